@@ -24,7 +24,7 @@
 #import <AppKit/AppKit.h>
 #import <Foundation/Foundation.h>
 
-@interface AppDelegate : NSObject <NSApplicationDelegate, NSMenuDelegate, NSTabViewDelegate>
+@interface AppDelegate : NSObject <NSApplicationDelegate, NSMenuDelegate, NSTabViewDelegate, NSWindowDelegate>
 
 @property (weak) IBOutlet NSWindow *window;
 @property (weak) IBOutlet NSWindow *top;
@@ -36,6 +36,7 @@
 @property (weak) IBOutlet NSButton *packageButton;
 @property (weak) IBOutlet NSButton *coreButton;
 @property (weak) IBOutlet NSButton *logicalButton;
+@property (weak) IBOutlet NSButton *clusterButton;
 
 @property (weak) IBOutlet NSButton *fastButton;
 @property (weak) IBOutlet NSButton *normalButton;
@@ -43,6 +44,8 @@
 
 @property (weak) IBOutlet NSButton *barButton;
 @property (weak) IBOutlet NSButton *dotButton;
+@property (weak) IBOutlet NSButton *stackedButton;
+@property (weak) IBOutlet NSButton *scaledButton;
 
 @property (weak) IBOutlet NSButton *solidButton;
 @property (weak) IBOutlet NSButton *strippedButton;
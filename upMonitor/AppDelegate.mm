@@ -36,6 +36,8 @@
 #import "CpuSampler.h"
 #import "CpuRenderer.h"
 #import "Top.h"
+#import "SamplerThread.h"
+#import "CpuRecorder.h"
 
 #pragma mark Constants
 
@@ -46,6 +48,11 @@
 
 #define TOP_COUNT                   (15)
 #define TOP_REFRESH_RATE            (2.5)
+#define EXITED_COUNT                (5)
+#define EXITED_SECONDS              (60)
+#define CPU_ADAPTIVE_RATE           (1.0)
+#define CPU_ADAPTIVE_THRESHOLD      (0.1)
+#define REPLAY_FAST_SPEED           (10.0)
 
 //   32 space bar  3.333984
 // 8201 thin space 1.669922
@@ -70,6 +77,16 @@ static NSString* TickLineKey = @"TickLineKey";
 static NSString* TickWidthKey = @"TickWidthKey";
 static NSString* AppearanceKey = @"AppearanceKey";
 static NSString* ThemeKey = @"ThemeKey";
+static NSString* StackedKey = @"StackedKey";
+static NSString* AdaptiveKey = @"AdaptiveKey";
+static NSString* ScaledKey = @"ScaledKey";
+static NSString* TopWorkersKey = @"TopWorkersKey";
+static NSString* GroupedKey = @"GroupedKey";
+static NSString* ExitedKey = @"ExitedKey";
+static NSString* TopRankCpuKey = @"TopRankCpuKey";
+static NSString* TopHalfLifeKey = @"TopHalfLifeKey";
+static NSString* RecordPathKey = @"RecordPathKey";
+static NSString* ReplayPathKey = @"ReplayPathKey";
 static NSString* LaunchOnStartupKey = @"LaunchOnStartupKey";
 
 #pragma mark - C APIs
@@ -117,21 +134,27 @@ static Boolean imageEqual(const void *value1, const void *value2)
 @implementation AppDelegate
 
 static CpuSummaryInfo cpu_info;
+static CpuSummaryInfo cpu_view;
 static CpuSummaryInfo cpu_sine_demo_info;
 static CpuSummaryInfo cpu_flat_demo_info;
 
+// with a ReplayPathKey recording, the preview panes replay it instead of the synthetic demos
+static CpuReplay* replay_sine = NULL;
+static CpuReplay* replay_flat = NULL;
+static CpuRecorder* recorder = NULL;
+
 static NSMenu* menu = nil;
 
 static NSTimer* timerCPU = nil;
 
-static NSTimer* timerTop = nil;
 static TopProcessSample_t topProcceses[TOP_COUNT];
 static NSMenuItem* topMenus[TOP_COUNT];
+// the sampler thread owns the TopInit context, the process inspector reads arguments through its own
+static TopContext_t* topArgsContext = NULL;
 static CFMutableDictionaryRef topNameHashTable;
 static CFMutableDictionaryRef topCpuHashTable;
 static CFMutableDictionaryRef topIconHashTable;
-
-static bool refreshTop = false;
+static CFMutableDictionaryRef topGenerationHashTable;
 
 static CGFloat tickHeight = 16.0;
 static CGFloat tickWidth = 3.0;
@@ -148,10 +171,23 @@ static bool stripped = true;
 static bool colored = false;
 static int theme = THEME_YELLOW;
 
+static bool stacked = false;
+static bool scaled = false;
+
 static float speed = 1.0f;
 
 static bool launch = false;
 
+static bool grouped = false;
+static NSMenuItem* groupedMenu = nil;
+
+// lists the names that exited in the last EXITED_SECONDS below the top processes
+static bool exited = false;
+static NSMenuItem* exitedMenu = nil;
+static TopExitedSample_t topExited[EXITED_COUNT];
+static NSMenuItem* exitedTitleMenu = nil;
+static NSMenuItem* exitedMenus[EXITED_COUNT];
+
 static NSDictionary* attributesStandard = nil;
 static NSDictionary* attributesGrey = nil;
 static NSDictionary* attributesWhite = nil;
@@ -163,7 +199,6 @@ static NSString *current_process_path = nil;
 
 volatile static BOOL fillLsofForProcessInProgress = NO;
 volatile static BOOL fillNmForProcessInProgress = NO;
-volatile static BOOL fillThreadsForProcessInProgress = NO;
 
 - (NSFileHandle*)launch:(NSTask *)task
 {
@@ -233,9 +268,12 @@ volatile static BOOL fillThreadsForProcessInProgress = NO;
   [self.packageButton setState:NSControlStateValueOff];
   [self.coreButton setState:NSControlStateValueOff];
   [self.logicalButton setState:NSControlStateValueOff];
+  [self.clusterButton setState:NSControlStateValueOff];
   
   [self.barButton setState:NSControlStateValueOff];
   [self.dotButton setState:NSControlStateValueOff];
+  [self.stackedButton setState:NSControlStateValueOff];
+  [self.scaledButton setState:NSControlStateValueOff];
   
   [self.solidButton setState:NSControlStateValueOff];
   [self.strippedButton setState:NSControlStateValueOff];
@@ -274,6 +312,17 @@ volatile static BOOL fillThreadsForProcessInProgress = NO;
       [self.thickButton setEnabled:YES];
     }
   }
+  else if (granularity == 3)
+  {
+    [self.clusterButton setState:NSControlStateValueOn];
+
+    if (bar)
+    {
+      [self.thinButton setEnabled:YES];
+      [self.standardButton setEnabled:YES];
+      [self.thickButton setEnabled:YES];
+    }
+  }
   else
   {
     [self.logicalButton setState:NSControlStateValueOn];
@@ -290,6 +339,7 @@ volatile static BOOL fillThreadsForProcessInProgress = NO;
 
     [self.solidButton setEnabled:YES];
     [self.strippedButton setEnabled:YES];
+    [self.stackedButton setEnabled:YES];
     if (granularity != 0)
     {
       [self.thinButton setEnabled:YES];
@@ -308,6 +358,7 @@ volatile static BOOL fillThreadsForProcessInProgress = NO;
 
     [self.solidButton setEnabled:NO];
     [self.strippedButton setEnabled:NO];
+    [self.stackedButton setEnabled:NO];
     [self.thinButton setEnabled:NO];
     [self.standardButton setEnabled:NO];
     [self.thickButton setEnabled:NO];
@@ -315,6 +366,15 @@ volatile static BOOL fillThreadsForProcessInProgress = NO;
     [self.greyButton setEnabled:NO];
   }
   
+  if (stacked)
+  {
+    [self.stackedButton setState:NSControlStateValueOn];
+  }
+  if (scaled)
+  {
+    [self.scaledButton setState:NSControlStateValueOn];
+  }
+  
   if (!stripped)
   {
     [self.solidButton setState:NSControlStateValueOn];
@@ -470,30 +530,36 @@ static BOOL spaces_init = NO;
   }
   if (!CFDictionaryContainsKey(topNameHashTable, key))
   {
-    NSMutableString* string = [NSMutableString stringWithFormat:@"%s", name];
-    int count = [self getSpacesCountFor:string width:target];
-    if (count <= 0)
-    {
-      [string deleteCharactersInRange:NSMakeRange([string length]-SIZE_DOTS, SIZE_DOTS)];
-      [string insertString:[NSString stringWithCharacters:&dots[0] length:SIZE_DOTS] atIndex:[string length]];
-      while (count <= 0)
-      {
-        [string deleteCharactersInRange:NSMakeRange([string length]-SIZE_DOTS, 1)];
-        count = [self getSpacesCountFor:string width:target];
-      }
-    }
+    NSString* string = [self getPaddedStringForName:name width:target];
+    CFDictionarySetValue(topNameHashTable, key, (__bridge const void *)(string));
+  }
+  return (NSString*)CFDictionaryGetValue(topNameHashTable, key);
+  //return [NSString stringWithFormat:@"%--s %*c %6.1f%%", name, spaces, SPACE_THIN, cpu];
+}
 
-    size_t length = [string length];
-    if (length > SIZE_SPACES)
+// the name cut down or padded to target, without the cache of getStringForName
+- (NSString*)getPaddedStringForName:(char*)name width:(CGFloat)target
+{
+  NSMutableString* string = [NSMutableString stringWithFormat:@"%s", name];
+  int count = [self getSpacesCountFor:string width:target];
+  if (count <= 0)
+  {
+    [string deleteCharactersInRange:NSMakeRange([string length]-SIZE_DOTS, SIZE_DOTS)];
+    [string insertString:[NSString stringWithCharacters:&dots[0] length:SIZE_DOTS] atIndex:[string length]];
+    while (count <= 0)
     {
-      length = SIZE_SPACES;
+      [string deleteCharactersInRange:NSMakeRange([string length]-SIZE_DOTS, 1)];
+      count = [self getSpacesCountFor:string width:target];
     }
-    [string insertString:[NSString stringWithCharacters:&spaces[0] length:count] atIndex:length];
+  }
 
-    CFDictionarySetValue(topNameHashTable, key, (__bridge const void *)(string));
+  size_t length = [string length];
+  if (length > SIZE_SPACES)
+  {
+    length = SIZE_SPACES;
   }
-  return (NSString*)CFDictionaryGetValue(topNameHashTable, key);
-  //return [NSString stringWithFormat:@"%--s %*c %6.1f%%", name, spaces, SPACE_THIN, cpu];
+  [string insertString:[NSString stringWithCharacters:&spaces[0] length:count] atIndex:length];
+  return string;
 }
 
 - (NSImage*)getIconForPid:(pid_t)pid size:(NSSize)size
@@ -534,6 +600,24 @@ static BOOL spaces_init = NO;
   return (NSImage*)CFDictionaryGetValue(topIconHashTable, key);
 }
 
+// pids get reused, the cached name and icon of a pid only hold for the process generation they were made for
+- (void)validateCachesForPid:(pid_t)pid generation:(uint32_t)generation
+{
+  const void* key = (const void *)(uintptr_t)pid;
+  if (key == NULL)
+  {
+    key = (const void*)0xffffffff;
+  }
+  const void* value = NULL;
+  if (CFDictionaryGetValueIfPresent(topGenerationHashTable, key, &value) && ((uint32_t)(uintptr_t)value == generation))
+  {
+    return;
+  }
+  CFDictionaryRemoveValue(topNameHashTable, key);
+  CFDictionaryRemoveValue(topIconHashTable, key);
+  CFDictionarySetValue(topGenerationHashTable, key, (const void *)(uintptr_t)generation);
+}
+
 - (void)updateMenuTopFor:(NSMenuItem*)item name:(char*)name pid:(pid_t)pid path:(char*)path cpu:(double)cpu width:(CGFloat)target
 {
   NSString* stringName = [self getStringForName:name pid:pid width:target];
@@ -560,13 +644,39 @@ static BOOL spaces_init = NO;
     //NSImage *appIcon = [ws iconForFileType:NSFileTypeForHFSTypeCode(kGenericApplicationIcon)];
     
     TopProcessSample_t* sample = &topProcceses[i];
-    [self updateMenuTopFor:topMenus[i] name:sample->name pid:sample->pid path:NULL cpu:sample->cpu width:NAME_STR_SPACE_TARGET];
+    [self validateCachesForPid:sample->pid generation:sample->generation];
+    // a group shows the cpu of the app together with all of its helpers
+    double cpu = grouped ? sample->cpu_tree : sample->cpu;
+    [self updateMenuTopFor:topMenus[i] name:sample->name pid:sample->pid path:NULL cpu:cpu width:NAME_STR_SPACE_TARGET];
     [topMenus[i] setTag:sample->pid];
   }
   
   [menu update];
 }
 
+- (void)updateMenuExited
+{
+  int count = exited ? SamplerThreadReadExited(topExited, EXITED_COUNT) : 0;
+  [exitedTitleMenu setHidden:!exited];
+  for (int i=0; i<EXITED_COUNT; i++)
+  {
+    NSMenuItem* item = exitedMenus[i];
+    [item setHidden:(i >= count)];
+    if (i < count)
+    {
+      // the processes are gone, so there is no pid to cache the name or look up an icon for
+      TopExitedSample_t* sample = &topExited[i];
+      NSString* stringName = [self getPaddedStringForName:sample->name width:NAME_STR_SPACE_TARGET];
+      NSString* stringCpu = [self getStringForCpu:sample->cpu width:CPU_STR_SPACE_TARGET];
+      [item setTitle: [NSString stringWithFormat:@"%@ %@", stringName, stringCpu]];
+
+      NSMutableAttributedString* title = [[NSMutableAttributedString alloc] initWithString:[item title] attributes:attributesGrey];
+      [title setAttributes:attributesWhite range:NSMakeRange([stringName length], [stringCpu length]+1)];
+      [item setAttributedTitle:title];
+    }
+  }
+}
+
 - (void)setupMenus
 {
   if (!spaces_init)
@@ -619,10 +729,33 @@ static BOOL spaces_init = NO;
     {
       topMenus[i] = [menu addItemWithTitle:@"" action:@selector(selectPid:) keyEquivalent:@""];
     }
+
+    exitedTitleMenu = [menu addItemWithTitle:@"EXITED IN THE LAST MINUTE" action:nil keyEquivalent:@""];
+    [exitedTitleMenu setAttributedTitle:[[NSAttributedString alloc] initWithString:[exitedTitleMenu title] attributes:attributesStandardCenter]];
+    [exitedTitleMenu setHidden:YES];
+    NSImage* blankIcon = [[NSImage alloc] initWithSize:NSMakeSize(MENU_ICON_SIZE, MENU_ICON_SIZE)];
+    for (int i=0; i<EXITED_COUNT; i++)
+    {
+      exitedMenus[i] = [menu addItemWithTitle:@"" action:nil keyEquivalent:@""];
+      [exitedMenus[i] setImage:blankIcon];
+      [exitedMenus[i] setHidden:YES];
+    }
   }
   
   [menu addItem:[NSMenuItem separatorItem]];
 
+  {
+    groupedMenu = [menu addItemWithTitle:@"Group by App" action:@selector(groupedClicked:) keyEquivalent:@""];
+    [groupedMenu setAttributedTitle:[[NSAttributedString alloc] initWithString:[groupedMenu title] attributes:attributesStandard]];
+    [groupedMenu setState:grouped ? NSControlStateValueOn : NSControlStateValueOff];
+
+    exitedMenu = [menu addItemWithTitle:@"Show Exited" action:@selector(exitedClicked:) keyEquivalent:@""];
+    [exitedMenu setAttributedTitle:[[NSAttributedString alloc] initWithString:[exitedMenu title] attributes:attributesStandard]];
+    [exitedMenu setState:exited ? NSControlStateValueOn : NSControlStateValueOff];
+  }
+
+  [menu addItem:[NSMenuItem separatorItem]];
+
 //  {
 //    NSMenuItem* item = [menu addItemWithTitle:@"Process Explorer" action:@selector(processExplorer:) keyEquivalent:@""];
 //    [item setAttributedTitle:[[NSAttributedString alloc] initWithString:[item title] attributes:attributesStandard]];
@@ -685,7 +818,7 @@ static BOOL spaces_init = NO;
 
 - (void)renderMenubarWithLight:(BOOL)light
 {
-  CpuSamplerUpdate(&cpu_info);
+  CpuSamplerRead(&cpu_info, &cpu_view);
   static NSImage* image = nil;
   {
     image = self.statusItem.button.image;
@@ -704,7 +837,7 @@ static BOOL spaces_init = NO;
     [image lockFocus];
     {
       CGContextRef ctx = [[NSGraphicsContext currentContext] CGContext];
-      CpuRender(&cpu_info, ctx, light, granularity, bar, stripped, colored, tickWidth, tickTotalWidth, imageWidth, theme);
+      CpuRender(&cpu_view, ctx, light, granularity, bar, stripped, colored, stacked, scaled, tickWidth, tickTotalWidth, imageWidth, theme);
     }
     [image unlockFocus];
   }
@@ -731,7 +864,7 @@ static BOOL spaces_init = NO;
     [image lockFocus];
     {
       CGContextRef ctx = [[NSGraphicsContext currentContext] CGContext];
-      CpuRender(&cpu_info, ctx, light, granularity, bar, stripped, colored, tickWidth, tickTotalWidth, imageWidth, theme);
+      CpuRender(&cpu_view, ctx, light, granularity, bar, stripped, colored, stacked, scaled, tickWidth, tickTotalWidth, imageWidth, theme);
     }
     [image unlockFocus];
   }
@@ -740,7 +873,14 @@ static BOOL spaces_init = NO;
 
 - (void)renderPrefsSinWithLight:(BOOL)light
 {
-  CpuSamplerSineDemoUpdate(&cpu_sine_demo_info, speed);
+  if (replay_sine != NULL)
+  {
+    CpuReplayUpdate(replay_sine, &cpu_sine_demo_info, 1.0);
+  }
+  else
+  {
+    CpuSamplerSineDemoUpdate(&cpu_sine_demo_info, speed);
+  }
 
   [self.sineDemoView setBoundsSize:NSMakeSize(imageWidth, tickHeight)];
   [self.sineDemoView setFrameSize:NSMakeSize(imageWidth, tickHeight)];
@@ -760,7 +900,7 @@ static BOOL spaces_init = NO;
     [image lockFocus];
     {
       CGContextRef ctx = [[NSGraphicsContext currentContext] CGContext];
-      CpuRender(&cpu_sine_demo_info, ctx, light, granularity, bar, stripped, colored, tickWidth, tickTotalWidth, imageWidth, theme);
+      CpuRender(&cpu_sine_demo_info, ctx, light, granularity, bar, stripped, colored, stacked, scaled, tickWidth, tickTotalWidth, imageWidth, theme);
     }
     [image unlockFocus];
   }
@@ -769,7 +909,14 @@ static BOOL spaces_init = NO;
 
 - (void)renderPrefsFlatWithLight:(BOOL)light
 {
-  CpuSamplerFlatDemoUpdate(&cpu_flat_demo_info, speed);
+  if (replay_flat != NULL)
+  {
+    CpuReplayUpdate(replay_flat, &cpu_flat_demo_info, REPLAY_FAST_SPEED);
+  }
+  else
+  {
+    CpuSamplerFlatDemoUpdate(&cpu_flat_demo_info, speed);
+  }
   
   [self.flatDemoView setBoundsSize:NSMakeSize(imageWidth, tickHeight)];
   [self.flatDemoView setFrameSize:NSMakeSize(imageWidth, tickHeight)];
@@ -789,7 +936,7 @@ static BOOL spaces_init = NO;
     [image lockFocus];
     {
       CGContextRef ctx = [[NSGraphicsContext currentContext] CGContext];
-      CpuRender(&cpu_flat_demo_info, ctx, light, granularity, bar, stripped, colored, tickWidth, tickTotalWidth, imageWidth, theme);
+      CpuRender(&cpu_flat_demo_info, ctx, light, granularity, bar, stripped, colored, stacked, scaled, tickWidth, tickTotalWidth, imageWidth, theme);
     }
     [image unlockFocus];
   }
@@ -862,27 +1009,17 @@ static BOOL spaces_init = NO;
 
 - (void)updateTop:(id)sender
 {
-  if (refreshTop)
-  {
-    TopSample();
-    int counter = 0;
-    const TopProcessSample_t *psample = TopIterate();
-    while (psample != NULL)
-    {
-      //if (psample->pid > 1)
-      {
-        topProcceses[counter] = *psample;
-        //printf("   %6d %30s %5.1f%% %20s\n", psample->pid, psample->name, psample->cpu, TopGetUsername(psample->uid));
-        if (++counter >= TOP_COUNT)
-        {
-          break;
-        }
-      }
-      psample = TopIterate();
-    }
-    //printf("\n");
-    [self performSelectorOnMainThread:@selector(updateMenuTop) withObject:nil waitUntilDone:YES];
-  }
+  SamplerThreadReadTop(topProcceses, TOP_COUNT, NULL);
+  [self updateMenuExited];
+  [self updateMenuTop];
+  [self updateThreads];
+}
+
+// called on the top sampler thread whenever it publishes a new snapshot
+static void topSampled(void* context)
+{
+  AppDelegate* delegate = (__bridge AppDelegate*)context;
+  [delegate performSelectorOnMainThread:@selector(updateTop:) withObject:nil waitUntilDone:NO];
 }
 
 - (void)setupStatusItem
@@ -914,6 +1051,14 @@ static BOOL spaces_init = NO;
   [[NSUserDefaults standardUserDefaults] registerDefaults:@{TickWidthKey:@3.0}];
   [[NSUserDefaults standardUserDefaults] registerDefaults:@{AppearanceKey:@1}];
   [[NSUserDefaults standardUserDefaults] registerDefaults:@{ThemeKey:@2}];
+  [[NSUserDefaults standardUserDefaults] registerDefaults:@{StackedKey:@0}];
+  [[NSUserDefaults standardUserDefaults] registerDefaults:@{AdaptiveKey:@1}];
+  [[NSUserDefaults standardUserDefaults] registerDefaults:@{ScaledKey:@0}];
+  [[NSUserDefaults standardUserDefaults] registerDefaults:@{TopWorkersKey:@1}];
+  [[NSUserDefaults standardUserDefaults] registerDefaults:@{GroupedKey:@0}];
+  [[NSUserDefaults standardUserDefaults] registerDefaults:@{ExitedKey:@0}];
+  [[NSUserDefaults standardUserDefaults] registerDefaults:@{TopRankCpuKey:@(TOP_CPU_SMOOTH)}];
+  [[NSUserDefaults standardUserDefaults] registerDefaults:@{TopHalfLifeKey:@5.0}];
   [[NSUserDefaults standardUserDefaults] registerDefaults:@{LaunchOnStartupKey:@0}];
 
   granularity = (int)[[NSUserDefaults standardUserDefaults] integerForKey:GranularityKey];
@@ -923,25 +1068,79 @@ static BOOL spaces_init = NO;
   tickWidth = [[NSUserDefaults standardUserDefaults] doubleForKey:TickWidthKey];
   colored = [[NSUserDefaults standardUserDefaults] boolForKey:AppearanceKey];
   theme = (int)[[NSUserDefaults standardUserDefaults] integerForKey:ThemeKey];
+  stacked = [[NSUserDefaults standardUserDefaults] boolForKey:StackedKey];
+  scaled = [[NSUserDefaults standardUserDefaults] boolForKey:ScaledKey];
   launch = [[NSUserDefaults standardUserDefaults] boolForKey:LaunchOnStartupKey];
+  grouped = [[NSUserDefaults standardUserDefaults] boolForKey:GroupedKey];
+  exited = [[NSUserDefaults standardUserDefaults] boolForKey:ExitedKey];
 
   [self updateRendererParameters];
   [self updateUI];
 }
 
+// RecordPathKey appends every sample to a recording, ReplayPathKey plays one back in the
+// preview panes, at real speed in the left one and accelerated in the right one
+- (void)setupReplay
+{
+  NSString* replayPath = [[NSUserDefaults standardUserDefaults] stringForKey:ReplayPathKey];
+  if (replayPath != nil)
+  {
+    replay_sine = CpuReplayOpen([replayPath fileSystemRepresentation], &cpu_sine_demo_info);
+    replay_flat = CpuReplayOpen([replayPath fileSystemRepresentation], &cpu_flat_demo_info);
+  }
+  if (replay_sine == NULL)
+  {
+    CpuSamplerSineDemoInit(&cpu_sine_demo_info);
+  }
+  if (replay_flat == NULL)
+  {
+    CpuSamplerFlatDemoInit(&cpu_flat_demo_info);
+  }
+
+  NSString* recordPath = [[NSUserDefaults standardUserDefaults] stringForKey:RecordPathKey];
+  if (recordPath != nil)
+  {
+    recorder = CpuRecorderOpen([recordPath fileSystemRepresentation], &cpu_info, TOP_COUNT);
+    SamplerThreadSetRecorder(recorder);
+  }
+}
+
 - (void)setupTimers
 {
+  double refresh = [[NSUserDefaults standardUserDefaults] doubleForKey:RefreshKey];
+  BOOL adaptive = [[NSUserDefaults standardUserDefaults] boolForKey:AdaptiveKey];
+  SamplerThreadSetCpuInterval(refresh);
+  SamplerThreadSetCpuAdaptive(adaptive, MAX(refresh, CPU_ADAPTIVE_RATE), CPU_ADAPTIVE_THRESHOLD);
+
+  [self setupRenderTimer:nil];
+}
+
+// the timer only renders, sampling happens on the sampler threads, so it follows the
+// current (possibly adaptive) cpu rate rather than the preference; the preference panes
+// animate the replay and demos on their own, so they keep the preference while shown
+- (void)setupRenderTimer:(id)sender
+{
+  double refresh = SamplerThreadGetCpuInterval();
+  if ([self.window isVisible])
+  {
+    refresh = [[NSUserDefaults standardUserDefaults] doubleForKey:RefreshKey];
+  }
+  if ((timerCPU != nil) && ([timerCPU timeInterval] == refresh))
+  {
+    return;
+  }
   [timerCPU invalidate];
   timerCPU = nil;
-  timerCPU = [NSTimer scheduledTimerWithTimeInterval:[[NSUserDefaults standardUserDefaults] doubleForKey:RefreshKey] target:self selector:@selector(updateCPU:) userInfo:nil repeats:YES];
+  timerCPU = [NSTimer scheduledTimerWithTimeInterval:refresh target:self selector:@selector(updateCPU:) userInfo:nil repeats:YES];
   [[NSRunLoop currentRunLoop] addTimer:timerCPU forMode:NSEventTrackingRunLoopMode];
   [[NSRunLoop currentRunLoop] addTimer:timerCPU forMode:NSModalPanelRunLoopMode];
+}
 
-  [timerTop invalidate];
-  timerTop = nil;
-  timerTop = [NSTimer scheduledTimerWithTimeInterval:TOP_REFRESH_RATE target:self selector:@selector(updateTop:) userInfo:nil repeats:YES];
-  [[NSRunLoop currentRunLoop] addTimer:timerTop forMode:NSEventTrackingRunLoopMode];
-  [[NSRunLoop currentRunLoop] addTimer:timerTop forMode:NSModalPanelRunLoopMode];
+// called on the cpu sampler thread whenever the adaptive rate changes
+static void cpuRateChanged(void* context)
+{
+  AppDelegate* delegate = (__bridge AppDelegate*)context;
+  [delegate performSelectorOnMainThread:@selector(setupRenderTimer:) withObject:nil waitUntilDone:NO];
 }
 
 - (BOOL)fillDescForProcess:(NSString*)name
@@ -1128,55 +1327,47 @@ static BOOL spaces_init = NO;
   fillNmForProcessInProgress = NO;
 }
 
-- (void)fillThreadsForProcess:(NSNumber*)pid_number
+// the sampler thread samples the threads of the watched pid along with every top sample
+- (void)updateThreads
 {
-  if (fillThreadsForProcessInProgress)
+  static TopThreadSample_t threads[SAMPLER_THREADS_MAX];
+  pid_t pid = 0;
+  int count = SamplerThreadReadThreads(threads, SAMPLER_THREADS_MAX, &pid);
+  if ((pid == 0) || (pid != [current_process_pid intValue]))
   {
     return;
   }
-  fillThreadsForProcessInProgress = YES;
-  
-  NSString *appPath = @"/usr/bin/sample";
-  pid_t pid = [pid_number intValue];
-  NSArray<NSString *> *arguments = [NSArray arrayWithObjects:[NSString stringWithFormat:@"%d", pid], nil];
-  //NSArray<NSString *> *arguments = @[];
 
+  NSMutableString* string = [NSMutableString stringWithFormat:@"\n%-20s %8s %6s  %-14s %s\n\n", "thread", "cpu", "prio", "state", "name"];
+  for (int i=0; i<count; i++)
   {
-    NSTask *task = [[NSTask alloc] init];
-    [task setLaunchPath:appPath];
-    [task setArguments:arguments];
-    
-    NSFileHandle *outputFileHandle = [self launch:task];
-    if (outputFileHandle != nil)
+    TopThreadSample_t* thread = &threads[i];
+    const char* state = "unknown";
+    switch (thread->state)
     {
-      int wait = 10;
-      for (int i=0; i<=wait; i++)
-      {
-        [NSThread sleepForTimeInterval:1];
-        NSString *string = [NSString stringWithFormat:@"\nsampling ends in %d seconds ...", (10-i)];
-        [self.procThreadsTextView performSelectorOnMainThread:@selector(setString:) withObject:string waitUntilDone:NO];
-      }
-      
-//      while ([task isRunning])
-//      {
-//        [NSThread sleepForTimeInterval:1];
-//        NSString *string = [NSString stringWithFormat:@"\nstill sampling ..."];
-//        [self.procThreadsTextView performSelectorOnMainThread:@selector(setString:) withObject:string waitUntilDone:NO];
-//      }
-      
-      NSData *outputData = [outputFileHandle readDataToEndOfFile];
-      NSString *output = [[NSString alloc] initWithData:outputData encoding:NSUTF8StringEncoding];
-      [self.procThreadsTextView performSelectorOnMainThread:@selector(setString:) withObject:output waitUntilDone:NO];
+      case TH_STATE_RUNNING: state = "running"; break;
+      case TH_STATE_STOPPED: state = "stopped"; break;
+      case TH_STATE_WAITING: state = "waiting"; break;
+      case TH_STATE_UNINTERRUPTIBLE: state = "uninterruptible"; break;
+      case TH_STATE_HALTED: state = "halted"; break;
+      default: break;
     }
-    else
-    {
-      [self.procThreadsTextView performSelectorOnMainThread:@selector(setString:) withObject:@"N/A (error)" waitUntilDone:NO];
-    }
-    
-    [task terminate];
+    [string appendFormat:@"%-20llu %7.1f%% %6d  %-14s %s\n", thread->tid, thread->cpu, thread->priority, state, thread->name];
+  }
+  [self.procThreadsTextView setString:string];
+}
+
+- (void)windowWillClose:(NSNotification *)notification
+{
+  if ([notification object] == self.top)
+  {
+    SamplerThreadSetThreadsPid(0);
+  }
+  else if ([notification object] == self.window)
+  {
+    // the window is still visible until this returns
+    [self performSelector:@selector(setupRenderTimer:) withObject:nil afterDelay:0];
   }
-  
-  fillThreadsForProcessInProgress = NO;
 }
 
 #pragma mark - Public APIs
@@ -1196,28 +1387,52 @@ static BOOL spaces_init = NO;
       CFDictionaryValueCallBacks tableCallbacks = { 0, imageRetain, imageFree, NULL, imageEqual };
       topIconHashTable = CFDictionaryCreateMutable(NULL, 0, NULL, &tableCallbacks);
     }
+
+    topGenerationHashTable = CFDictionaryCreateMutable(NULL, 0, NULL, NULL);
     
     CpuRenderInit();
+#ifdef CPU_SAMPLER_BENCHMARK
+    CpuSamplerBenchmark();
+#endif
+#ifdef CPU_RECORDER_TEST
+    CpuRecorderTest();
+#endif
+#ifdef TOP_BENCHMARK
+    TopBenchmark();
+#endif
     CpuSamplerInit(&cpu_info);
-    CpuSamplerSineDemoInit(&cpu_sine_demo_info);
-    CpuSamplerSineDemoInit(&cpu_flat_demo_info);
+    CpuSamplerViewInit(&cpu_view, &cpu_info);
     TopInit();
+    topArgsContext = TopContextCreate();
     
     [self setupPreferences];
+    [self setupReplay];
+    TopSetWorkers((int)[[NSUserDefaults standardUserDefaults] integerForKey:TopWorkersKey]);
+    // the menu ranks on smoothed cpu, so bursts do not reshuffle it on every refresh
+    TopSetRankCpu((int)[[NSUserDefaults standardUserDefaults] integerForKey:TopRankCpuKey]);
+    TopSetHalfLife([[NSUserDefaults standardUserDefaults] doubleForKey:TopHalfLifeKey]);
+    SamplerThreadStart(&cpu_info, [[NSUserDefaults standardUserDefaults] doubleForKey:RefreshKey], TOP_REFRESH_RATE, TOP_COUNT);
+    SamplerThreadSetTopCallback(topSampled, (__bridge void*)self);
+    SamplerThreadSetTopGrouped(grouped);
+    SamplerThreadSetTopExited(exited ? EXITED_SECONDS : 0);
+    SamplerThreadSetCpuCallback(cpuRateChanged, (__bridge void*)self);
     [self setupStatusItem];
     [self setupMenus];
     [self setupTimers];
+    [self.top setDelegate:self];
+    [self.window setDelegate:self];
     
-    refreshTop = true;
-    {
-      [timerTop fire];
-    }
-    refreshTop = false;
+    SamplerThreadRequestTop();
   }
 }
 
 - (void)applicationWillTerminate:(NSNotification *)aNotification
 {
+  SamplerThreadStop();
+  CpuRecorderClose(recorder);
+  recorder = NULL;
+  TopContextDestroy(topArgsContext);
+  topArgsContext = NULL;
   //[[NSUserDefaults standardUserDefaults] synchronize];
 }
 
@@ -1228,6 +1443,7 @@ static BOOL spaces_init = NO;
   [self.window center];
   [self.window orderFrontRegardless];
   [self.window makeKeyWindow];
+  [self setupRenderTimer:nil];
 }
 
 - (void)processExplorer:(id)sender
@@ -1263,8 +1479,34 @@ static BOOL spaces_init = NO;
   [icon setSize:NSMakeSize(TOP_ICON_SIZE, TOP_ICON_SIZE)];
   [self.procAppIcon setImage:icon];
   
-  TopProcessInfo_t* info = TopGetArgs(pid);
-  TopProcessSample_t* sample = TopGetSample(pid);
+  if (topArgsContext == NULL)
+  {
+    return;
+  }
+  TopProcessInfo_t* info = TopContextGetArgs(topArgsContext, pid);
+  
+  // the sampler thread owns the Top tables, use the copy published for the menu
+  TopProcessSample_t process;
+  TopProcessSample_t* sample = NULL;
+  for (int i=0; i<TOP_COUNT; i++)
+  {
+    if (topProcceses[i].pid == pid)
+    {
+      process = topProcceses[i];
+      sample = &process;
+      break;
+    }
+  }
+  if (sample == NULL)
+  {
+    // a refresh dropped it from the menu copy, sample it on the inspector's own context
+    TopContextSample(topArgsContext);
+    sample = TopContextGetSample(topArgsContext, pid);
+    if (sample == NULL)
+    {
+      return;
+    }
+  }
   current_process_path = [NSString stringWithFormat:@"%s", info->command];
   NSString* name = [NSString stringWithFormat:@"%s", info->name];
   
@@ -1345,6 +1587,24 @@ static BOOL spaces_init = NO;
   }];
 }
 
+- (void)groupedClicked:(id)sender
+{
+  grouped = !grouped;
+  [[NSUserDefaults standardUserDefaults] setBool:grouped forKey:GroupedKey];
+  [groupedMenu setState:grouped ? NSControlStateValueOn : NSControlStateValueOff];
+  SamplerThreadSetTopGrouped(grouped);
+  SamplerThreadRequestTop();
+}
+
+- (void)exitedClicked:(id)sender
+{
+  exited = !exited;
+  [[NSUserDefaults standardUserDefaults] setBool:exited forKey:ExitedKey];
+  [exitedMenu setState:exited ? NSControlStateValueOn : NSControlStateValueOff];
+  SamplerThreadSetTopExited(exited ? EXITED_SECONDS : 0);
+  SamplerThreadRequestTop();
+}
+
 - (void)launchActivityMonitor:(id)sender
 {
   NSString *appPath = @"/System/Applications/Utilities/Activity Monitor.app";
@@ -1378,6 +1638,15 @@ static BOOL spaces_init = NO;
   [self updateUI];
 }
 
+- (IBAction)clusterButtonClicked:(id)sender
+{
+  granularity = 3;
+  tickWidth = [[NSUserDefaults standardUserDefaults] doubleForKey:TickWidthKey];
+  [[NSUserDefaults standardUserDefaults] setDouble:granularity forKey:GranularityKey];
+  
+  [self updateUI];
+}
+
 - (IBAction)fastButtonClicked:(id)sender
 {
   speed = 1.0f;
@@ -1429,6 +1698,22 @@ static BOOL spaces_init = NO;
   [self updateUI];
 }
 
+- (IBAction)stackedButtonClicked:(id)sender
+{
+  stacked = !stacked;
+  [[NSUserDefaults standardUserDefaults] setBool:stacked forKey:StackedKey];
+  
+  [self updateUI];
+}
+
+- (IBAction)scaledButtonClicked:(id)sender
+{
+  scaled = !scaled;
+  [[NSUserDefaults standardUserDefaults] setBool:scaled forKey:ScaledKey];
+  
+  [self updateUI];
+}
+
 - (IBAction)solidButtonClicked:(id)sender
 {
   stripped = false;
@@ -1543,12 +1828,12 @@ static BOOL spaces_init = NO;
 
 - (void)menuWillOpen:(NSMenu *)menu
 {
-  refreshTop = true;
+  SamplerThreadSetTopEnabled(TRUE);
 }
 
 - (void)menuDidClose:(NSMenu *)menu
 {
-  refreshTop = false;
+  SamplerThreadSetTopEnabled(FALSE);
 }
 
 - (void)tabView:(NSTabView *)tabView didSelectTabViewItem:(nullable NSTabViewItem *)tabViewItem
@@ -1568,12 +1853,14 @@ static BOOL spaces_init = NO;
     }
     case 5:
     {
-      [self performSelectorInBackground:@selector(fillThreadsForProcess:) withObject:current_process_pid];
-      break;
+      SamplerThreadSetThreadsPid([current_process_pid intValue]);
+      SamplerThreadRequestTop();
+      return;
     }
     default:
       break;
   }
+  SamplerThreadSetThreadsPid(0);
 }
 
 @end
@@ -0,0 +1,618 @@
+// The MIT License (MIT)
+
+// Copyright 2022 HalfMarble LLC
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "CpuRecorder.h"
+
+#define CPU_RECORD_ALIGN(size) (((size) + 7) & ~(size_t)7)
+#define CPU_RECORD_FIXED       (65535.0)
+// a larger jump forward between two records of a file without session records is a gap between runs
+#define CPU_REPLAY_GAP         (10*1000000000ULL)
+
+struct CpuRecorder
+{
+  int            fd;
+  natural_t      count;
+  int            topCount;
+  size_t         cpuSize;     // payload bytes of a cpu record
+  unsigned char* buffer;      // one record, reused for every write
+};
+
+struct CpuReplay
+{
+  int                  fd;
+  const unsigned char* map;
+  size_t               size;
+  natural_t            count;
+  size_t               first;     // offset of the first record
+  size_t               cursor;    // offset of the next record
+  size_t               top;       // offset of the latest top record replayed, 0 for none
+  uint64_t             base;      // timestamp the current session starts at
+  uint64_t             origin;    // replayed ns at which the current session starts
+  uint64_t             last;      // timestamp of the latest record replayed
+  uint64_t             position;  // replayed ns since the first record
+  uint64_t             wall;      // monotonic ns of the last update
+};
+
+static size_t _CpuRecordCpuSize(natural_t count)
+{
+  return CPU_RECORD_ALIGN(((2+CPU_LOAD_STATES)*count*sizeof(uint16_t)) + count);
+}
+
+static size_t _CpuRecordPrefixSize(natural_t count)
+{
+  return sizeof(CpuRecordHeader) + CPU_RECORD_ALIGN(count*sizeof(uint16_t));
+}
+
+static inline uint16_t _CpuRecordFixed(double value)
+{
+  if (value <= 0.0)
+  {
+    return 0;
+  }
+  if (value >= 1.0)
+  {
+    return (uint16_t)CPU_RECORD_FIXED;
+  }
+  return (uint16_t)((value * CPU_RECORD_FIXED) + 0.5);
+}
+
+static inline uint16_t _CpuRecordMHz(double mhz)
+{
+  if (mhz <= 0.0)
+  {
+    return 0;
+  }
+  return (mhz >= 65535.0) ? 65535 : (uint16_t)(mhz + 0.5);
+}
+
+static uint64_t _CpuRecordNanos(clockid_t clock)
+{
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static boolean_t _CpuRecordWrite(int fd, const void* data, size_t size)
+{
+  const char* p = (const char*)data;
+  while (size > 0)
+  {
+    ssize_t written = write(fd, p, size);
+    if (written < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("write recording error");
+      return FALSE;
+    }
+    p += written;
+    size -= (size_t)written;
+  }
+  return TRUE;
+}
+
+static boolean_t _CpuRecordCompatible(const CpuRecordHeader* header, natural_t count)
+{
+  return (header->magic == CPU_RECORD_MAGIC) && (header->version == CPU_RECORD_VERSION) &&
+         ((count == 0) || (header->countLogical == count)) && (header->countStates == CPU_LOAD_STATES) &&
+         (header->topSampleSize == sizeof(TopProcessSample_t));
+}
+
+// drops a torn record left behind by a crash, so that new records are appended to a valid stream
+static void _CpuRecorderTrim(int fd, size_t offset, size_t size)
+{
+  CpuRecord record;
+  while (offset + sizeof(CpuRecord) <= size)
+  {
+    if (pread(fd, &record, sizeof(CpuRecord), (off_t)offset) != sizeof(CpuRecord))
+    {
+      break;
+    }
+    if (offset + sizeof(CpuRecord) + record.size > size)
+    {
+      break;
+    }
+    offset += sizeof(CpuRecord) + record.size;
+  }
+  if (offset < size)
+  {
+    if (ftruncate(fd, (off_t)offset) != 0)
+    {
+      perror("ftruncate recording error");
+    }
+  }
+}
+
+CpuRecorder* CpuRecorderOpen(const char* path, const CpuSummaryInfo* cpu_info, int topCount)
+{
+  int fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+  if (fd < 0)
+  {
+    perror("open recording error");
+    return NULL;
+  }
+
+  natural_t count = cpu_info->countLogical;
+  size_t prefix = _CpuRecordPrefixSize(count);
+  struct stat st;
+  if (fstat(fd, &st) != 0)
+  {
+    perror("fstat recording error");
+    close(fd);
+    return NULL;
+  }
+  if (st.st_size == 0)
+  {
+    unsigned char* buffer = (unsigned char*)calloc(1, prefix);
+    CpuRecordHeader* header = (CpuRecordHeader*)buffer;
+    header->magic = CPU_RECORD_MAGIC;
+    header->version = CPU_RECORD_VERSION;
+    header->countLogical = count;
+    header->countStates = CPU_LOAD_STATES;
+    header->topSampleSize = sizeof(TopProcessSample_t);
+    header->created = _CpuRecordNanos(CLOCK_REALTIME);
+    uint16_t* mhzMax = (uint16_t*)(buffer + sizeof(CpuRecordHeader));
+    for (natural_t i=0; (i<count) && (cpu_info->mhzMax != NULL); i++)
+    {
+      mhzMax[i] = _CpuRecordMHz(cpu_info->mhzMax[i]);
+    }
+    boolean_t written = _CpuRecordWrite(fd, buffer, prefix);
+    free(buffer);
+    if (!written)
+    {
+      close(fd);
+      return NULL;
+    }
+  }
+  else
+  {
+    CpuRecordHeader header;
+    if ((pread(fd, &header, sizeof(header), 0) != sizeof(header)) || !_CpuRecordCompatible(&header, count))
+    {
+      fprintf(stderr, "recording %s is not compatible with this machine\n", path);
+      close(fd);
+      return NULL;
+    }
+    _CpuRecorderTrim(fd, prefix, (size_t)st.st_size);
+  }
+
+  CpuRecorder* recorder = (CpuRecorder*)calloc(1, sizeof(CpuRecorder));
+  recorder->fd = fd;
+  recorder->count = count;
+  recorder->topCount = topCount;
+  recorder->cpuSize = _CpuRecordCpuSize(count);
+  size_t topSize = CPU_RECORD_ALIGN((2*sizeof(uint32_t)) + (topCount*sizeof(TopProcessSample_t)));
+  recorder->buffer = (unsigned char*)calloc(1, sizeof(CpuRecord) + ((recorder->cpuSize > topSize) ? recorder->cpuSize : topSize));
+
+  // the monotonic clock of the records that follow has nothing to do with the one of earlier runs
+  CpuRecord* record = (CpuRecord*)recorder->buffer;
+  record->type = CPU_RECORD_SESSION;
+  record->size = sizeof(uint64_t);
+  record->timestamp = _CpuRecordNanos(CLOCK_MONOTONIC);
+  uint64_t created = _CpuRecordNanos(CLOCK_REALTIME);
+  memcpy(record+1, &created, sizeof(created));
+  _CpuRecordWrite(fd, record, sizeof(CpuRecord) + sizeof(uint64_t));
+  return recorder;
+}
+
+void CpuRecorderWriteCpu(CpuRecorder* recorder, const CpuSummaryInfo* cpu_info)
+{
+  natural_t count = recorder->count;
+  CpuRecord* record = (CpuRecord*)recorder->buffer;
+  record->type = CPU_RECORD_CPU;
+  record->size = (uint32_t)recorder->cpuSize;
+  record->timestamp = cpu_info->timestamp;
+
+  uint16_t* values = (uint16_t*)(recorder->buffer + sizeof(CpuRecord));
+  memset(values, 0x00, recorder->cpuSize);
+  for (natural_t i=0; i<count; i++)
+  {
+    values[i] = _CpuRecordFixed(cpu_info->load[i]);
+  }
+  for (int s=0; (s<CPU_LOAD_STATES) && (cpu_info->state[s] != NULL); s++)
+  {
+    uint16_t* state = values + ((1+s)*count);
+    for (natural_t i=0; i<count; i++)
+    {
+      state[i] = _CpuRecordFixed(cpu_info->state[s][i]);
+    }
+  }
+  uint16_t* mhz = values + ((1+CPU_LOAD_STATES)*count);
+  unsigned char* online = (unsigned char*)(values + ((2+CPU_LOAD_STATES)*count));
+  for (natural_t i=0; i<count; i++)
+  {
+    mhz[i] = (cpu_info->mhz != NULL) ? _CpuRecordMHz(cpu_info->mhz[i]) : 0;
+    online[i] = (cpu_info->online != NULL) ? cpu_info->online[i] : 1;
+  }
+
+  _CpuRecordWrite(recorder->fd, record, sizeof(CpuRecord) + recorder->cpuSize);
+}
+
+void CpuRecorderWriteTop(CpuRecorder* recorder, const TopProcessSample_t* samples, int count, uint64_t timestamp)
+{
+  if (count > recorder->topCount)
+  {
+    count = recorder->topCount;
+  }
+  size_t size = CPU_RECORD_ALIGN((2*sizeof(uint32_t)) + (count*sizeof(TopProcessSample_t)));
+  CpuRecord* record = (CpuRecord*)recorder->buffer;
+  record->type = CPU_RECORD_TOP;
+  record->size = (uint32_t)size;
+  record->timestamp = timestamp;
+
+  uint32_t* header = (uint32_t*)(recorder->buffer + sizeof(CpuRecord));
+  header[0] = (uint32_t)count;
+  header[1] = 0;
+  memcpy(header+2, samples, count*sizeof(TopProcessSample_t));
+
+  _CpuRecordWrite(recorder->fd, record, sizeof(CpuRecord) + size);
+}
+
+void CpuRecorderClose(CpuRecorder* recorder)
+{
+  if (recorder == NULL)
+  {
+    return;
+  }
+  close(recorder->fd);
+  free(recorder->buffer);
+  free(recorder);
+}
+
+// the record at offset, or NULL past the end of the file or for a torn record
+static const CpuRecord* _CpuReplayRecord(const CpuReplay* replay, size_t offset)
+{
+  if (offset + sizeof(CpuRecord) > replay->size)
+  {
+    return NULL;
+  }
+  const CpuRecord* record = (const CpuRecord*)(replay->map + offset);
+  if (offset + sizeof(CpuRecord) + record->size > replay->size)
+  {
+    return NULL;
+  }
+  return record;
+}
+
+static void _CpuReplayRewind(CpuReplay* replay)
+{
+  replay->cursor = replay->first;
+  replay->top = 0;
+  const CpuRecord* first = _CpuReplayRecord(replay, replay->first);
+  replay->base = (first != NULL) ? first->timestamp : 0;
+  replay->last = replay->base;
+  replay->origin = 0;
+}
+
+// replayed ns at which record is due; a session record, or a file without them whose timestamps go
+// backwards or jump ahead, starts a session that plays right where the previous one stopped
+static uint64_t _CpuReplayTime(const CpuReplay* replay, const CpuRecord* record, boolean_t* session)
+{
+  *session = (record->type == CPU_RECORD_SESSION) || (record->timestamp < replay->last) ||
+             ((record->timestamp - replay->last) > CPU_REPLAY_GAP);
+  uint64_t timestamp = *session ? replay->last : record->timestamp;
+  return replay->origin + (timestamp - replay->base);
+}
+
+static void _CpuReplayConsume(CpuReplay* replay, const CpuRecord* record, uint64_t time, boolean_t session)
+{
+  if (session)
+  {
+    replay->origin = time;
+    replay->base = record->timestamp;
+  }
+  replay->last = record->timestamp;
+  replay->cursor += sizeof(CpuRecord) + record->size;
+}
+
+static void _CpuReplayDecode(const CpuReplay* replay, const CpuRecord* record, CpuSummaryInfo* cpu_info)
+{
+  natural_t count = replay->count;
+  const uint16_t* values = (const uint16_t*)(record + 1);
+  const double scale = 1.0 / CPU_RECORD_FIXED;
+  for (natural_t i=0; i<count; i++)
+  {
+    cpu_info->load[i] = values[i] * scale;
+  }
+  for (int s=0; s<CPU_LOAD_STATES; s++)
+  {
+    const uint16_t* state = values + ((1+s)*count);
+    for (natural_t i=0; i<count; i++)
+    {
+      cpu_info->state[s][i] = state[i] * scale;
+    }
+  }
+  const uint16_t* mhz = values + ((1+CPU_LOAD_STATES)*count);
+  for (natural_t i=0; i<count; i++)
+  {
+    cpu_info->mhz[i] = (double)mhz[i];
+  }
+  memcpy(cpu_info->online, values + ((2+CPU_LOAD_STATES)*count), count);
+  cpu_info->timestamp = record->timestamp;
+  cpu_info->sequence++;
+}
+
+CpuReplay* CpuReplayOpen(const char* path, CpuSummaryInfo* cpu_info)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    perror("open recording error");
+    return NULL;
+  }
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || ((size_t)st.st_size < sizeof(CpuRecordHeader)))
+  {
+    fprintf(stderr, "recording %s is empty\n", path);
+    close(fd);
+    return NULL;
+  }
+  const unsigned char* map = (const unsigned char*)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+  {
+    perror("mmap recording error");
+    close(fd);
+    return NULL;
+  }
+  const CpuRecordHeader* header = (const CpuRecordHeader*)map;
+  natural_t count = header->countLogical;
+  if (!_CpuRecordCompatible(header, 0) || (count == 0) || (_CpuRecordPrefixSize(count) > (size_t)st.st_size))
+  {
+    fprintf(stderr, "recording %s is not a valid recording\n", path);
+    munmap((void*)map, (size_t)st.st_size);
+    close(fd);
+    return NULL;
+  }
+
+  CpuReplay* replay = (CpuReplay*)calloc(1, sizeof(CpuReplay));
+  replay->fd = fd;
+  replay->map = map;
+  replay->size = (size_t)st.st_size;
+  replay->count = count;
+  replay->first = _CpuRecordPrefixSize(count);
+  _CpuReplayRewind(replay);
+
+  CpuSamplerViewAlloc(cpu_info, count);
+  cpu_info->countCores = count;
+  cpu_info->mhzMax = (double*)calloc(cpu_info->countPadded, sizeof(double));
+  const uint16_t* mhzMax = (const uint16_t*)(map + sizeof(CpuRecordHeader));
+  for (natural_t i=0; i<count; i++)
+  {
+    cpu_info->mhzMax[i] = (double)mhzMax[i];
+  }
+
+  CpuReplayStep(replay, cpu_info);
+  return replay;
+}
+
+boolean_t CpuReplayUpdate(CpuReplay* replay, CpuSummaryInfo* cpu_info, double speed)
+{
+  uint64_t now = _CpuRecordNanos(CLOCK_MONOTONIC);
+  if (replay->wall == 0)
+  {
+    replay->wall = now;
+  }
+  replay->position += (uint64_t)((double)(now - replay->wall) * speed);
+  replay->wall = now;
+
+  const CpuRecord* latest = NULL;
+  boolean_t wrapped = FALSE;
+  for (;;)
+  {
+    const CpuRecord* record = _CpuReplayRecord(replay, replay->cursor);
+    if (record == NULL)
+    {
+      // loop the recording, but only once per update so that an empty one cannot spin
+      if (wrapped || (latest != NULL))
+      {
+        break;
+      }
+      wrapped = TRUE;
+      _CpuReplayRewind(replay);
+      replay->position = 0;
+      continue;
+    }
+    boolean_t session;
+    uint64_t time = _CpuReplayTime(replay, record, &session);
+    if (time > replay->position)
+    {
+      break;
+    }
+    if (record->type == CPU_RECORD_CPU)
+    {
+      latest = record;
+    }
+    else if (record->type == CPU_RECORD_TOP)
+    {
+      replay->top = replay->cursor;
+    }
+    _CpuReplayConsume(replay, record, time, session);
+  }
+
+  if (latest == NULL)
+  {
+    return FALSE;
+  }
+  _CpuReplayDecode(replay, latest, cpu_info);
+  return TRUE;
+}
+
+boolean_t CpuReplayStep(CpuReplay* replay, CpuSummaryInfo* cpu_info)
+{
+  boolean_t wrapped = FALSE;
+  for (;;)
+  {
+    const CpuRecord* record = _CpuReplayRecord(replay, replay->cursor);
+    if (record == NULL)
+    {
+      if (wrapped)
+      {
+        return FALSE;
+      }
+      wrapped = TRUE;
+      _CpuReplayRewind(replay);
+      continue;
+    }
+    size_t offset = replay->cursor;
+    boolean_t session;
+    uint64_t time = _CpuReplayTime(replay, record, &session);
+    _CpuReplayConsume(replay, record, time, session);
+    if (record->type == CPU_RECORD_CPU)
+    {
+      replay->position = time;
+      _CpuReplayDecode(replay, record, cpu_info);
+      return TRUE;
+    }
+    else if (record->type == CPU_RECORD_TOP)
+    {
+      replay->top = offset;
+    }
+  }
+}
+
+int CpuReplayReadTop(CpuReplay* replay, TopProcessSample_t* samples, int count)
+{
+  if (replay->top == 0)
+  {
+    return 0;
+  }
+  const CpuRecord* record = _CpuReplayRecord(replay, replay->top);
+  const uint32_t* header = (const uint32_t*)(record + 1);
+  if ((int)header[0] < count)
+  {
+    count = (int)header[0];
+  }
+  memcpy(samples, header+2, count*sizeof(TopProcessSample_t));
+  return count;
+}
+
+void CpuReplayClose(CpuReplay* replay)
+{
+  if (replay == NULL)
+  {
+    return;
+  }
+  munmap((void*)replay->map, replay->size);
+  close(replay->fd);
+  free(replay);
+}
+
+#ifdef CPU_RECORDER_TEST
+
+// appends three sessions to one file, the second one after a reboot with timestamps below the first,
+// the third one after a long pause, and replays across both seams
+void CpuRecorderTest(void)
+{
+  const natural_t count = 4;
+  const int records = 5;
+  const uint64_t interval = 500000000ULL;
+  const uint64_t starts[3] = {1000*1000000000ULL, 5*1000000000ULL, 3000*1000000000ULL};
+
+  char path[] = "/tmp/CpuRecorderTest.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0)
+  {
+    perror("mkstemp error");
+    return;
+  }
+  close(fd);
+  unlink(path);
+
+  CpuSummaryInfo cpu_info;
+  CpuSamplerViewAlloc(&cpu_info, count);
+  for (int s=0; s<3; s++)
+  {
+    CpuRecorder* recorder = CpuRecorderOpen(path, &cpu_info, 0);
+    if (recorder == NULL)
+    {
+      return;
+    }
+    for (int i=0; i<records; i++)
+    {
+      cpu_info.load[0] = (double)((s*records)+i) / 100.0;
+      cpu_info.timestamp = starts[s] + (i*interval);
+      CpuRecorderWriteCpu(recorder, &cpu_info);
+    }
+    CpuRecorderClose(recorder);
+  }
+  free(cpu_info.load);
+
+  // every step plays the next sample, no later than one interval after the previous one
+  boolean_t passed = TRUE;
+  CpuSummaryInfo view;
+  CpuReplay* replay = CpuReplayOpen(path, &view);
+  uint64_t position = replay->position;
+  for (int i=1; i<3*records; i++)
+  {
+    CpuReplayStep(replay, &view);
+    int index = (int)((view.load[0] * 100.0) + 0.5);
+    if ((index != i) || (replay->position < position) || (replay->position - position > interval))
+    {
+      fprintf(stderr, "CpuRecorderTest: step %d played sample %d at %llu ns after %llu ns\n",
+              i, index, (unsigned long long)replay->position, (unsigned long long)position);
+      passed = FALSE;
+    }
+    position = replay->position;
+  }
+
+  // the timed replay reaches the last sample after the recorded time, without stalling on the reboot or
+  // idling through the pause
+  CpuReplayClose(replay);
+  free(view.load);
+  free(view.mhzMax);
+  replay = CpuReplayOpen(path, &view);
+  int updates = 0;
+  int index = 0;
+  while ((index < (3*records)-1) && (updates < 1000))
+  {
+    replay->wall = _CpuRecordNanos(CLOCK_MONOTONIC) - (interval/5);
+    if (CpuReplayUpdate(replay, &view, 1.0))
+    {
+      index = (int)((view.load[0] * 100.0) + 0.5);
+    }
+    updates++;
+  }
+  if (updates > ((3*records)*5)+1)
+  {
+    fprintf(stderr, "CpuRecorderTest: the timed replay took %d updates to reach sample %d\n", updates, index);
+    passed = FALSE;
+  }
+  CpuReplayClose(replay);
+  free(view.load);
+  free(view.mhzMax);
+  unlink(path);
+
+  fprintf(stderr, "CpuRecorderTest: replay across 3 sessions %s\n", passed ? "passed" : "FAILED");
+}
+#endif
@@ -0,0 +1,99 @@
+// The MIT License (MIT)
+
+// Copyright 2022 HalfMarble LLC
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef CpuRecorder_h
+#define CpuRecorder_h
+
+#include "CpuSampler.h"
+#include "Top.h"
+
+__BEGIN_DECLS
+
+// Recording file, host byte order, every record 8 byte aligned so the file can be read in place
+// through mmap:
+//   CpuRecordHeader, uint16 mhzMax[countLogical] padded to 8 bytes, then records
+//   CpuRecord followed by size payload bytes:
+//     CPU_RECORD_CPU  uint16 load[count], uint16 state[CPU_LOAD_STATES][count] as fractions of 65535,
+//                     uint16 mhz[count], uint8 online[count]
+//     CPU_RECORD_TOP  uint32 count, uint32 padding, TopProcessSample_t[count]
+//     CPU_RECORD_SESSION  uint64 wall clock ns, written whenever a recorder opens the file
+// Records are only ever appended; a torn record at the end of a file is ignored by the replay.
+// Every session has a monotonic clock of its own, the replay plays them back to back.
+
+#define CPU_RECORD_MAGIC   (0x524d7075)   // "upMR"
+#define CPU_RECORD_VERSION (1)
+
+enum CpuRecordType
+{
+  CPU_RECORD_CPU = 1,
+  CPU_RECORD_TOP = 2,
+  CPU_RECORD_SESSION = 3,
+};
+
+struct CpuRecordHeader
+{
+  uint32_t magic;
+  uint32_t version;
+  uint32_t countLogical;
+  uint32_t countStates;
+  uint32_t topSampleSize;
+  uint32_t reserved;
+  uint64_t created;       // wall clock ns
+}
+typedef CpuRecordHeader;
+
+struct CpuRecord
+{
+  uint32_t type;
+  uint32_t size;
+  uint64_t timestamp;     // monotonic ns of the sample
+}
+typedef CpuRecord;
+
+typedef struct CpuRecorder CpuRecorder;
+typedef struct CpuReplay CpuReplay;
+
+// appends to path, creating it when needed; an existing file must have been recorded with the
+// same cpu count; topCount is the largest top snapshot that will be written, 0 for cpu only
+CpuRecorder* CpuRecorderOpen(const char* path, const CpuSummaryInfo* cpu_info, int topCount);
+void CpuRecorderWriteCpu(CpuRecorder* recorder, const CpuSummaryInfo* cpu_info);
+void CpuRecorderWriteTop(CpuRecorder* recorder, const TopProcessSample_t* samples, int count, uint64_t timestamp);
+void CpuRecorderClose(CpuRecorder* recorder);
+
+// maps a recording and sets cpu_info up as a view of its cpu count
+CpuReplay* CpuReplayOpen(const char* path, CpuSummaryInfo* cpu_info);
+// moves the replay forward by the wall clock time since the last update times speed, looping at the end
+boolean_t CpuReplayUpdate(CpuReplay* replay, CpuSummaryInfo* cpu_info, double speed);
+// moves exactly one cpu record forward, for deterministic runs
+boolean_t CpuReplayStep(CpuReplay* replay, CpuSummaryInfo* cpu_info);
+int CpuReplayReadTop(CpuReplay* replay, TopProcessSample_t* samples, int count);
+void CpuReplayClose(CpuReplay* replay);
+
+//#define CPU_RECORDER_TEST
+#ifdef CPU_RECORDER_TEST
+  #warning "CPU_RECORDER_TEST !"
+void CpuRecorderTest(void);
+#endif
+
+__END_DECLS
+
+#endif /* CpuRecorder_h */
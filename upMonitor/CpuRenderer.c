@@ -21,6 +21,7 @@
 // THE SOFTWARE.
 
 #include "CpuRenderer.h"
+#include "CpuTopology.h"
 
 typedef struct
 {
@@ -173,7 +174,38 @@ rgb _color(int cool, double t)
   return _hsv2rgb(hsv);
 }
 
-void CpuRender(CpuSummaryInfo* cpu_info, CGContextRef ctx, bool light, int granularity, bool bar, bool stripped, bool colored, CGFloat tickWidth, CGFloat tickTotalWidth, CGFloat imageWidth, int theme)
+// bottom to top order of the stacked bar segments
+static const int _stack_order[CPU_LOAD_STATES] = { CPU_LOAD_USER, CPU_LOAD_NICE, CPU_LOAD_SYSTEM, CPU_LOAD_IRQ, CPU_LOAD_STEAL, CPU_LOAD_IOWAIT };
+
+static const rgb _state_colors[CPU_LOAD_STATES] =
+{
+  [CPU_LOAD_USER]   = {0.0, 0.0, 0.0}, // follows the theme
+  [CPU_LOAD_SYSTEM] = {1.0, 0.3, 0.3},
+  [CPU_LOAD_NICE]   = {0.3, 0.6, 1.0},
+  [CPU_LOAD_IOWAIT] = {0.6, 0.6, 0.6},
+  [CPU_LOAD_IRQ]    = {0.8, 0.4, 1.0},
+  [CPU_LOAD_STEAL]  = {1.0, 0.6, 0.1},
+};
+
+static void _render_stacked(CGContextRef ctx, const CGFloat* state, CGFloat x, CGFloat width, rgb user, CGFloat alpha)
+{
+  CGFloat y = 0.0;
+  for (int i=0; i<CPU_LOAD_STATES; i++)
+  {
+    int s = _stack_order[i];
+    CGFloat height = state[s]*16;
+    if (height <= 0.0)
+    {
+      continue;
+    }
+    rgb rgb = (s == CPU_LOAD_USER) ? user : _state_colors[s];
+    CGContextSetRGBFillColor(ctx, rgb.r, rgb.g, rgb.b, (s == CPU_LOAD_IOWAIT) ? alpha*0.5 : alpha);
+    CGContextFillRect(ctx, CGRectMake(x, y, width, height));
+    y += height;
+  }
+}
+
+void CpuRender(CpuSummaryInfo* cpu_info, CGContextRef ctx, bool light, int granularity, bool bar, bool stripped, bool colored, bool stacked, bool scaled, CGFloat tickWidth, CGFloat tickTotalWidth, CGFloat imageWidth, int theme)
 {
   CGContextClearRect(ctx, CGRectMake(0, 0, imageWidth, 16));
   
@@ -190,17 +222,68 @@ void CpuRender(CpuSummaryInfo* cpu_info, CGContextRef ctx, bool light, int granu
     CGContextFillRect(ctx, CGRectMake(0, 0, imageWidth, 1));
   }
   
-  natural_t count = CpuSamplerGetCount(granularity);
-  natural_t group = cpu_info->countLogical / count;
+  // the demo samplers do not produce a state breakdown
+  stacked = stacked && bar && (cpu_info->state[0] != NULL);
+  
+  // gather the logical cpus of each group through the topology table, offline cpus are
+  // left out of the average and a group without any online cpu is drawn as an outline
+  const CpuTopologyGroups* groups = CpuTopologyGetGroups(granularity);
+  natural_t count = groups->count;
   for (natural_t i=0; i<count; i++)
   {
     CGFloat load = 0.0;
-    for (natural_t j=0; j<group; j++)
+    CGFloat state[CPU_LOAD_STATES] = {0};
+    natural_t members = 0;
+    for (natural_t j=groups->start[i]; j<groups->start[i+1]; j++)
     {
-      natural_t index = (i*group)+j;
-      load += cpu_info->now[index].load;
+      natural_t index = groups->members[j];
+      if ((index >= cpu_info->countLogical) || ((cpu_info->online != NULL) && !cpu_info->online[index]))
+      {
+        continue;
+      }
+      members++;
+      // frequency scaled load: a busy cpu throttled to half its clock draws a half bar
+      CGFloat scale = 1.0;
+      if (scaled && (cpu_info->mhz != NULL) && (cpu_info->mhz[index] > 0.0) && (cpu_info->mhzMax[index] > 0.0))
+      {
+        scale = fmin(cpu_info->mhz[index] / cpu_info->mhzMax[index], 1.0);
+      }
+      load += scale * cpu_info->load[index];
+      if (stacked)
+      {
+        for (int s=0; s<CPU_LOAD_STATES; s++)
+        {
+          state[s] += scale * cpu_info->state[s][index];
+        }
+      }
+    }
+    if (members > 0)
+    {
+      load /= (CGFloat)members;
+      if (stacked)
+      {
+        for (int s=0; s<CPU_LOAD_STATES; s++)
+        {
+          state[s] /= (CGFloat)members;
+        }
+      }
+    }
+    
+    if (members == 0)
+    {
+      CGContextSetGrayStrokeColor(ctx, color, range*0.5);
+      CGContextSetLineWidth(ctx, 1.0);
+      if (bar)
+      {
+        CGContextStrokeRect(ctx, CGRectMake(i*tickTotalWidth+0.5, 0.5, tickWidth-1.0, 15.0));
+      }
+      else
+      {
+        double w = tickWidth + 5.0;
+        CGContextStrokeEllipseInRect(ctx, CGRectMake(i*tickTotalWidth+0.5, ((14.0-w)/2.0)+0.5, w, w));
+      }
+      continue;
     }
-    load /= (CGFloat)group;
     
     CGFloat alpha = (range*load)+(1.0-range);
     if (!bar)
@@ -216,10 +299,15 @@ void CpuRender(CpuSummaryInfo* cpu_info, CGContextRef ctx, bool light, int granu
     }
     else
     {
+      rgb.r = rgb.g = rgb.b = color;
       CGContextSetGrayFillColor(ctx, color, alpha);
     }
     
-    if (bar)
+    if (stacked)
+    {
+      _render_stacked(ctx, state, i*tickTotalWidth, tickWidth, rgb, alpha);
+    }
+    else if (bar)
     {
       CGContextFillRect(ctx, CGRectMake(i*tickTotalWidth, 0, tickWidth, load*16));
     }
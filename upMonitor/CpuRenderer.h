@@ -38,7 +38,7 @@ enum Theme
 };
 
 void CpuRenderInit(void);
-void CpuRender(CpuSummaryInfo* cpu_info, CGContextRef ctx, bool light, int granularity, bool bar, bool stripped, bool colored, CGFloat tickWidth, CGFloat tickTotalWidth, CGFloat imageWidth, int theme);
+void CpuRender(CpuSummaryInfo* cpu_info, CGContextRef ctx, bool light, int granularity, bool bar, bool stripped, bool colored, bool stacked, bool scaled, CGFloat tickWidth, CGFloat tickTotalWidth, CGFloat imageWidth, int theme);
 void CpuRenderDemo(CGContextRef ctx, CGFloat width, CGFloat height, int tint);
 
 __END_DECLS
@@ -0,0 +1,201 @@
+// The MIT License (MIT)
+
+// Copyright 2022 HalfMarble LLC
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "CpuRollup.h"
+
+#define CPU_ROLLUP_NSEC_PER_SEC (1000000000ULL)
+
+static const uint64_t _rollup_periods[CPU_ROLLUP_TIERS] = { 1, 10, 60, 3600 };
+static const natural_t _rollup_capacities[CPU_ROLLUP_TIERS] = { 300, 360, 1440, 720 };
+
+CpuRollup* CpuRollupCreate(natural_t count)
+{
+  CpuRollup* rollup = (CpuRollup*)calloc(1, sizeof(CpuRollup));
+  rollup->count = count;
+  rollup->stride = (count + CPU_SAMPLER_LANES-1) & ~(natural_t)(CPU_SAMPLER_LANES-1);
+  for (int t=0; t<CPU_ROLLUP_TIERS; t++)
+  {
+    CpuRollupLevel* level = &rollup->levels[t];
+    size_t slots = (size_t)_rollup_capacities[t] * rollup->stride;
+    level->period = _rollup_periods[t] * CPU_ROLLUP_NSEC_PER_SEC;
+    level->capacity = _rollup_capacities[t];
+    level->min = (float*)calloc(slots, sizeof(float));
+    level->max = (float*)calloc(slots, sizeof(float));
+    level->mean = (float*)calloc(slots, sizeof(float));
+    level->samples = (uint32_t*)calloc(level->capacity, sizeof(uint32_t));
+    level->duration = (uint64_t*)calloc(level->capacity, sizeof(uint64_t));
+    level->start = (uint64_t*)calloc(level->capacity, sizeof(uint64_t));
+    level->openMin = (float*)calloc(rollup->stride, sizeof(float));
+    level->openMax = (float*)calloc(rollup->stride, sizeof(float));
+    level->openSum = (double*)calloc(rollup->stride, sizeof(double));
+  }
+  return rollup;
+}
+
+static void _CpuRollupClose(CpuRollupLevel* level, natural_t count, natural_t stride)
+{
+  uint64_t head = __atomic_load_n(&level->head, __ATOMIC_RELAXED);
+  natural_t slot = (natural_t)(head % level->capacity);
+  float* min = &level->min[(size_t)slot * stride];
+  float* max = &level->max[(size_t)slot * stride];
+  float* mean = &level->mean[(size_t)slot * stride];
+  double scale = 1.0 / (double)level->openTime;
+  for (natural_t i=0; i<count; i++)
+  {
+    min[i] = level->openMin[i];
+    max[i] = level->openMax[i];
+    mean[i] = (float)(level->openSum[i] * scale);
+  }
+  level->samples[slot] = level->open;
+  level->duration[slot] = level->openTime;
+  level->start[slot] = level->bucket * level->period;
+  level->open = 0;
+  __atomic_store_n(&level->head, head+1, __ATOMIC_RELEASE);
+}
+
+// every tier accumulates the sample into its open bucket, a constant amount of work per sample;
+// a bucket closes when the first sample of a later one arrives, buckets without samples are skipped
+void CpuRollupPush(CpuRollup* rollup, const double* load, uint64_t timestamp)
+{
+  natural_t count = rollup->count;
+  // the very first load has no previous push to measure from, give it a token weight
+  uint64_t elapsed = ((rollup->last > 0) && (timestamp > rollup->last)) ? (timestamp - rollup->last) : 1;
+  rollup->last = timestamp;
+  for (int t=0; t<CPU_ROLLUP_TIERS; t++)
+  {
+    CpuRollupLevel* level = &rollup->levels[t];
+    uint64_t bucket = timestamp / level->period;
+    // after a sleep one load stands for the whole gap, but it never outweighs a full bucket
+    uint64_t dt = (elapsed < level->period) ? elapsed : level->period;
+    double weight = (double)dt;
+    if ((level->open > 0) && (bucket != level->bucket))
+    {
+      _CpuRollupClose(level, count, rollup->stride);
+    }
+    if (level->open == 0)
+    {
+      level->bucket = bucket;
+      level->openTime = 0;
+      for (natural_t i=0; i<count; i++)
+      {
+        level->openMin[i] = (float)load[i];
+        level->openMax[i] = (float)load[i];
+        level->openSum[i] = load[i] * weight;
+      }
+    }
+    else
+    {
+      for (natural_t i=0; i<count; i++)
+      {
+        float value = (float)load[i];
+        level->openMin[i] = (value < level->openMin[i]) ? value : level->openMin[i];
+        level->openMax[i] = (value > level->openMax[i]) ? value : level->openMax[i];
+        level->openSum[i] += load[i] * weight;
+      }
+    }
+    level->open++;
+    level->openTime += dt;
+  }
+}
+
+// walks the closed buckets in [from, to) and retries when the producer overwrote any of them meanwhile;
+// the oldest slot is left out as it is the next to be overwritten
+static natural_t _CpuRollupCollect(const CpuRollup* rollup, int tier, natural_t cpu, uint64_t from, uint64_t to, CpuRollupValue* values, natural_t max, CpuRollupValue* fold)
+{
+  if ((tier < 0) || (tier >= CPU_ROLLUP_TIERS) || (cpu >= rollup->count))
+  {
+    return 0;
+  }
+  const CpuRollupLevel* level = &rollup->levels[tier];
+  natural_t collected;
+  uint64_t first;
+  do
+  {
+    uint64_t head = __atomic_load_n(&level->head, __ATOMIC_ACQUIRE);
+    first = (head > level->capacity-1) ? (head - (level->capacity-1)) : 0;
+    collected = 0;
+    double sum = 0.0;
+    if (fold != NULL)
+    {
+      memset(fold, 0x00, sizeof(CpuRollupValue));
+    }
+    for (uint64_t i=first; (i<head) && (collected<max); i++)
+    {
+      natural_t slot = (natural_t)(i % level->capacity);
+      uint64_t start = level->start[slot];
+      if (start < from)
+      {
+        continue;
+      }
+      if (start >= to)
+      {
+        break;
+      }
+      size_t index = ((size_t)slot * rollup->stride) + cpu;
+      CpuRollupValue value = { level->min[index], level->max[index], level->mean[index], level->samples[slot], level->duration[slot], start };
+      if (values != NULL)
+      {
+        values[collected] = value;
+      }
+      if (fold != NULL)
+      {
+        if ((collected == 0) || (value.min < fold->min))
+        {
+          fold->min = value.min;
+        }
+        if ((collected == 0) || (value.max > fold->max))
+        {
+          fold->max = value.max;
+        }
+        if (collected == 0)
+        {
+          fold->start = start;
+        }
+        fold->samples += value.samples;
+        fold->duration += value.duration;
+        sum += (double)value.mean * (double)value.duration;
+      }
+      collected++;
+    }
+    if ((fold != NULL) && (fold->duration > 0))
+    {
+      fold->mean = (float)(sum / (double)fold->duration);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  }
+  while ((__atomic_load_n(&level->head, __ATOMIC_RELAXED) - first) >= level->capacity);
+  return collected;
+}
+
+natural_t CpuRollupRange(const CpuRollup* rollup, int tier, natural_t cpu, uint64_t from, uint64_t to, CpuRollupValue* values, natural_t max)
+{
+  return _CpuRollupCollect(rollup, tier, cpu, from, to, values, max, NULL);
+}
+
+natural_t CpuRollupQuery(const CpuRollup* rollup, int tier, natural_t cpu, uint64_t from, uint64_t to, CpuRollupValue* value)
+{
+  return _CpuRollupCollect(rollup, tier, cpu, from, to, NULL, (natural_t)-1, value);
+}
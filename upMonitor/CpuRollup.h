@@ -0,0 +1,95 @@
+// The MIT License (MIT)
+
+// Copyright 2022 HalfMarble LLC
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef CpuRollup_h
+#define CpuRollup_h
+
+#include "CpuSampler.h"
+
+__BEGIN_DECLS
+
+// fixed size rings of per-cpu min/max/mean at several resolutions:
+//   1s x 300 (5 minutes), 10s x 360 (1 hour), 1m x 1440 (1 day), 1h x 720 (30 days)
+// a load covers the time since the previous push, so means are weighted by that time
+// and not by the number of samples, which the adaptive rate raises while the cpus are busy
+enum CpuRollupTier
+{
+  CPU_ROLLUP_1S = 0,
+  CPU_ROLLUP_10S,
+  CPU_ROLLUP_1M,
+  CPU_ROLLUP_1H,
+  CPU_ROLLUP_TIERS,
+};
+
+struct CpuRollupValue
+{
+  float    min;
+  float    max;
+  float    mean;
+  uint32_t samples;
+  uint64_t duration;  // ns of load the mean covers
+  uint64_t start;     // monotonic ns at which the bucket starts
+}
+typedef CpuRollupValue;
+
+// single producer, multi consumer like CpuHistory: bucket i of a tier lives in slot
+// i % capacity and is closed once head > i; the open bucket is accumulated on the side
+struct CpuRollupLevel
+{
+  uint64_t  period;     // ns per bucket
+  natural_t capacity;
+  float*    min;        // capacity * stride
+  float*    max;
+  float*    mean;
+  uint32_t* samples;    // capacity
+  uint64_t* duration;   // capacity
+  uint64_t* start;      // capacity
+  uint64_t  head;
+  uint64_t  bucket;     // timestamp / period of the open bucket
+  uint32_t  open;       // samples in the open bucket
+  uint64_t  openTime;   // ns covered by them
+  float*    openMin;    // stride
+  float*    openMax;
+  double*   openSum;    // load * ns
+}
+typedef CpuRollupLevel;
+
+struct CpuRollup
+{
+  natural_t      count;
+  natural_t      stride;
+  uint64_t       last;  // timestamp of the previous push
+  CpuRollupLevel levels[CPU_ROLLUP_TIERS];
+}
+typedef CpuRollup;
+
+CpuRollup* CpuRollupCreate(natural_t count);
+void CpuRollupPush(CpuRollup* rollup, const double* load, uint64_t timestamp);
+
+// the closed buckets of a tier that start in [from, to), oldest first, up to max of them
+natural_t CpuRollupRange(const CpuRollup* rollup, int tier, natural_t cpu, uint64_t from, uint64_t to, CpuRollupValue* values, natural_t max);
+// the same buckets folded into one value, returns how many were folded
+natural_t CpuRollupQuery(const CpuRollup* rollup, int tier, natural_t cpu, uint64_t from, uint64_t to, CpuRollupValue* value);
+
+__END_DECLS
+
+#endif /* CpuRollup_h */
@@ -21,15 +21,277 @@
 // THE SOFTWARE.
 
 #include "CpuSampler.h"
+#include "CpuTopology.h"
+#include "CpuRollup.h"
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/utsname.h>
+#else
 #include <sys/sysctl.h>
+#endif
 
 static char *_cpuType = NULL;
 static char *_cpuSubtype = NULL;
 static long _frequency = 0;
 
+#ifdef __linux__
+
+#define PROC_STAT_PATH        "/proc/stat"
+#define SYS_CPU_PATH          "/sys/devices/system/cpu"
+
+// scaling_cur_freq holds a single kHz value
+#define CPU_FREQ_LENGTH_MAX   (32)
+
+// worst case length of a "cpuN ..." line: 10 counters of up to 20 digits each
+#define PROC_STAT_LINE_MAX    (256)
+
+// the subset of mach's host_basic_info that the sampler uses
+typedef struct
+{
+  int max_cpus;
+  int avail_cpus;
+  int logical_cpu;
+}
+host_basic_info_data_t, *host_basic_info_t;
+
+static ssize_t _CpuSamplerReadFile(const char* path, char* buffer, size_t size)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  ssize_t length = read(fd, buffer, size-1);
+  close(fd);
+  if (length < 0)
+  {
+    return -1;
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
+static char* _CpuSamplerCpuInfoValue(const char* cpuinfo, const char* key)
+{
+  size_t keyLength = strlen(key);
+  const char* line = cpuinfo;
+  while ((line != NULL) && (line[0] != '\0'))
+  {
+    if (strncmp(line, key, keyLength) == 0)
+    {
+      const char* value = strchr(line, ':');
+      const char* end = strchr(line, '\n');
+      if ((value != NULL) && ((end == NULL) || (value < end)))
+      {
+        value++;
+        while (*value == ' ' || *value == '\t')
+        {
+          value++;
+        }
+        size_t length = (end != NULL) ? (size_t)(end-value) : strlen(value);
+        return strndup(value, length);
+      }
+    }
+    line = strchr(line, '\n');
+    if (line != NULL)
+    {
+      line++;
+    }
+  }
+  return NULL;
+}
+
+static host_basic_info_t _CpuSamplerGetCounts()
+{
+  static boolean_t initialized = FALSE;
+  static host_basic_info_data_t basic_info;
+  if (!initialized)
+  {
+    initialized = TRUE;
+
+    memset(&basic_info, 0x0, sizeof(host_basic_info_data_t));
+    basic_info.max_cpus = (int)sysconf(_SC_NPROCESSORS_CONF);
+    basic_info.avail_cpus = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    basic_info.logical_cpu = basic_info.avail_cpus;
+
+    char buffer[4096];
+    struct utsname name;
+    if (uname(&name) == 0)
+    {
+      _cpuType = strdup(name.machine);
+    }
+
+    static char cpuinfo[64*1024];
+    if (_CpuSamplerReadFile("/proc/cpuinfo", cpuinfo, sizeof(cpuinfo)) > 0)
+    {
+      _cpuSubtype = _CpuSamplerCpuInfoValue(cpuinfo, "model name");
+      if (_cpuSubtype == NULL)
+      {
+        _cpuSubtype = _CpuSamplerCpuInfoValue(cpuinfo, "Hardware");
+      }
+    }
+
+    if (_CpuSamplerReadFile(SYS_CPU_PATH"/cpu0/cpufreq/cpuinfo_max_freq", buffer, sizeof(buffer)) > 0)
+    {
+      _frequency = atol(buffer) / 1000;
+    }
+    else
+    {
+      char* mhz = _CpuSamplerCpuInfoValue(cpuinfo, "cpu MHz");
+      if (mhz != NULL)
+      {
+        _frequency = atol(mhz);
+        free(mhz);
+      }
+    }
+  }
+  return &basic_info;
+}
+
+static inline uint64_t _CpuSamplerParseU64(const char** cursor)
+{
+  const char* p = *cursor;
+  while (*p == ' ')
+  {
+    p++;
+  }
+  uint64_t value = 0;
+  while ((*p >= '0') && (*p <= '9'))
+  {
+    value = (value * 10) + (uint64_t)(*p - '0');
+    p++;
+  }
+  *cursor = p;
+  return value;
+}
+
+// /proc/stat starts with the aggregate "cpu" line followed by one "cpuN" line per online cpu:
+//   cpuN user nice system idle iowait irq softirq steal guest guest_nice
+// the ticks of cpu N land in slot N and mark it online, slots of offline cpus are left alone
+static natural_t _CpuSamplerGet(CpuSummaryInfo* cpu_info, Ticks* ticks)
+{
+  ssize_t length = pread(cpu_info->fd, cpu_info->buffer, cpu_info->bufferSize-1, 0);
+  if (length <= 0)
+  {
+    perror("pread "PROC_STAT_PATH" error");
+    return 0;
+  }
+  cpu_info->buffer[length] = '\0';
+  memset(cpu_info->online, 0x00, cpu_info->countLogical);
+
+  natural_t cpu_count = 0;
+  const char* p = strchr(cpu_info->buffer, '\n');
+  while ((p != NULL) && (p[1] == 'c') && (p[2] == 'p') && (p[3] == 'u'))
+  {
+    p += 4;
+    natural_t cpu = (natural_t)_CpuSamplerParseU64(&p);
+    if (cpu < cpu_info->countLogical)
+    {
+      uint64_t user    = _CpuSamplerParseU64(&p);
+      uint64_t nice    = _CpuSamplerParseU64(&p);
+      uint64_t system  = _CpuSamplerParseU64(&p);
+      uint64_t idle    = _CpuSamplerParseU64(&p);
+      uint64_t iowait  = _CpuSamplerParseU64(&p);
+      uint64_t irq     = _CpuSamplerParseU64(&p);
+      uint64_t softirq = _CpuSamplerParseU64(&p);
+      uint64_t steal   = _CpuSamplerParseU64(&p);
+
+      ticks->systemTicks[cpu] = system;
+      ticks->userTicks[cpu]   = user;
+      ticks->niceTicks[cpu]   = nice;
+      ticks->idleTicks[cpu]   = idle;
+      ticks->iowaitTicks[cpu] = iowait;
+      ticks->irqTicks[cpu]    = irq + softirq;
+      ticks->stealTicks[cpu]  = steal;
+      cpu_info->online[cpu] = 1;
+      cpu_count++;
+    }
+    p = strchr(p, '\n');
+  }
+
+  return cpu_count;
+}
+
+static void _CpuSamplerFrequencyOpen(CpuSummaryInfo* cpu_info)
+{
+  char path[128];
+  char buffer[CPU_FREQ_LENGTH_MAX];
+  cpu_info->freqFd = (int*)malloc(cpu_info->countPadded*sizeof(int));
+  for (natural_t i=0; i<cpu_info->countLogical; i++)
+  {
+    snprintf(path, sizeof(path), SYS_CPU_PATH"/cpu%u/cpufreq/scaling_cur_freq", i);
+    cpu_info->freqFd[i] = open(path, O_RDONLY | O_CLOEXEC);
+
+    cpu_info->mhzMax[i] = (double)_frequency;
+    snprintf(path, sizeof(path), SYS_CPU_PATH"/cpu%u/cpufreq/cpuinfo_max_freq", i);
+    if (_CpuSamplerReadFile(path, buffer, sizeof(buffer)) > 0)
+    {
+      cpu_info->mhzMax[i] = (double)atol(buffer) / 1000.0;
+    }
+  }
+}
+
+static void _CpuSamplerFrequencyGet(CpuSummaryInfo* cpu_info)
+{
+  char buffer[CPU_FREQ_LENGTH_MAX];
+  for (natural_t i=0; i<cpu_info->countLogical; i++)
+  {
+    int fd = cpu_info->freqFd[i];
+    if (fd < 0)
+    {
+      continue;
+    }
+    ssize_t length = pread(fd, buffer, sizeof(buffer)-1, 0);
+    if (length > 0)
+    {
+      buffer[length] = '\0';
+      cpu_info->mhz[i] = (double)strtoul(buffer, NULL, 10) / 1000.0;
+    }
+  }
+}
+
+// a cpu that was offline at launch has no cpufreq directory yet
+static void _CpuSamplerFrequencyOnline(CpuSummaryInfo* cpu_info, natural_t cpu)
+{
+  if (cpu_info->freqFd[cpu] < 0)
+  {
+    char path[128];
+    snprintf(path, sizeof(path), SYS_CPU_PATH"/cpu%u/cpufreq/scaling_cur_freq", cpu);
+    cpu_info->freqFd[cpu] = open(path, O_RDONLY | O_CLOEXEC);
+  }
+}
+
+static void _CpuSamplerOpen(CpuSummaryInfo* cpu_info)
+{
+  cpu_info->fd = open(PROC_STAT_PATH, O_RDONLY | O_CLOEXEC);
+  if (cpu_info->fd < 0)
+  {
+    perror("open "PROC_STAT_PATH" error");
+    return;
+  }
+
+  // size the buffer from the possible cpus so that a single pread always covers every cpu line
+  _CpuSamplerGetCounts();
+  cpu_info->bufferSize = (cpu_info->countLogical+1)*PROC_STAT_LINE_MAX;
+  cpu_info->buffer = (char*)malloc(cpu_info->bufferSize);
+}
+
+#else
+
 static host_basic_info_t _CpuSamplerGetCounts()
 {
   static boolean_t initialized = FALSE;
@@ -82,8 +344,9 @@ static host_basic_info_t _CpuSamplerGetCounts()
   return &basic_info;
 }
 
-static natural_t _CpuSamplerGet(mach_port_t port, Ticks* ticks)
+static natural_t _CpuSamplerGet(CpuSummaryInfo* cpu_info, Ticks* ticks)
 {
+  mach_port_t port = cpu_info->port;
   natural_t cpu_count = 0;
   processor_cpu_load_info_t cpu_load;
   mach_msg_type_number_t msg_count = PROCESSOR_CPU_LOAD_INFO_COUNT;
@@ -95,12 +358,18 @@ static natural_t _CpuSamplerGet(mach_port_t port, Ticks* ticks)
   }
   else if (ticks != NULL)
   {
+    if (cpu_count > cpu_info->countLogical)
+    {
+      cpu_count = cpu_info->countLogical;
+    }
+    memset(cpu_info->online, 0x00, cpu_info->countLogical);
+    memset(cpu_info->online, 0x01, cpu_count);
     for (natural_t i=0; i<cpu_count; i++)
     {
-      ticks[i].systemTicks = cpu_load[i].cpu_ticks[CPU_STATE_SYSTEM];
-      ticks[i].userTicks   = cpu_load[i].cpu_ticks[CPU_STATE_USER];
-      ticks[i].niceTicks   = cpu_load[i].cpu_ticks[CPU_STATE_NICE];
-      ticks[i].idleTicks   = cpu_load[i].cpu_ticks[CPU_STATE_IDLE];
+      ticks->systemTicks[i] = cpu_load[i].cpu_ticks[CPU_STATE_SYSTEM];
+      ticks->userTicks[i]   = cpu_load[i].cpu_ticks[CPU_STATE_USER];
+      ticks->niceTicks[i]   = cpu_load[i].cpu_ticks[CPU_STATE_NICE];
+      ticks->idleTicks[i]   = cpu_load[i].cpu_ticks[CPU_STATE_IDLE];
     }
   }
   error = vm_deallocate(mach_task_self(), (vm_address_t)cpu_load, msg_count);
@@ -112,17 +381,38 @@ static natural_t _CpuSamplerGet(mach_port_t port, Ticks* ticks)
   return cpu_count;
 }
 
-natural_t CpuSamplerGetCount(int granularity)
+// there is no public per cpu clock on macOS (Apple silicon only exposes it through the private
+// IOReport), so every cpu reports the nominal HW_CPU_FREQ, or 0 where that does not exist
+static void _CpuSamplerFrequencyOpen(CpuSummaryInfo* cpu_info)
 {
-  host_basic_info_t info = _CpuSamplerGetCounts();
-  switch(granularity)
+  for (natural_t i=0; i<cpu_info->countLogical; i++)
   {
-    case 1: return info->physical_cpu;
-    case 2: return info->logical_cpu;
-    default: return 1;
+    cpu_info->mhz[i] = (double)_frequency;
+    cpu_info->mhzMax[i] = (double)_frequency;
   }
 }
 
+static void _CpuSamplerFrequencyGet(CpuSummaryInfo* cpu_info)
+{
+}
+
+static void _CpuSamplerFrequencyOnline(CpuSummaryInfo* cpu_info, natural_t cpu)
+{
+}
+
+static void _CpuSamplerOpen(CpuSummaryInfo* cpu_info)
+{
+  cpu_info->port = mach_host_self();
+  _CpuSamplerGetCounts();
+}
+
+#endif
+
+natural_t CpuSamplerGetCount(int granularity)
+{
+  return CpuTopologyGetGroups(granularity)->count;
+}
+
 char* CpuSamplerGetCpuType()
 {
   _CpuSamplerGetCounts();
@@ -141,96 +431,516 @@ long CpuSamplerGetCpuMHz()
   return _frequency;
 }
 
+// load, the per state fractions and mhz are contiguous, countPadded apart, followed by the online
+// mask, and published as one block
+#define CPU_PUBLISHED_ARRAYS (1+CPU_LOAD_STATES+1)
+#define CPU_PUBLISHED_SIZE(padded) ((CPU_PUBLISHED_ARRAYS*(padded)*sizeof(double)) + (padded))
+
+static uint64_t _CpuSamplerNanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * 1000000000ULL) + (uint64_t)ts.tv_nsec;
+}
+
+static void _CpuSamplerAlloc(CpuSummaryInfo* cpu_info)
+{
+  natural_t padded = (cpu_info->countLogical + CPU_SAMPLER_LANES-1) & ~(natural_t)(CPU_SAMPLER_LANES-1);
+  cpu_info->countPadded = padded;
+
+  // both tick sets and the published arrays in one zeroed block aligned for the widest vector
+  size_t size = padded*sizeof(uint64_t);
+  size_t total = (2*CPU_TICK_ARRAYS*size) + CPU_PUBLISHED_SIZE(padded);
+  char* block = NULL;
+  if (posix_memalign((void**)&block, 32, total) != 0)
+  {
+    perror("posix_memalign error");
+    return;
+  }
+  memset(block, 0x00, total);
+  for (int i=0; i<2; i++)
+  {
+    char* ticks = block + (i*CPU_TICK_ARRAYS*size);
+    cpu_info->ticks[i].systemTicks = (uint64_t*)(ticks + 0*size);
+    cpu_info->ticks[i].userTicks   = (uint64_t*)(ticks + 1*size);
+    cpu_info->ticks[i].niceTicks   = (uint64_t*)(ticks + 2*size);
+    cpu_info->ticks[i].idleTicks   = (uint64_t*)(ticks + 3*size);
+    cpu_info->ticks[i].iowaitTicks = (uint64_t*)(ticks + 4*size);
+    cpu_info->ticks[i].irqTicks    = (uint64_t*)(ticks + 5*size);
+    cpu_info->ticks[i].stealTicks  = (uint64_t*)(ticks + 6*size);
+  }
+  cpu_info->load = (double*)(block + (2*CPU_TICK_ARRAYS*size));
+  for (int i=0; i<CPU_LOAD_STATES; i++)
+  {
+    cpu_info->state[i] = cpu_info->load + ((i+1)*padded);
+  }
+  cpu_info->mhz = cpu_info->load + ((1+CPU_LOAD_STATES)*padded);
+  cpu_info->mhzMax = (double*)calloc(padded, sizeof(double));
+  cpu_info->online = (unsigned char*)(cpu_info->load + (CPU_PUBLISHED_ARRAYS*padded));
+  cpu_info->onlineLast = (unsigned char*)calloc(padded, 1);
+  cpu_info->last = &cpu_info->ticks[0];
+  cpu_info->now = &cpu_info->ticks[1];
+}
+
+// load = busy / (busy+idle+iowait) over the tick deltas, with busy = user+system+nice+irq+steal,
+// and each state as its own fraction of the same total; everything is 0 when no ticks elapsed
+static inline void _CpuSamplerLoadScalar(const Ticks* now, const Ticks* last, double* load, double* const* state, natural_t count)
+{
+  for (natural_t i=0; i<count; i++)
+  {
+    uint64_t system = now->systemTicks[i] - last->systemTicks[i];
+    uint64_t user   = now->userTicks[i]   - last->userTicks[i];
+    uint64_t nice   = now->niceTicks[i]   - last->niceTicks[i];
+    uint64_t idle   = now->idleTicks[i]   - last->idleTicks[i];
+    uint64_t iowait = now->iowaitTicks[i] - last->iowaitTicks[i];
+    uint64_t irq    = now->irqTicks[i]    - last->irqTicks[i];
+    uint64_t steal  = now->stealTicks[i]  - last->stealTicks[i];
+    uint64_t used = system + user + nice + irq + steal;
+    uint64_t total = used + idle + iowait;
+    double rcp = 1.0 / (total != 0 ? (double)total : 1.0);
+    load[i] = (double)used * rcp;
+    state[CPU_LOAD_USER][i]   = (double)user * rcp;
+    state[CPU_LOAD_SYSTEM][i] = (double)system * rcp;
+    state[CPU_LOAD_NICE][i]   = (double)nice * rcp;
+    state[CPU_LOAD_IOWAIT][i] = (double)iowait * rcp;
+    state[CPU_LOAD_IRQ][i]    = (double)irq * rcp;
+    state[CPU_LOAD_STEAL][i]  = (double)steal * rcp;
+  }
+}
+
+// tick deltas are far below 2^52, so a u64 becomes a double by or-ing it into the mantissa of 2^52
+// and subtracting 2^52 again; SSE2 and AVX2 have no direct u64 -> double conversion
+#define CPU_SAMPLER_2P52 (0x4330000000000000ULL)
+
+static void _CpuSamplerLoadVector(const Ticks* now, const Ticks* last, double* load, double* const* state, natural_t count)
+{
+#if defined(__AVX2__)
+  const __m256i magic = _mm256_set1_epi64x((long long)CPU_SAMPLER_2P52);
+  const __m256d magicd = _mm256_castsi256_pd(magic);
+  const __m256d one = _mm256_set1_pd(1.0);
+#define DELTA(field) _mm256_sub_epi64(_mm256_load_si256((const __m256i*)&now->field[i]), _mm256_load_si256((const __m256i*)&last->field[i]))
+#define DOUBLE(x) _mm256_sub_pd(_mm256_castsi256_pd(_mm256_or_si256((x), magic)), magicd)
+  for (natural_t i=0; i<count; i+=4)
+  {
+    __m256i system = DELTA(systemTicks);
+    __m256i user   = DELTA(userTicks);
+    __m256i nice   = DELTA(niceTicks);
+    __m256i idle   = DELTA(idleTicks);
+    __m256i iowait = DELTA(iowaitTicks);
+    __m256i irq    = DELTA(irqTicks);
+    __m256i steal  = DELTA(stealTicks);
+    __m256i used   = _mm256_add_epi64(_mm256_add_epi64(_mm256_add_epi64(system, user), _mm256_add_epi64(nice, irq)), steal);
+    __m256i total  = _mm256_add_epi64(_mm256_add_epi64(used, idle), iowait);
+    __m256d rcp    = _mm256_div_pd(one, _mm256_max_pd(DOUBLE(total), one));
+    _mm256_store_pd(&load[i], _mm256_mul_pd(DOUBLE(used), rcp));
+    _mm256_store_pd(&state[CPU_LOAD_USER][i],   _mm256_mul_pd(DOUBLE(user), rcp));
+    _mm256_store_pd(&state[CPU_LOAD_SYSTEM][i], _mm256_mul_pd(DOUBLE(system), rcp));
+    _mm256_store_pd(&state[CPU_LOAD_NICE][i],   _mm256_mul_pd(DOUBLE(nice), rcp));
+    _mm256_store_pd(&state[CPU_LOAD_IOWAIT][i], _mm256_mul_pd(DOUBLE(iowait), rcp));
+    _mm256_store_pd(&state[CPU_LOAD_IRQ][i],    _mm256_mul_pd(DOUBLE(irq), rcp));
+    _mm256_store_pd(&state[CPU_LOAD_STEAL][i],  _mm256_mul_pd(DOUBLE(steal), rcp));
+  }
+#undef DELTA
+#undef DOUBLE
+#elif defined(__SSE2__)
+  const __m128i magic = _mm_set1_epi64x((long long)CPU_SAMPLER_2P52);
+  const __m128d magicd = _mm_castsi128_pd(magic);
+  const __m128d one = _mm_set1_pd(1.0);
+#define DELTA(field) _mm_sub_epi64(_mm_load_si128((const __m128i*)&now->field[i]), _mm_load_si128((const __m128i*)&last->field[i]))
+#define DOUBLE(x) _mm_sub_pd(_mm_castsi128_pd(_mm_or_si128((x), magic)), magicd)
+  for (natural_t i=0; i<count; i+=2)
+  {
+    __m128i system = DELTA(systemTicks);
+    __m128i user   = DELTA(userTicks);
+    __m128i nice   = DELTA(niceTicks);
+    __m128i idle   = DELTA(idleTicks);
+    __m128i iowait = DELTA(iowaitTicks);
+    __m128i irq    = DELTA(irqTicks);
+    __m128i steal  = DELTA(stealTicks);
+    __m128i used   = _mm_add_epi64(_mm_add_epi64(_mm_add_epi64(system, user), _mm_add_epi64(nice, irq)), steal);
+    __m128i total  = _mm_add_epi64(_mm_add_epi64(used, idle), iowait);
+    __m128d rcp    = _mm_div_pd(one, _mm_max_pd(DOUBLE(total), one));
+    _mm_store_pd(&load[i], _mm_mul_pd(DOUBLE(used), rcp));
+    _mm_store_pd(&state[CPU_LOAD_USER][i],   _mm_mul_pd(DOUBLE(user), rcp));
+    _mm_store_pd(&state[CPU_LOAD_SYSTEM][i], _mm_mul_pd(DOUBLE(system), rcp));
+    _mm_store_pd(&state[CPU_LOAD_NICE][i],   _mm_mul_pd(DOUBLE(nice), rcp));
+    _mm_store_pd(&state[CPU_LOAD_IOWAIT][i], _mm_mul_pd(DOUBLE(iowait), rcp));
+    _mm_store_pd(&state[CPU_LOAD_IRQ][i],    _mm_mul_pd(DOUBLE(irq), rcp));
+    _mm_store_pd(&state[CPU_LOAD_STEAL][i],  _mm_mul_pd(DOUBLE(steal), rcp));
+  }
+#undef DELTA
+#undef DOUBLE
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+  const float64x2_t one = vdupq_n_f64(1.0);
+#define DELTA(field) vsubq_u64(vld1q_u64(&now->field[i]), vld1q_u64(&last->field[i]))
+  for (natural_t i=0; i<count; i+=2)
+  {
+    uint64x2_t system = DELTA(systemTicks);
+    uint64x2_t user   = DELTA(userTicks);
+    uint64x2_t nice   = DELTA(niceTicks);
+    uint64x2_t idle   = DELTA(idleTicks);
+    uint64x2_t iowait = DELTA(iowaitTicks);
+    uint64x2_t irq    = DELTA(irqTicks);
+    uint64x2_t steal  = DELTA(stealTicks);
+    uint64x2_t used   = vaddq_u64(vaddq_u64(vaddq_u64(system, user), vaddq_u64(nice, irq)), steal);
+    uint64x2_t total  = vaddq_u64(vaddq_u64(used, idle), iowait);
+    float64x2_t rcp   = vdivq_f64(one, vmaxq_f64(vcvtq_f64_u64(total), one));
+    vst1q_f64(&load[i], vmulq_f64(vcvtq_f64_u64(used), rcp));
+    vst1q_f64(&state[CPU_LOAD_USER][i],   vmulq_f64(vcvtq_f64_u64(user), rcp));
+    vst1q_f64(&state[CPU_LOAD_SYSTEM][i], vmulq_f64(vcvtq_f64_u64(system), rcp));
+    vst1q_f64(&state[CPU_LOAD_NICE][i],   vmulq_f64(vcvtq_f64_u64(nice), rcp));
+    vst1q_f64(&state[CPU_LOAD_IOWAIT][i], vmulq_f64(vcvtq_f64_u64(iowait), rcp));
+    vst1q_f64(&state[CPU_LOAD_IRQ][i],    vmulq_f64(vcvtq_f64_u64(irq), rcp));
+    vst1q_f64(&state[CPU_LOAD_STEAL][i],  vmulq_f64(vcvtq_f64_u64(steal), rcp));
+  }
+#undef DELTA
+#else
+  _CpuSamplerLoadScalar(now, last, load, state, count);
+#endif
+}
+
+static void _CpuSamplerHistoryAlloc(CpuHistory* history, natural_t stride)
+{
+  history->capacity = CPU_HISTORY_CAPACITY;
+  history->stride = stride;
+  history->frames = (float*)calloc((size_t)history->capacity*stride, sizeof(float));
+  history->head = 0;
+}
+
+static void _CpuSamplerHistoryPush(CpuHistory* history, const double* load, natural_t count)
+{
+  if (history->frames == NULL)
+  {
+    return;
+  }
+  uint64_t head = __atomic_load_n(&history->head, __ATOMIC_RELAXED);
+  float* frame = &history->frames[(size_t)(head % history->capacity) * history->stride];
+  for (natural_t i=0; i<count; i++)
+  {
+    frame[i] = (float)load[i];
+  }
+  __atomic_store_n(&history->head, head+1, __ATOMIC_RELEASE);
+}
+
+// zero copy view of the last count frames; the oldest slot is left out as it is the next to be overwritten
+natural_t CpuSamplerHistoryView(const CpuSummaryInfo* cpu_info, natural_t count, CpuHistoryView* view)
+{
+  const CpuHistory* history = &cpu_info->history;
+  memset(view, 0x00, sizeof(CpuHistoryView));
+  view->stride = history->stride;
+  if (history->frames == NULL)
+  {
+    return 0;
+  }
+
+  uint64_t head = __atomic_load_n(&history->head, __ATOMIC_ACQUIRE);
+  if (count > history->capacity-1)
+  {
+    count = history->capacity-1;
+  }
+  if (count > head)
+  {
+    count = (natural_t)head;
+  }
+  view->first = head - count;
+
+  natural_t start = (natural_t)(view->first % history->capacity);
+  natural_t run = history->capacity - start;
+  if (run > count)
+  {
+    run = count;
+  }
+  view->frames[0] = &history->frames[(size_t)start * history->stride];
+  view->count[0] = run;
+  view->frames[1] = history->frames;
+  view->count[1] = count - run;
+
+  return count;
+}
+
+// true when no frame of the view has been overwritten while it was being read
+boolean_t CpuSamplerHistoryValid(const CpuSummaryInfo* cpu_info, const CpuHistoryView* view)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  uint64_t head = __atomic_load_n(&cpu_info->history.head, __ATOMIC_RELAXED);
+  return (head - view->first) < cpu_info->history.capacity;
+}
+
+// copies the last count frames, oldest first, into frames[count * stride]
+natural_t CpuSamplerHistorySnapshot(const CpuSummaryInfo* cpu_info, natural_t count, float* frames)
+{
+  CpuHistoryView view;
+  natural_t copied = 0;
+  do
+  {
+    copied = CpuSamplerHistoryView(cpu_info, count, &view);
+    size_t size0 = (size_t)view.count[0] * view.stride * sizeof(float);
+    size_t size1 = (size_t)view.count[1] * view.stride * sizeof(float);
+    memcpy(frames, view.frames[0], size0);
+    memcpy((char*)frames + size0, view.frames[1], size1);
+  }
+  while (!CpuSamplerHistoryValid(cpu_info, &view));
+  return copied;
+}
+
+static void _CpuSamplerPublish(CpuSummaryInfo* cpu_info)
+{
+  if (cpu_info->published[0] == NULL)
+  {
+    return;
+  }
+  uint64_t sequence = __atomic_load_n(&cpu_info->sequence, __ATOMIC_RELAXED) + 1;
+  natural_t slot = (natural_t)(sequence & 1);
+  // the odd value has to be visible before any of the payload stores, a reader still copying the slot
+  // then fails its recheck
+  __atomic_store_n(&cpu_info->publishedSequence[slot], (2*sequence)-1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(cpu_info->published[slot], cpu_info->load, CPU_PUBLISHED_SIZE(cpu_info->countPadded));
+  cpu_info->publishedTimestamp[slot] = cpu_info->timestamp;
+  cpu_info->publishedGeneration[slot] = cpu_info->onlineGeneration;
+  __atomic_store_n(&cpu_info->publishedSequence[slot], 2*sequence, __ATOMIC_RELEASE);
+  __atomic_store_n(&cpu_info->sequence, sequence, __ATOMIC_RELEASE);
+}
+
+static inline void _CpuSamplerCopyTicks(Ticks* to, const Ticks* from, natural_t i)
+{
+  to->systemTicks[i] = from->systemTicks[i];
+  to->userTicks[i]   = from->userTicks[i];
+  to->niceTicks[i]   = from->niceTicks[i];
+  to->idleTicks[i]   = from->idleTicks[i];
+  to->iowaitTicks[i] = from->iowaitTicks[i];
+  to->irqTicks[i]    = from->irqTicks[i];
+  to->stealTicks[i]  = from->stealTicks[i];
+}
+
+// an offline cpu keeps its last ticks so that its load reads 0, a cpu that came (back) online
+// starts from its current ticks so that it does not report its whole downtime in one sample;
+// everything stays in the preallocated per cpu slots
+static void _CpuSamplerRemap(CpuSummaryInfo* cpu_info, natural_t online)
+{
+  natural_t count = cpu_info->countLogical;
+  if ((online == count) && (cpu_info->countOnline == count))
+  {
+    return;
+  }
+  for (natural_t i=0; i<count; i++)
+  {
+    if (!cpu_info->online[i])
+    {
+      _CpuSamplerCopyTicks(cpu_info->now, cpu_info->last, i);
+      cpu_info->mhz[i] = 0.0;
+    }
+    else if (!cpu_info->onlineLast[i])
+    {
+      _CpuSamplerCopyTicks(cpu_info->last, cpu_info->now, i);
+      _CpuSamplerFrequencyOnline(cpu_info, i);
+    }
+  }
+  if (memcmp(cpu_info->online, cpu_info->onlineLast, count) != 0)
+  {
+    memcpy(cpu_info->onlineLast, cpu_info->online, count);
+    cpu_info->onlineGeneration++;
+  }
+  cpu_info->countOnline = online;
+}
+
+// a view has the published arrays of a sampler but no tick sets, history or descriptors
+void CpuSamplerViewAlloc(CpuSummaryInfo* view, natural_t countLogical)
+{
+  memset(view, 0x00, sizeof(CpuSummaryInfo));
+  view->countLogical = countLogical;
+  view->countPadded = (countLogical + CPU_SAMPLER_LANES-1) & ~(natural_t)(CPU_SAMPLER_LANES-1);
+  view->load = (double*)calloc(1, CPU_PUBLISHED_SIZE(view->countPadded));
+  for (int i=0; i<CPU_LOAD_STATES; i++)
+  {
+    view->state[i] = view->load + ((i+1)*view->countPadded);
+  }
+  view->mhz = view->load + ((1+CPU_LOAD_STATES)*view->countPadded);
+  view->online = (unsigned char*)(view->load + (CPU_PUBLISHED_ARRAYS*view->countPadded));
+}
+
+void CpuSamplerViewInit(CpuSummaryInfo* view, const CpuSummaryInfo* cpu_info)
+{
+  CpuSamplerViewAlloc(view, cpu_info->countLogical);
+  view->countCores = cpu_info->countCores;
+  view->frequency = cpu_info->frequency;
+  view->mhzMax = cpu_info->mhzMax;
+}
+
+// copies the latest published sample into view without ever blocking the sampler; the slot being read
+// is only rewritten two publications later, so a retry needs the sampler to lap the reader
+boolean_t CpuSamplerRead(const CpuSummaryInfo* cpu_info, CpuSummaryInfo* view)
+{
+  uint64_t begin, check;
+  do
+  {
+    uint64_t sequence = __atomic_load_n(&cpu_info->sequence, __ATOMIC_ACQUIRE);
+    if (sequence == 0)
+    {
+      return FALSE;
+    }
+    natural_t slot = (natural_t)(sequence & 1);
+    begin = __atomic_load_n(&cpu_info->publishedSequence[slot], __ATOMIC_ACQUIRE);
+    if ((begin & 1) != 0)
+    {
+      // the sampler lapped the reader and is rewriting this slot
+      check = begin+1;
+      continue;
+    }
+    memcpy(view->load, cpu_info->published[slot], CPU_PUBLISHED_SIZE(view->countPadded));
+    view->timestamp = cpu_info->publishedTimestamp[slot];
+    view->onlineGeneration = cpu_info->publishedGeneration[slot];
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    check = __atomic_load_n(&cpu_info->publishedSequence[slot], __ATOMIC_RELAXED);
+  }
+  while (check != begin);
+  // a slot rewritten in between holds a newer sample than the sequence first read
+  view->sequence = begin/2;
+  return TRUE;
+}
+
 void CpuSamplerInit(CpuSummaryInfo* cpu_info)
 {
   memset(cpu_info, 0x00, sizeof(CpuSummaryInfo));
   
-  cpu_info->port = mach_host_self();
-  cpu_info->countLogical = _CpuSamplerGet(cpu_info->port, NULL);
-  host_basic_info_t info = _CpuSamplerGetCounts();
-  cpu_info->countCores = info->physical_cpu;
-
-  size_t size = cpu_info->countLogical*sizeof(Ticks);
-  cpu_info->last = (Ticks*)malloc(size);
-  memset(cpu_info->last, 0x00, size);
-  cpu_info->now = (Ticks*)malloc(size);
-  memset(cpu_info->now, 0x00, size);
+  // every slot is preallocated for the possible cpus, hotplug only flips the online mask
+  cpu_info->countLogical = CpuTopologyGet()->countLogical;
+  _CpuSamplerOpen(cpu_info);
+  cpu_info->countCores = CpuTopologyGetGroups(CPU_GRANULARITY_CORE)->count;
+
+  _CpuSamplerAlloc(cpu_info);
+  _CpuSamplerHistoryAlloc(&cpu_info->history, cpu_info->countPadded);
+  cpu_info->rollup = CpuRollupCreate(cpu_info->countLogical);
+  cpu_info->published[0] = (double*)calloc(1, CPU_PUBLISHED_SIZE(cpu_info->countPadded));
+  cpu_info->published[1] = (double*)calloc(1, CPU_PUBLISHED_SIZE(cpu_info->countPadded));
+  _CpuSamplerFrequencyOpen(cpu_info);
   
-  _CpuSamplerGet(cpu_info->port, cpu_info->last);
+  cpu_info->countOnline = _CpuSamplerGet(cpu_info, cpu_info->last);
+  memcpy(cpu_info->onlineLast, cpu_info->online, cpu_info->countLogical);
   CpuSamplerUpdate(cpu_info);
 }
 
 void CpuSamplerUpdate(CpuSummaryInfo* cpu_info)
 {
-  _CpuSamplerGet(cpu_info->port, cpu_info->now);
-  
-  for (natural_t i=0; i<cpu_info->countLogical; i++)
+  natural_t online = _CpuSamplerGet(cpu_info, cpu_info->now);
+  _CpuSamplerFrequencyGet(cpu_info);
+  _CpuSamplerRemap(cpu_info, online);
+  cpu_info->timestamp = _CpuSamplerNanos();
+
+  // the padding lanes stay zero in both tick sets, so the kernel runs over whole vectors
+  _CpuSamplerLoadVector(cpu_info->now, cpu_info->last, cpu_info->load, cpu_info->state, cpu_info->countPadded);
+  _CpuSamplerHistoryPush(&cpu_info->history, cpu_info->load, cpu_info->countLogical);
+  if (cpu_info->rollup != NULL)
   {
-    uint64_t systemTicks = cpu_info->now[i].systemTicks - cpu_info->last[i].systemTicks;
-    uint64_t userTicks   = cpu_info->now[i].userTicks   - cpu_info->last[i].userTicks;
-    uint64_t niceTicks   = cpu_info->now[i].niceTicks   - cpu_info->last[i].niceTicks;
-    uint64_t idleTicks   = cpu_info->now[i].idleTicks   - cpu_info->last[i].idleTicks;
-    {
-      double used = systemTicks + userTicks + niceTicks;
-      double total = used + idleTicks;
-      if (total == 0.0)
-      {
-        total = 1.0;
-      }
-      cpu_info->now[i].load = used/total;
-    }
-    cpu_info->last[i] = cpu_info->now[i];
+    CpuRollupPush(cpu_info->rollup, cpu_info->load, cpu_info->timestamp);
   }
+  _CpuSamplerPublish(cpu_info);
+
+  Ticks* swap = cpu_info->last;
+  cpu_info->last = cpu_info->now;
+  cpu_info->now = swap;
 }
 
 void CpuSamplerSineDemoInit(CpuSummaryInfo* cpu_info)
 {
-  cpu_info->port = mach_host_self();
-  cpu_info->countLogical = _CpuSamplerGet(cpu_info->port, NULL);
-  host_basic_info_t info = _CpuSamplerGetCounts();
-  cpu_info->countCores = info->physical_cpu;
+  cpu_info->countLogical = CpuSamplerGetCount(2);
+  cpu_info->countCores = CpuTopologyGetGroups(CPU_GRANULARITY_CORE)->count;
 
-  size_t size = cpu_info->countLogical*sizeof(Ticks);
-  cpu_info->now = (Ticks*)malloc(size);
-  memset(cpu_info->now, 0x00, size);
+  cpu_info->load = (double*)calloc(cpu_info->countLogical, sizeof(double));
   
   CpuSamplerSineDemoUpdate(cpu_info, 1.0);
 }
 
 void CpuSamplerSineDemoUpdate(CpuSummaryInfo* cpu_info, float speed)
 {
-  static double counter = 0.0;
   for (natural_t i=0; i<cpu_info->countLogical; i++)
   {
-    cpu_info->now[i].load = (sin(3.5*counter)/2.0) + 0.5;
-    counter += (0.025*speed);
+    cpu_info->load[i] = (sin(3.5*cpu_info->phase)/2.0) + 0.5;
+    cpu_info->phase += (0.025*speed);
   }
 }
 
 void CpuSamplerFlatDemoInit(CpuSummaryInfo* cpu_info)
 {
-  cpu_info->port = mach_host_self();
-  cpu_info->countLogical = _CpuSamplerGet(cpu_info->port, NULL);
-  host_basic_info_t info = _CpuSamplerGetCounts();
-  cpu_info->countCores = info->physical_cpu;
+  cpu_info->countLogical = CpuSamplerGetCount(2);
+  cpu_info->countCores = CpuTopologyGetGroups(CPU_GRANULARITY_CORE)->count;
 
-  size_t size = cpu_info->countLogical*sizeof(Ticks);
-  cpu_info->now = (Ticks*)malloc(size);
-  memset(cpu_info->now, 0x00, size);
+  cpu_info->load = (double*)calloc(cpu_info->countLogical, sizeof(double));
   
-  CpuSamplerSineDemoUpdate(cpu_info, 1.0);
+  CpuSamplerFlatDemoUpdate(cpu_info, 1.0);
 }
 
 void CpuSamplerFlatDemoUpdate(CpuSummaryInfo* cpu_info, float speed)
 {
-  static double load = 0.0;
   for (natural_t i=0; i<cpu_info->countLogical; i++)
   {
-    cpu_info->now[i].load = load;
+    cpu_info->load[i] = cpu_info->phase;
+  }
+  cpu_info->phase += (0.04*speed);
+  if (cpu_info->phase > 1.0)
+  {
+    cpu_info->phase = 0.0;
+  }
+}
+
+#ifdef CPU_SAMPLER_BENCHMARK
+
+void CpuSamplerBenchmark(void)
+{
+  const natural_t count = 512;
+  const int iterations = 100000;
+
+  CpuSummaryInfo cpu_info;
+  memset(&cpu_info, 0x00, sizeof(CpuSummaryInfo));
+  cpu_info.countLogical = count;
+  _CpuSamplerAlloc(&cpu_info);
+
+  srandom(42);
+  for (natural_t i=0; i<count; i++)
+  {
+    cpu_info.last->systemTicks[i] = random() % 1000000;
+    cpu_info.last->userTicks[i]   = random() % 1000000;
+    cpu_info.last->niceTicks[i]   = random() % 1000000;
+    cpu_info.last->idleTicks[i]   = random() % 1000000;
+    cpu_info.now->systemTicks[i]  = cpu_info.last->systemTicks[i] + (random() % 10);
+    cpu_info.now->userTicks[i]    = cpu_info.last->userTicks[i]   + (random() % 10);
+    cpu_info.now->niceTicks[i]    = cpu_info.last->niceTicks[i]   + (random() % 10);
+    cpu_info.now->idleTicks[i]    = cpu_info.last->idleTicks[i]   + (random() % 10);
+  }
+
+  double* check = (double*)calloc((1+CPU_LOAD_STATES)*cpu_info.countPadded, sizeof(double));
+  double* check_state[CPU_LOAD_STATES];
+  for (int i=0; i<CPU_LOAD_STATES; i++)
+  {
+    check_state[i] = check + ((i+1)*cpu_info.countPadded);
+  }
+
+  uint64_t start = _CpuSamplerNanos();
+  for (int i=0; i<iterations; i++)
+  {
+    _CpuSamplerLoadScalar(cpu_info.now, cpu_info.last, check, check_state, cpu_info.countPadded);
+    __asm__ __volatile__("" : : "r"(check) : "memory");
+  }
+  uint64_t scalar = _CpuSamplerNanos() - start;
+
+  start = _CpuSamplerNanos();
+  for (int i=0; i<iterations; i++)
+  {
+    _CpuSamplerLoadVector(cpu_info.now, cpu_info.last, cpu_info.load, cpu_info.state, cpu_info.countPadded);
+    __asm__ __volatile__("" : : "r"(cpu_info.load) : "memory");
   }
-  load += (0.04*speed);
-  if (load > 1.0)
+  uint64_t vector = _CpuSamplerNanos() - start;
+
+  double error = 0.0;
+  for (natural_t i=0; i<count; i++)
   {
-    load = 0.0;
+    error = fmax(error, fabs(check[i] - cpu_info.load[i]));
   }
+
+  fprintf(stderr, "CpuSamplerBenchmark: %u cpus, scalar %.1f ns, vector %.1f ns per update (%.2fx), max error %g\n",
+          count, (double)scalar/iterations, (double)vector/iterations, (double)scalar/(double)vector, error);
+
+  free(check);
+  free(cpu_info.ticks[0].systemTicks);
 }
+#endif
@@ -23,36 +23,123 @@
 #ifndef CpuSampler_h
 #define CpuSampler_h
 
+#ifdef __linux__
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/cdefs.h>
+
+typedef unsigned int natural_t;
+typedef unsigned int boolean_t;
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+#else
 #include <mach/mach.h>
 #include <mach/boolean.h>
 #include <mach/processor_info.h>
 #include <mach/mach_init.h>
 #include <mach/mach_host.h>
 #include <mach/mach_error.h>
+#endif
 
 __BEGIN_DECLS
 
+// structure of arrays, one entry per logical cpu, padded to CPU_SAMPLER_LANES
 struct Ticks
 {
-  uint64_t  systemTicks;
-  uint64_t  userTicks;
-  uint64_t  niceTicks;
-  uint64_t  idleTicks;
-  double    load;
+  uint64_t* systemTicks;
+  uint64_t* userTicks;
+  uint64_t* niceTicks;
+  uint64_t* idleTicks;
+  uint64_t* iowaitTicks;  // iowait, irq and steal are only reported on linux
+  uint64_t* irqTicks;
+  uint64_t* stealTicks;
 }
 typedef Ticks;
 
+#define CPU_TICK_ARRAYS (7)
+#define CPU_SAMPLER_LANES (4)
+
+// per state fractions of the elapsed ticks; iowait counts as idle and is not part of load
+enum CpuLoadState
+{
+  CPU_LOAD_USER = 0,
+  CPU_LOAD_SYSTEM,
+  CPU_LOAD_NICE,
+  CPU_LOAD_IOWAIT,
+  CPU_LOAD_IRQ,
+  CPU_LOAD_STEAL,
+  CPU_LOAD_STATES,
+};
+
+// one minute of frames at the fastest refresh rate
+#define CPU_HISTORY_CAPACITY (600)
+
+// single producer, multi consumer ring of per-cpu load frames; frame i lives in
+// frames[(i % capacity) * stride] and is complete once head > i
+struct CpuHistory
+{
+  natural_t capacity;
+  natural_t stride;
+  float*    frames;
+  uint64_t  head;
+}
+typedef CpuHistory;
+
+// up to two contiguous runs of frames, oldest first, each frame holding stride loads
+struct CpuHistoryView
+{
+  const float* frames[2];
+  natural_t    count[2];
+  natural_t    stride;
+  uint64_t     first;
+}
+typedef CpuHistoryView;
+
 struct CpuSummaryInfo
 {
+#ifdef __linux__
+  int         fd;         // persistent /proc/stat descriptor
+  char*       buffer;     // reused for every pread of /proc/stat
+  size_t      bufferSize;
+  int*        freqFd;     // persistent scaling_cur_freq descriptor per cpu, -1 when missing
+#else
   mach_port_t port;
+#endif
   natural_t   countCores;
-  natural_t   countLogical;
+  natural_t   countLogical;   // possible cpus, indexed by cpu number whether online or not
+  natural_t   countPadded;
+  natural_t   countOnline;
   long        frequency;
+  Ticks       ticks[2];
   Ticks*      last;
   Ticks*      now;
+  double*     load;
+  double*     state[CPU_LOAD_STATES];
+  double*     mhz;            // current clock per cpu, 0 when unknown
+  double*     mhzMax;         // maximum clock per cpu, shared with the views
+  unsigned char* online;      // 1 for the cpus reported by the latest sample, published with load
+  unsigned char* onlineLast;
+  uint64_t    onlineGeneration;   // bumped whenever the online mask changes
+  uint64_t    timestamp;      // monotonic ns at which load was sampled
+  CpuHistory  history;
+  struct CpuRollup* rollup;   // min/max/mean tiers fed by every update
+  double*     published[2];   // seqlock double buffer read by CpuSamplerRead
+  uint64_t    publishedTimestamp[2];
+  uint64_t    publishedGeneration[2];
+  uint64_t    publishedSequence[2];   // odd while the slot is rewritten, twice the sequence it holds after
+  uint64_t    sequence;
+  double      phase;          // position of the synthetic demo generators
 }
 typedef CpuSummaryInfo;
 
+//#define CPU_SAMPLER_BENCHMARK
+#ifdef CPU_SAMPLER_BENCHMARK
+  #warning "CPU_SAMPLER_BENCHMARK !"
+#endif
+
 natural_t CpuSamplerGetCount(int granularity);
 
 char* CpuSamplerGetCpuType(void);
@@ -62,12 +149,24 @@ long CpuSamplerGetCpuMHz(void);
 void CpuSamplerInit(CpuSummaryInfo* cpu_info);
 void CpuSamplerUpdate(CpuSummaryInfo* cpu_info);
 
+void CpuSamplerViewAlloc(CpuSummaryInfo* view, natural_t countLogical);
+void CpuSamplerViewInit(CpuSummaryInfo* view, const CpuSummaryInfo* cpu_info);
+boolean_t CpuSamplerRead(const CpuSummaryInfo* cpu_info, CpuSummaryInfo* view);
+
+natural_t CpuSamplerHistoryView(const CpuSummaryInfo* cpu_info, natural_t count, CpuHistoryView* view);
+boolean_t CpuSamplerHistoryValid(const CpuSummaryInfo* cpu_info, const CpuHistoryView* view);
+natural_t CpuSamplerHistorySnapshot(const CpuSummaryInfo* cpu_info, natural_t count, float* frames);
+
 void CpuSamplerSineDemoInit(CpuSummaryInfo* cpu_info);
 void CpuSamplerSineDemoUpdate(CpuSummaryInfo* cpu_info, float speed);
 
 void CpuSamplerFlatDemoInit(CpuSummaryInfo* cpu_info);
 void CpuSamplerFlatDemoUpdate(CpuSummaryInfo* cpu_info, float speed);
 
+#ifdef CPU_SAMPLER_BENCHMARK
+void CpuSamplerBenchmark(void);
+#endif
+
 __END_DECLS
 
 #endif /* CpuSampler_h */
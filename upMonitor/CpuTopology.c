@@ -0,0 +1,312 @@
+// The MIT License (MIT)
+
+// Copyright 2022 HalfMarble LLC
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#include <sys/sysctl.h>
+#endif
+
+#include "CpuTopology.h"
+
+static CpuTopology _topology;
+static boolean_t _topology_initialized = FALSE;
+
+// numbers the keys densely by first appearance and buckets the logical cpus of each key
+static void _CpuTopologyGroup(CpuTopologyGroups* groups, natural_t* map, const uint64_t* keys, natural_t count)
+{
+  uint64_t* seen = (uint64_t*)malloc(count*sizeof(uint64_t));
+  natural_t n = 0;
+  for (natural_t i=0; i<count; i++)
+  {
+    natural_t j = 0;
+    while ((j < n) && (seen[j] != keys[i]))
+    {
+      j++;
+    }
+    if (j == n)
+    {
+      seen[n++] = keys[i];
+    }
+    map[i] = j;
+  }
+  free(seen);
+
+  groups->count = n;
+  groups->start = (natural_t*)calloc(n+1, sizeof(natural_t));
+  groups->members = (natural_t*)malloc(count*sizeof(natural_t));
+  for (natural_t i=0; i<count; i++)
+  {
+    groups->start[map[i]+1]++;
+  }
+  for (natural_t g=0; g<n; g++)
+  {
+    groups->start[g+1] += groups->start[g];
+  }
+  natural_t* cursor = (natural_t*)malloc(n*sizeof(natural_t));
+  memcpy(cursor, groups->start, n*sizeof(natural_t));
+  for (natural_t i=0; i<count; i++)
+  {
+    groups->members[cursor[map[i]]++] = i;
+  }
+  free(cursor);
+}
+
+#ifdef __linux__
+
+#define SYS_CPU_PATH "/sys/devices/system/cpu"
+
+static ssize_t _CpuTopologyRead(const char* path, char* buffer, size_t size)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  ssize_t length = read(fd, buffer, size-1);
+  close(fd);
+  if (length < 0)
+  {
+    return -1;
+  }
+  buffer[length] = '\0';
+  return length;
+}
+
+static long _CpuTopologyReadLong(const char* format, natural_t cpu, long fallback)
+{
+  char path[128];
+  char buffer[64];
+  snprintf(path, sizeof(path), format, cpu);
+  if (_CpuTopologyRead(path, buffer, sizeof(buffer)) <= 0)
+  {
+    return fallback;
+  }
+  return strtol(buffer, NULL, 10);
+}
+
+// marks the cpus of a kernel cpu list such as "0-3,8-11" in mask[count]
+static boolean_t _CpuTopologyReadList(const char* path, unsigned char* mask, natural_t count)
+{
+  char buffer[4096];
+  if (_CpuTopologyRead(path, buffer, sizeof(buffer)) <= 0)
+  {
+    return FALSE;
+  }
+  CpuTopologyParseList(buffer, mask, count);
+  return TRUE;
+}
+
+static void _CpuTopologyBuild(CpuTopology* topology, uint64_t* packageKeys, uint64_t* coreKeys, uint64_t* clusterKeys)
+{
+  natural_t count = topology->countLogical;
+
+  for (natural_t i=0; i<count; i++)
+  {
+    // offline cpus have no topology directory, they become a core of their own
+    long package = _CpuTopologyReadLong(SYS_CPU_PATH"/cpu%u/topology/physical_package_id", i, 0);
+    long die = _CpuTopologyReadLong(SYS_CPU_PATH"/cpu%u/topology/die_id", i, 0);
+    long core = _CpuTopologyReadLong(SYS_CPU_PATH"/cpu%u/topology/core_id", i, -1);
+    packageKeys[i] = (uint64_t)package;
+    if (core < 0)
+    {
+      coreKeys[i] = (1ULL << 63) | i;
+    }
+    else
+    {
+      coreKeys[i] = ((uint64_t)package << 42) | ((uint64_t)die << 21) | (uint64_t)core;
+    }
+    clusterKeys[i] = 0;
+  }
+
+  // hybrid parts: arm reports a relative capacity per cpu, intel splits its pmu into cpu_core and cpu_atom
+  unsigned char* atom = (unsigned char*)calloc(count, 1);
+  if (_CpuTopologyReadList("/sys/devices/cpu_atom/cpus", atom, count))
+  {
+    for (natural_t i=0; i<count; i++)
+    {
+      clusterKeys[i] = atom[i];
+    }
+  }
+  else
+  {
+    for (natural_t i=0; i<count; i++)
+    {
+      clusterKeys[i] = (uint64_t)_CpuTopologyReadLong(SYS_CPU_PATH"/cpu%u/cpu_capacity", i, 0);
+    }
+  }
+  free(atom);
+}
+
+// every cpu that can ever come online, so hotplug never needs more slots
+static natural_t _CpuTopologyCount(void)
+{
+  long count = sysconf(_SC_NPROCESSORS_CONF);
+  char buffer[4096];
+  if (_CpuTopologyRead(SYS_CPU_PATH"/possible", buffer, sizeof(buffer)) > 0)
+  {
+    const char* p = buffer;
+    while ((*p >= '0') && (*p <= '9'))
+    {
+      char* end = NULL;
+      long last = strtol(p, &end, 10);
+      if (last+1 > count)
+      {
+        count = last+1;
+      }
+      p = ((*end == ',') || (*end == '-')) ? end+1 : end;
+    }
+  }
+  return (count > 0) ? (natural_t)count : 1;
+}
+
+#else
+
+static int _CpuTopologySysctl(const char* name, int fallback)
+{
+  int value = 0;
+  size_t size = sizeof(value);
+  if ((sysctlbyname(name, &value, &size, NULL, 0) != 0) || (value <= 0))
+  {
+    return fallback;
+  }
+  return value;
+}
+
+static void _CpuTopologyBuild(CpuTopology* topology, uint64_t* packageKeys, uint64_t* coreKeys, uint64_t* clusterKeys)
+{
+  natural_t count = topology->countLogical;
+  int packages = _CpuTopologySysctl("hw.packages", 1);
+  int levels = _CpuTopologySysctl("hw.nperflevels", 1);
+
+  // Apple silicon numbers the cpus of the slowest perflevel first, intel smt siblings are adjacent
+  natural_t cpu = 0;
+  for (int level=levels-1; level>=0; level--)
+  {
+    char name[64];
+    snprintf(name, sizeof(name), "hw.perflevel%d.logicalcpu", level);
+    int logical = _CpuTopologySysctl(name, (levels == 1) ? (int)count : 0);
+    snprintf(name, sizeof(name), "hw.perflevel%d.physicalcpu", level);
+    int physical = _CpuTopologySysctl(name, (levels == 1) ? _CpuTopologySysctl("hw.physicalcpu_max", logical) : logical);
+    int threads = (physical > 0) ? (logical / physical) : 1;
+    if (threads < 1)
+    {
+      threads = 1;
+    }
+    for (int j=0; (j<logical) && (cpu<count); j++, cpu++)
+    {
+      coreKeys[cpu] = ((uint64_t)level << 32) | (uint64_t)(j / threads);
+      clusterKeys[cpu] = (uint64_t)level;
+    }
+  }
+  for (; cpu<count; cpu++)
+  {
+    coreKeys[cpu] = (1ULL << 63) | cpu;
+    clusterKeys[cpu] = 0;
+  }
+
+  natural_t perPackage = (count + (natural_t)packages - 1) / (natural_t)packages;
+  for (natural_t i=0; i<count; i++)
+  {
+    packageKeys[i] = i / perPackage;
+  }
+}
+
+static natural_t _CpuTopologyCount(void)
+{
+  return (natural_t)_CpuTopologySysctl("hw.logicalcpu_max", 1);
+}
+
+#endif
+
+void CpuTopologyParseList(const char* list, unsigned char* mask, natural_t count)
+{
+  const char* p = list;
+  while ((*p >= '0') && (*p <= '9'))
+  {
+    char* end = NULL;
+    unsigned long first = strtoul(p, &end, 10);
+    unsigned long last = first;
+    if (*end == '-')
+    {
+      last = strtoul(end+1, &end, 10);
+    }
+    for (unsigned long i=first; (i<=last) && (i<count); i++)
+    {
+      mask[i] = 1;
+    }
+    p = (*end == ',') ? end+1 : end;
+  }
+}
+
+const CpuTopology* CpuTopologyGet(void)
+{
+  if (!_topology_initialized)
+  {
+    _topology_initialized = TRUE;
+
+    CpuTopology* topology = &_topology;
+    natural_t count = _CpuTopologyCount();
+    topology->countLogical = count;
+    topology->core = (natural_t*)malloc(count*sizeof(natural_t));
+    topology->package = (natural_t*)malloc(count*sizeof(natural_t));
+    topology->cluster = (natural_t*)malloc(count*sizeof(natural_t));
+
+    uint64_t* packageKeys = (uint64_t*)malloc(count*sizeof(uint64_t));
+    uint64_t* coreKeys = (uint64_t*)malloc(count*sizeof(uint64_t));
+    uint64_t* clusterKeys = (uint64_t*)malloc(count*sizeof(uint64_t));
+    uint64_t* logicalKeys = (uint64_t*)malloc(count*sizeof(uint64_t));
+    natural_t* logical = (natural_t*)malloc(count*sizeof(natural_t));
+    for (natural_t i=0; i<count; i++)
+    {
+      logicalKeys[i] = i;
+    }
+
+    _CpuTopologyBuild(topology, packageKeys, coreKeys, clusterKeys);
+
+    _CpuTopologyGroup(&topology->groups[CPU_GRANULARITY_PACKAGE], topology->package, packageKeys, count);
+    _CpuTopologyGroup(&topology->groups[CPU_GRANULARITY_CORE], topology->core, coreKeys, count);
+    _CpuTopologyGroup(&topology->groups[CPU_GRANULARITY_LOGICAL], logical, logicalKeys, count);
+    _CpuTopologyGroup(&topology->groups[CPU_GRANULARITY_CLUSTER], topology->cluster, clusterKeys, count);
+
+    free(packageKeys);
+    free(coreKeys);
+    free(clusterKeys);
+    free(logicalKeys);
+    free(logical);
+  }
+  return &_topology;
+}
+
+const CpuTopologyGroups* CpuTopologyGetGroups(int granularity)
+{
+  if ((granularity < 0) || (granularity >= CPU_GRANULARITIES))
+  {
+    granularity = CPU_GRANULARITY_PACKAGE;
+  }
+  return &CpuTopologyGet()->groups[granularity];
+}
@@ -0,0 +1,66 @@
+// The MIT License (MIT)
+
+// Copyright 2022 HalfMarble LLC
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef CpuTopology_h
+#define CpuTopology_h
+
+#include "CpuSampler.h"
+
+__BEGIN_DECLS
+
+enum CpuGranularity
+{
+  CPU_GRANULARITY_PACKAGE = 0,
+  CPU_GRANULARITY_CORE,
+  CPU_GRANULARITY_LOGICAL,
+  CPU_GRANULARITY_CLUSTER,   // performance vs efficiency cores
+  CPU_GRANULARITIES,
+};
+
+// members[start[i] .. start[i+1]-1] are the logical cpus of group i,
+// groups are ordered by their lowest logical cpu
+struct CpuTopologyGroups
+{
+  natural_t  count;
+  natural_t* start;
+  natural_t* members;
+}
+typedef CpuTopologyGroups;
+
+struct CpuTopology
+{
+  natural_t  countLogical;
+  natural_t* core;           // logical cpu -> core
+  natural_t* package;        // logical cpu -> package
+  natural_t* cluster;        // logical cpu -> cluster of cores of the same kind
+  CpuTopologyGroups groups[CPU_GRANULARITIES];
+}
+typedef CpuTopology;
+
+const CpuTopology* CpuTopologyGet(void);
+const CpuTopologyGroups* CpuTopologyGetGroups(int granularity);
+
+void CpuTopologyParseList(const char* list, unsigned char* mask, natural_t count);
+
+__END_DECLS
+
+#endif /* CpuTopology_h */
@@ -0,0 +1,585 @@
+// The MIT License (MIT)
+
+// Copyright 2022 HalfMarble LLC
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "SamplerThread.h"
+
+#define SAMPLER_NSEC_PER_SEC (1000000000ULL)
+
+// bar heights are 16 px, unchanged heights for this many samples count as quiet
+#define SAMPLER_ADAPTIVE_LEVELS  (16.0)
+#define SAMPLER_ADAPTIVE_QUIET   (10)
+
+typedef struct _SamplerLoop _SamplerLoop_t;
+struct _SamplerLoop
+{
+  pthread_t       thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t  cond;
+  boolean_t       running;
+  boolean_t       enabled;
+  boolean_t       requested;
+  uint64_t        interval;   // ns between samples
+  uint64_t        deadline;   // monotonic ns of the next sample
+  void            (*sample)(void);
+};
+
+static _SamplerLoop_t _sampler_cpu;
+static _SamplerLoop_t _sampler_top;
+
+static CpuSummaryInfo* _sampler_cpu_info;
+
+/* Adaptive cpu rate, the reference holds the loads of the last sample that moved a bar. */
+static boolean_t _sampler_cpu_adaptive;
+static uint64_t _sampler_cpu_fast;
+static uint64_t _sampler_cpu_slow;
+static double _sampler_cpu_threshold;
+static int _sampler_cpu_quiet;
+static double* _sampler_cpu_reference;
+
+static CpuRecorder* _sampler_recorder;
+
+static SamplerThreadCallback _sampler_cpu_callback;
+static void* _sampler_cpu_context;
+
+/* Seqlock double buffer of the first _sampler_top_count processes of the latest TopSample. */
+static int _sampler_top_count;
+static TopProcessSample_t* _sampler_top_published[2];
+static int _sampler_top_published_count[2];
+static uint64_t _sampler_top_published_timestamp[2];
+static uint64_t _sampler_top_published_sequence[2];
+static uint64_t _sampler_top_sequence;
+
+static SamplerThreadCallback _sampler_top_callback;
+static void* _sampler_top_context;
+
+/* Publishes the app groups of TopIterateGroups instead of single processes. */
+static boolean_t _sampler_top_grouped;
+
+/* The top loop runs while the menu wants it or a process has its threads watched. */
+static boolean_t _sampler_top_wanted;
+
+/* Seqlock double buffer of the threads of _sampler_threads_pid, sampled right after every TopSample. */
+static pid_t _sampler_threads_pid;
+static TopThreadSample_t _sampler_threads_published[2][SAMPLER_THREADS_MAX];
+static int _sampler_threads_published_count[2];
+static pid_t _sampler_threads_published_pid[2];
+static uint64_t _sampler_threads_published_sequence[2];
+static uint64_t _sampler_threads_sequence;
+
+/* Seqlock double buffer of the busiest names that exited in the last _sampler_exited_seconds, 0 publishes none.
+   The top thread starts TopStartLifecycle the first time they are wanted, 1 once it watches, -1 if it can not. */
+static int _sampler_exited_seconds;
+static int _sampler_exited_started;
+static TopExitedSample_t _sampler_exited_published[2][SAMPLER_EXITED_MAX];
+static int _sampler_exited_published_count[2];
+static uint64_t _sampler_exited_published_sequence[2];
+static uint64_t _sampler_exited_sequence;
+
+/* A slot holds twice the sequence it was written for, and an odd value while it is rewritten. The odd value
+   is ordered before the payload stores, so a reader still copying the slot fails its recheck. */
+static inline void _SamplerPublishBegin(uint64_t* slot_sequence, uint64_t sequence)
+{
+  __atomic_store_n(slot_sequence, (2*sequence)-1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void _SamplerPublishEnd(uint64_t* slot_sequence, uint64_t* sequence_latest, uint64_t sequence)
+{
+  __atomic_store_n(slot_sequence, 2*sequence, __ATOMIC_RELEASE);
+  __atomic_store_n(sequence_latest, sequence, __ATOMIC_RELEASE);
+}
+
+/* Starts a read of the slot of the latest sequence, FALSE while it is being rewritten. */
+static inline boolean_t _SamplerReadBegin(const uint64_t* slot_sequences, const uint64_t* sequence_latest, int* slot, uint64_t* begin)
+{
+  uint64_t sequence = __atomic_load_n(sequence_latest, __ATOMIC_ACQUIRE);
+  *slot = (int)(sequence & 1);
+  *begin = __atomic_load_n(&slot_sequences[*slot], __ATOMIC_ACQUIRE);
+  return ((*begin & 1) == 0);
+}
+
+static inline boolean_t _SamplerReadValid(const uint64_t* slot_sequences, int slot, uint64_t begin)
+{
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return (__atomic_load_n(&slot_sequences[slot], __ATOMIC_RELAXED) == begin);
+}
+
+static uint64_t _SamplerNanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * SAMPLER_NSEC_PER_SEC) + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t _SamplerInterval(double seconds)
+{
+  uint64_t interval = (uint64_t)(seconds * (double)SAMPLER_NSEC_PER_SEC);
+  return (interval > 0) ? interval : 1;
+}
+
+static void _SamplerWait(_SamplerLoop_t* loop, uint64_t deadline)
+{
+#ifdef __linux__
+  struct timespec absolute = { (time_t)(deadline / SAMPLER_NSEC_PER_SEC), (long)(deadline % SAMPLER_NSEC_PER_SEC) };
+  pthread_cond_timedwait(&loop->cond, &loop->mutex, &absolute);
+#else
+  uint64_t now = _SamplerNanos();
+  if (deadline > now)
+  {
+    struct timespec relative = { (time_t)((deadline-now) / SAMPLER_NSEC_PER_SEC), (long)((deadline-now) % SAMPLER_NSEC_PER_SEC) };
+    pthread_cond_timedwait_relative_np(&loop->cond, &loop->mutex, &relative);
+  }
+#endif
+}
+
+static void* _SamplerThreadLoop(void* arg)
+{
+  _SamplerLoop_t* loop = (_SamplerLoop_t*)arg;
+  pthread_mutex_lock(&loop->mutex);
+  while (loop->running)
+  {
+    uint64_t now = _SamplerNanos();
+    if (loop->requested || (loop->enabled && (now >= loop->deadline)))
+    {
+      loop->requested = FALSE;
+      pthread_mutex_unlock(&loop->mutex);
+      loop->sample();
+      pthread_mutex_lock(&loop->mutex);
+
+      // deadlines advance by whole periods, so a late sample never shifts the schedule
+      now = _SamplerNanos();
+      if (loop->deadline <= now)
+      {
+        loop->deadline += (((now - loop->deadline) / loop->interval) + 1) * loop->interval;
+      }
+    }
+    else if (loop->enabled)
+    {
+      _SamplerWait(loop, loop->deadline);
+    }
+    else
+    {
+      pthread_cond_wait(&loop->cond, &loop->mutex);
+    }
+  }
+  pthread_mutex_unlock(&loop->mutex);
+  return NULL;
+}
+
+static void _SamplerLoopStart(_SamplerLoop_t* loop, double interval, boolean_t enabled, void (*sample)(void))
+{
+  pthread_mutex_init(&loop->mutex, NULL);
+#ifdef __linux__
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&loop->cond, &attr);
+  pthread_condattr_destroy(&attr);
+#else
+  pthread_cond_init(&loop->cond, NULL);
+#endif
+  loop->running = TRUE;
+  loop->enabled = enabled;
+  loop->requested = FALSE;
+  loop->interval = _SamplerInterval(interval);
+  loop->deadline = _SamplerNanos() + loop->interval;
+  loop->sample = sample;
+  if (pthread_create(&loop->thread, NULL, _SamplerThreadLoop, loop) != 0)
+  {
+    perror("pthread_create error");
+    loop->running = FALSE;
+  }
+}
+
+static void _SamplerLoopStop(_SamplerLoop_t* loop)
+{
+  pthread_mutex_lock(&loop->mutex);
+  boolean_t running = loop->running;
+  loop->running = FALSE;
+  pthread_cond_signal(&loop->cond);
+  pthread_mutex_unlock(&loop->mutex);
+  if (running)
+  {
+    pthread_join(loop->thread, NULL);
+  }
+  pthread_cond_destroy(&loop->cond);
+  pthread_mutex_destroy(&loop->mutex);
+}
+
+static int _SamplerQuantize(double load)
+{
+  return (int)((load * SAMPLER_ADAPTIVE_LEVELS) + 0.5);
+}
+
+static void _SamplerThreadAdapt(void)
+{
+  const double* load = _sampler_cpu_info->load;
+  natural_t count = _sampler_cpu_info->countLogical;
+  boolean_t moved = FALSE;
+  boolean_t burst = FALSE;
+  // the setters reset the quiet count and change the threshold under the same lock
+  pthread_mutex_lock(&_sampler_cpu.mutex);
+  for (natural_t i=0; i<count; i++)
+  {
+    if (fabs(load[i] - _sampler_cpu_reference[i]) > _sampler_cpu_threshold)
+    {
+      burst = TRUE;
+    }
+    if (_SamplerQuantize(load[i]) != _SamplerQuantize(_sampler_cpu_reference[i]))
+    {
+      moved = TRUE;
+    }
+  }
+  if (moved || burst)
+  {
+    memcpy(_sampler_cpu_reference, load, count*sizeof(double));
+    _sampler_cpu_quiet = 0;
+  }
+  else if (_sampler_cpu_quiet < SAMPLER_ADAPTIVE_QUIET)
+  {
+    _sampler_cpu_quiet++;
+  }
+
+  uint64_t interval = _sampler_cpu.interval;
+  if (burst)
+  {
+    interval = _sampler_cpu_fast;
+  }
+  else if (_sampler_cpu_quiet >= SAMPLER_ADAPTIVE_QUIET)
+  {
+    interval = _sampler_cpu_slow;
+  }
+  boolean_t changed = (interval != _sampler_cpu.interval);
+  _sampler_cpu.interval = interval;
+  SamplerThreadCallback callback = _sampler_cpu_callback;
+  void* context = _sampler_cpu_context;
+  pthread_mutex_unlock(&_sampler_cpu.mutex);
+
+  if (changed && (callback != NULL))
+  {
+    callback(context);
+  }
+}
+
+static void _SamplerThreadCpu(void)
+{
+  CpuSamplerUpdate(_sampler_cpu_info);
+  if (_sampler_recorder != NULL)
+  {
+    CpuRecorderWriteCpu(_sampler_recorder, _sampler_cpu_info);
+  }
+  if (__atomic_load_n(&_sampler_cpu_adaptive, __ATOMIC_RELAXED))
+  {
+    _SamplerThreadAdapt();
+  }
+}
+
+static void _SamplerThreadTop(void)
+{
+  int seconds = __atomic_load_n(&_sampler_exited_seconds, __ATOMIC_RELAXED);
+  if ((seconds > 0) && (_sampler_exited_started == 0))
+  {
+    _sampler_exited_started = (TopStartLifecycle() == 0) ? 1 : -1;
+  }
+
+  TopSample();
+
+  uint64_t sequence = __atomic_load_n(&_sampler_top_sequence, __ATOMIC_RELAXED) + 1;
+  int slot = (int)(sequence & 1);
+  int count = 0;
+  _SamplerPublishBegin(&_sampler_top_published_sequence[slot], sequence);
+  const TopProcessSample_t* (*iterate)(void) = __atomic_load_n(&_sampler_top_grouped, __ATOMIC_RELAXED) ? TopIterateGroups : TopIterate;
+  const TopProcessSample_t* psample = iterate();
+  while ((psample != NULL) && (count < _sampler_top_count))
+  {
+    _sampler_top_published[slot][count++] = *psample;
+    psample = iterate();
+  }
+  _sampler_top_published_count[slot] = count;
+  _sampler_top_published_timestamp[slot] = _SamplerNanos();
+  _SamplerPublishEnd(&_sampler_top_published_sequence[slot], &_sampler_top_sequence, sequence);
+
+  if (_sampler_recorder != NULL)
+  {
+    CpuRecorderWriteTop(_sampler_recorder, _sampler_top_published[slot], count, _sampler_top_published_timestamp[slot]);
+  }
+
+  pid_t pid = __atomic_load_n(&_sampler_threads_pid, __ATOMIC_RELAXED);
+  if ((pid > 0) || (_sampler_threads_published_pid[_sampler_threads_sequence & 1] > 0))
+  {
+    sequence = __atomic_load_n(&_sampler_threads_sequence, __ATOMIC_RELAXED) + 1;
+    slot = (int)(sequence & 1);
+    _SamplerPublishBegin(&_sampler_threads_published_sequence[slot], sequence);
+    _sampler_threads_published_count[slot] = TopSampleThreads(pid, _sampler_threads_published[slot], SAMPLER_THREADS_MAX);
+    _sampler_threads_published_pid[slot] = pid;
+    _SamplerPublishEnd(&_sampler_threads_published_sequence[slot], &_sampler_threads_sequence, sequence);
+  }
+
+  if ((seconds > 0) || (_sampler_exited_published_count[_sampler_exited_sequence & 1] > 0))
+  {
+    sequence = __atomic_load_n(&_sampler_exited_sequence, __ATOMIC_RELAXED) + 1;
+    slot = (int)(sequence & 1);
+    _SamplerPublishBegin(&_sampler_exited_published_sequence[slot], sequence);
+    _sampler_exited_published_count[slot] = ((seconds > 0) && (_sampler_exited_started > 0)) ? TopGetExited(seconds, _sampler_exited_published[slot], SAMPLER_EXITED_MAX) : 0;
+    _SamplerPublishEnd(&_sampler_exited_published_sequence[slot], &_sampler_exited_sequence, sequence);
+  }
+
+  SamplerThreadCallback callback = _sampler_top_callback;
+  if (callback != NULL)
+  {
+    callback(_sampler_top_context);
+  }
+}
+
+void SamplerThreadStart(CpuSummaryInfo* cpu_info, double cpuInterval, double topInterval, int topCount)
+{
+  _sampler_cpu_info = cpu_info;
+
+  _sampler_top_count = topCount;
+  TopSetLimit(topCount);
+  _sampler_top_published[0] = (TopProcessSample_t*)calloc(topCount, sizeof(TopProcessSample_t));
+  _sampler_top_published[1] = (TopProcessSample_t*)calloc(topCount, sizeof(TopProcessSample_t));
+  _sampler_top_sequence = 0;
+
+  _sampler_cpu_adaptive = FALSE;
+  _sampler_cpu_fast = _SamplerInterval(cpuInterval);
+  _sampler_cpu_slow = _sampler_cpu_fast;
+  _sampler_cpu_reference = (double*)calloc(cpu_info->countPadded, sizeof(double));
+
+  _SamplerLoopStart(&_sampler_cpu, cpuInterval, TRUE, _SamplerThreadCpu);
+  _SamplerLoopStart(&_sampler_top, topInterval, FALSE, _SamplerThreadTop);
+}
+
+void SamplerThreadStop(void)
+{
+  _SamplerLoopStop(&_sampler_cpu);
+  _SamplerLoopStop(&_sampler_top);
+
+  free(_sampler_top_published[0]);
+  free(_sampler_top_published[1]);
+  _sampler_top_published[0] = NULL;
+  _sampler_top_published[1] = NULL;
+  free(_sampler_cpu_reference);
+  _sampler_cpu_reference = NULL;
+}
+
+void SamplerThreadSetCpuInterval(double interval)
+{
+  pthread_mutex_lock(&_sampler_cpu.mutex);
+  _sampler_cpu_fast = _SamplerInterval(interval);
+  _sampler_cpu_quiet = 0;
+  _sampler_cpu.interval = _sampler_cpu_fast;
+  _sampler_cpu.deadline = _SamplerNanos() + _sampler_cpu.interval;
+  pthread_cond_signal(&_sampler_cpu.cond);
+  pthread_mutex_unlock(&_sampler_cpu.mutex);
+}
+
+void SamplerThreadSetCpuAdaptive(boolean_t adaptive, double slowInterval, double threshold)
+{
+  pthread_mutex_lock(&_sampler_cpu.mutex);
+  _sampler_cpu_adaptive = adaptive;
+  _sampler_cpu_slow = adaptive ? _SamplerInterval(slowInterval) : _sampler_cpu_fast;
+  _sampler_cpu_threshold = threshold;
+  _sampler_cpu_quiet = 0;
+  _sampler_cpu.interval = _sampler_cpu_fast;
+  _sampler_cpu.deadline = _SamplerNanos() + _sampler_cpu.interval;
+  pthread_cond_signal(&_sampler_cpu.cond);
+  pthread_mutex_unlock(&_sampler_cpu.mutex);
+}
+
+void SamplerThreadSetCpuCallback(SamplerThreadCallback callback, void* context)
+{
+  pthread_mutex_lock(&_sampler_cpu.mutex);
+  _sampler_cpu_context = context;
+  _sampler_cpu_callback = callback;
+  pthread_mutex_unlock(&_sampler_cpu.mutex);
+}
+
+double SamplerThreadGetCpuInterval(void)
+{
+  pthread_mutex_lock(&_sampler_cpu.mutex);
+  uint64_t interval = _sampler_cpu.interval;
+  pthread_mutex_unlock(&_sampler_cpu.mutex);
+  return (double)interval / (double)SAMPLER_NSEC_PER_SEC;
+}
+
+static void _SamplerTopUpdateEnabled(void)
+{
+  boolean_t enabled = _sampler_top_wanted || (_sampler_threads_pid > 0);
+  if (enabled && !_sampler_top.enabled)
+  {
+    _sampler_top.deadline = _SamplerNanos();
+  }
+  _sampler_top.enabled = enabled;
+  pthread_cond_signal(&_sampler_top.cond);
+}
+
+void SamplerThreadSetTopEnabled(boolean_t enabled)
+{
+  pthread_mutex_lock(&_sampler_top.mutex);
+  _sampler_top_wanted = enabled;
+  _SamplerTopUpdateEnabled();
+  pthread_mutex_unlock(&_sampler_top.mutex);
+}
+
+// takes effect with the next top sample
+void SamplerThreadSetTopGrouped(boolean_t grouped)
+{
+  __atomic_store_n(&_sampler_top_grouped, grouped, __ATOMIC_RELAXED);
+}
+
+// exits stay watched once started, seconds 0 only stops publishing them
+void SamplerThreadSetTopExited(int seconds)
+{
+  __atomic_store_n(&_sampler_exited_seconds, (seconds > 0) ? seconds : 0, __ATOMIC_RELAXED);
+}
+
+// the threads of pid are sampled with every top sample, and top sampling keeps running, until pid is 0
+void SamplerThreadSetThreadsPid(pid_t pid)
+{
+  pthread_mutex_lock(&_sampler_top.mutex);
+  __atomic_store_n(&_sampler_threads_pid, (pid > 0) ? pid : 0, __ATOMIC_RELAXED);
+  _SamplerTopUpdateEnabled();
+  pthread_mutex_unlock(&_sampler_top.mutex);
+}
+
+// one top sample as soon as possible, even while periodic top sampling is disabled
+void SamplerThreadRequestTop(void)
+{
+  pthread_mutex_lock(&_sampler_top.mutex);
+  _sampler_top.requested = TRUE;
+  pthread_cond_signal(&_sampler_top.cond);
+  pthread_mutex_unlock(&_sampler_top.mutex);
+}
+
+// the callback runs on the top sampler thread right after a new snapshot is published
+void SamplerThreadSetTopCallback(SamplerThreadCallback callback, void* context)
+{
+  pthread_mutex_lock(&_sampler_top.mutex);
+  _sampler_top_context = context;
+  _sampler_top_callback = callback;
+  pthread_mutex_unlock(&_sampler_top.mutex);
+}
+
+void SamplerThreadSetRecorder(CpuRecorder* recorder)
+{
+  _sampler_recorder = recorder;
+}
+
+int SamplerThreadReadTop(TopProcessSample_t* samples, int count, uint64_t* timestamp)
+{
+  int copied = 0;
+  for (;;)
+  {
+    if (__atomic_load_n(&_sampler_top_sequence, __ATOMIC_ACQUIRE) == 0)
+    {
+      return 0;
+    }
+    int slot;
+    uint64_t begin;
+    if (!_SamplerReadBegin(_sampler_top_published_sequence, &_sampler_top_sequence, &slot, &begin))
+    {
+      continue;
+    }
+    copied = _sampler_top_published_count[slot];
+    if (copied > count)
+    {
+      copied = count;
+    }
+    memcpy(samples, _sampler_top_published[slot], copied*sizeof(TopProcessSample_t));
+    if (timestamp != NULL)
+    {
+      *timestamp = _sampler_top_published_timestamp[slot];
+    }
+    if (_SamplerReadValid(_sampler_top_published_sequence, slot, begin))
+    {
+      return copied;
+    }
+  }
+}
+
+int SamplerThreadReadThreads(TopThreadSample_t* threads, int count, pid_t* pid)
+{
+  int copied = 0;
+  for (;;)
+  {
+    if (__atomic_load_n(&_sampler_threads_sequence, __ATOMIC_ACQUIRE) == 0)
+    {
+      return 0;
+    }
+    int slot;
+    uint64_t begin;
+    if (!_SamplerReadBegin(_sampler_threads_published_sequence, &_sampler_threads_sequence, &slot, &begin))
+    {
+      continue;
+    }
+    copied = _sampler_threads_published_count[slot];
+    if (copied > count)
+    {
+      copied = count;
+    }
+    memcpy(threads, _sampler_threads_published[slot], copied*sizeof(TopThreadSample_t));
+    if (pid != NULL)
+    {
+      *pid = _sampler_threads_published_pid[slot];
+    }
+    if (_SamplerReadValid(_sampler_threads_published_sequence, slot, begin))
+    {
+      return copied;
+    }
+  }
+}
+
+int SamplerThreadReadExited(TopExitedSample_t* exited, int count)
+{
+  int copied = 0;
+  for (;;)
+  {
+    if (__atomic_load_n(&_sampler_exited_sequence, __ATOMIC_ACQUIRE) == 0)
+    {
+      return 0;
+    }
+    int slot;
+    uint64_t begin;
+    if (!_SamplerReadBegin(_sampler_exited_published_sequence, &_sampler_exited_sequence, &slot, &begin))
+    {
+      continue;
+    }
+    copied = _sampler_exited_published_count[slot];
+    if (copied > count)
+    {
+      copied = count;
+    }
+    memcpy(exited, _sampler_exited_published[slot], copied*sizeof(TopExitedSample_t));
+    if (_SamplerReadValid(_sampler_exited_published_sequence, slot, begin))
+    {
+      return copied;
+    }
+  }
+}
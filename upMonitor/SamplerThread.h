@@ -0,0 +1,74 @@
+// The MIT License (MIT)
+
+// Copyright 2022 HalfMarble LLC
+
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef SamplerThread_h
+#define SamplerThread_h
+
+#include "CpuSampler.h"
+#include "Top.h"
+#include "CpuRecorder.h"
+
+__BEGIN_DECLS
+
+// most threads of one process published by SamplerThreadReadThreads, the busiest ones first
+#define SAMPLER_THREADS_MAX (256)
+// most names of exited processes published by SamplerThreadReadExited, the busiest ones first
+#define SAMPLER_EXITED_MAX (16)
+
+typedef void (*SamplerThreadCallback)(void* context);
+
+// Runs CpuSamplerUpdate and TopSample on their own threads against monotonic deadlines,
+// so neither sampling cadence depends on the main run loop. Cpu results are read with
+// CpuSamplerRead, the top processes with SamplerThreadReadTop.
+void SamplerThreadStart(CpuSummaryInfo* cpu_info, double cpuInterval, double topInterval, int topCount);
+void SamplerThreadStop(void);
+
+void SamplerThreadSetCpuInterval(double interval);
+
+// Adaptive cpu rate: once the quantized bar heights have not moved for a while the cpu
+// loop falls back to slowInterval, and it returns to the interval set above as soon as
+// any cpu's load moves by more than threshold. The callback runs on the cpu sampler
+// thread whenever the current interval changes.
+void SamplerThreadSetCpuAdaptive(boolean_t adaptive, double slowInterval, double threshold);
+void SamplerThreadSetCpuCallback(SamplerThreadCallback callback, void* context);
+double SamplerThreadGetCpuInterval(void);
+void SamplerThreadSetTopEnabled(boolean_t enabled);
+void SamplerThreadRequestTop(void);
+void SamplerThreadSetTopCallback(SamplerThreadCallback callback, void* context);
+void SamplerThreadSetThreadsPid(pid_t pid);
+// publish one entry per app group, with cpu_tree summed over its helpers, instead of single processes
+void SamplerThreadSetTopGrouped(boolean_t grouped);
+// watch process exits with TopStartLifecycle and publish the names that exited in the last seconds, 0 publishes none
+void SamplerThreadSetTopExited(int seconds);
+
+// every cpu sample and top snapshot is appended to recorder; set it while the threads are stopped
+void SamplerThreadSetRecorder(CpuRecorder* recorder);
+
+int SamplerThreadReadTop(TopProcessSample_t* samples, int count, uint64_t* timestamp);
+// the threads of the watched pid as of the latest top sample, pid tells which process they belong to
+int SamplerThreadReadThreads(TopThreadSample_t* threads, int count, pid_t* pid);
+// the exited names as of the latest top sample, none while exits can not be watched
+int SamplerThreadReadExited(TopExitedSample_t* exited, int count);
+
+__END_DECLS
+
+#endif /* SamplerThread_h */
@@ -21,12 +21,35 @@
 // THE SOFTWARE.
 
 #include <stdlib.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
 #include <limits.h>
-#include <libproc.h>
 #include <pwd.h>
+#include <pthread.h>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/prctl.h>
+#include <poll.h>
+#include <linux/netlink.h>
+#include <linux/connector.h>
+#include <linux/cn_proc.h>
+#else
+#include <libproc.h>
 
 #include <sys/param.h>
 #include <sys/sysctl.h>
+#include <sys/event.h>
 
 #include <mach/mach.h>
 #include <mach/task.h>
@@ -34,11 +57,48 @@
 #include <mach/mach_port.h>
 #include <mach/mach_types.h>
 #include <mach/mach_time.h>
-
-#include <CoreFoundation/CoreFoundation.h>
+#endif
 
 #include "Top.h"
+#ifdef TOP_BENCHMARK
+// only the comparison against the former tree index uses it
 #include "rb.h"
+#endif
+
+#ifdef __linux__
+
+typedef unsigned int boolean_t;
+
+#ifndef TRUE
+#define TRUE  1
+#define FALSE 0
+#endif
+
+#define NSEC_PER_SEC          (1000000000ull)
+#define NSEC_PER_USEC         (1000ull)
+#define NSEC_PER_MSEC         (1000000ull)
+
+#define PROC_PATH             "/proc"
+
+// getdents64 chunk, enough for a few hundred /proc entries per call
+#define PROC_DIRENT_BUFFER    (32*1024)
+
+// /proc/<pid>/stat is a single line, the comm field alone is at most 64 bytes
+#define PROC_PID_STAT_MAX     (1024)
+
+// descriptor limit asked for, half of it may be spent on keeping /proc/<pid>/stat open
+#define PROC_STAT_FDS_WANTED  (65536)
+
+struct linux_dirent64
+{
+  uint64_t       d_ino;
+  int64_t        d_off;
+  unsigned short d_reclen;
+  unsigned char  d_type;
+  char           d_name[];
+};
+
+#endif
 
 #define TIME_VALUE_TO_TIMEVAL(a, r) do { \
   (r)->tv_sec = (a)->seconds;             \
@@ -57,630 +117,3795 @@ typedef struct _TopProcessInfo _TopProcessInfo_t;
 struct _TopProcessInfo
 {
   TopProcessSample_t sample;
-  rb_node(_TopProcessInfo_t) node_new;
-  rb_node(_TopProcessInfo_t) node_sorted;
+  uint32_t index;               /* position in _top_records */
+  boolean_t fetched;            /* the static fields are read once per process */
+  uint32_t disk_sequence;       /* sample the disk totals were last read in */
+  _TopProcessInfo_t* parent;    /* process tree of the latest sample, NULL for a group root */
+  _TopProcessInfo_t* child;
+  _TopProcessInfo_t* sibling;
+#ifdef __linux__
+  int stat_fd;                  /* /proc/<pid>/stat kept open between samples, -1 once over the budget */
+#else
+  uint32_t watched;             /* generation whose exit kqueue reports, 0 for none */
+#endif
+  uint32_t children_sequence;   /* sample children_timens was read in, 0 before the first one */
+  uint64_t children_timens;     /* cpu of the children reaped so far, whole lives */
+  uint64_t children_grown;      /* growth of children_timens in the latest sample */
+  uint64_t children_credit;     /* cpu of exits already accounted for that this parent has yet to reap */
+  _TopProcessInfo_t* next;      /* free list link while the record is unused */
+};
+
+/* An exit as the lifecycle thread saw it, before a sample folds it in. */
+typedef struct _TopExit _TopExit_t;
+struct _TopExit
+{
+  pid_t pid;
+  pid_t ppid;                   /* linux: the parent that reaps it, 0 when the kernel does not say */
+  uint32_t generation;          /* darwin: of the record that asked for the exit */
+  boolean_t missed;             /* gone before its usage could be read, only pid and ppid are set */
+  uint64_t start_timens;        /* linux: tells a reused pid, like the sample field */
+  uint64_t total_timens;        /* cpu of the whole life */
+  uint64_t children_timens;     /* of the children it reaped, linux only counts them in whole ticks */
+  uint64_t timens;              /* when it exited, on the sampling clock */
+  char name[TOP_MAX_SAMPLE_NAME_SIZE+1];
+};
+
+/* Credit of exits whose parent no sample has listed, see _top_credit_add. */
+typedef struct _TopCredit _TopCredit_t;
+struct _TopCredit
+{
+  pid_t pid;
+  uint64_t timens;
 };
 
-static TopProcessInfo_t _top_process_info;
+/* cpu of the exited processes of one name, in one second buckets over the last TOP_EXITED_SECONDS. */
+typedef struct _TopExited _TopExited_t;
+struct _TopExited
+{
+  char name[TOP_MAX_SAMPLE_NAME_SIZE+1];
+  uint64_t latest;              /* newest second with a bucket */
+  uint64_t seconds[TOP_EXITED_SECONDS];
+  uint64_t timens[TOP_EXITED_SECONDS];
+  uint32_t count[TOP_EXITED_SECONDS];
+};
 
-static uint32_t _top_sequence;
-static uint32_t _top_process_count;
-static mach_port_t _top_port;
-static uint64_t _timens;
-static uint64_t _p_timens;
+/* Open addressing pid index: linear probing over a power of two table that is kept at most half full. */
+typedef struct _TopPidSlot _TopPidSlot_t;
+struct _TopPidSlot
+{
+  pid_t pid;
+  _TopProcessInfo_t* pinfo;     /* NULL for an empty slot */
+};
 
-/* Buffer that is large enough to hold the entire argument area of a process. */
-static char *_top_arg_buffer;
-static int _top_arg_max;
+#define TOP_PID_TABLE_MIN (1024)
+#define TOP_SLAB_RECORDS (256)
 
-/* Cache of uid->username translations. */
-static CFMutableDictionaryRef _top_username_hash_table;
-//static CFMutableDictionaryRef _top_hash_table;
+#define TOP_WORKERS_MAX (64)
+#define TOP_HALF_LIFE (5.0)
+#define TOP_EXITS_MAX (65536)
+#define TOP_CREDITS_MAX (4096)
+#define TOP_POOL_CHUNK (32)
 
-static rb_tree(_TopProcessInfo_t) _top_pid_tree;
-static rb_tree(_TopProcessInfo_t) _top_sorted_tree;
-static boolean_t _top_is_sorted;
-static _TopProcessInfo_t* _top_iterator;
+typedef struct TopContext TopContext_t;
 
-static void simpleFree(CFAllocatorRef allocator, const void *value)
+/* Worker 0 is the sampling thread itself, the others are pool threads. Each one only writes the records
+   of the chunks it claims, so the pid index is never touched while the pool runs. */
+typedef struct _TopWorker _TopWorker_t;
+struct _TopWorker
 {
-  free((void *)value);
-}
+  TopContext_t* context;
+  pthread_t thread;
+  uint64_t generation;          /* last batch this worker ran, seeded before the thread starts */
+  uint32_t syscalls;            /* made by this worker during the latest sample */
+#ifdef __linux__
+  char* buffer;                 /* reused for every pread of /proc/<pid>/stat */
+#endif
+};
 
-static const void* stringRetain(CFAllocatorRef allocator, const void *value)
+typedef void (*_TopPoolFunc)(_TopWorker_t* worker, uint32_t index);
+
+/* Everything one sampler owns. Contexts share nothing but the constants below and the username cache, so
+   each one may sample on its own thread. */
+struct TopContext
 {
-  return strdup(value);
-}
+  TopProcessInfo_t process_info;
+
+  uint32_t sequence;
+  uint32_t process_count;
+  uint32_t version;             /* bumped whenever ranked or groups change, cursors compare it */
+#ifdef __linux__
+  int proc_fd;                  /* persistent /proc descriptor, rewound for every sample */
+  char* dirent_buffer;
+#else
+  mach_port_t port;
+  uint64_t* thread_handles;
+  uint32_t thread_handles_capacity;
+#endif
+  /* Buffer for the argument area of a process, KERN_ARGMAX bytes on darwin, grown to fit on linux. */
+  char *arg_buffer;
+  int arg_max;
+  TopSpan_t* arg_spans;         /* the arguments followed by the environment */
+  uint32_t arg_spans_capacity;
+  uint32_t list_syscalls;       /* made while listing the pids of the latest sample */
+  uint32_t syscalls;
+  uint64_t timens;
+  uint64_t p_timens;
+  /* Previous and current sample on the clock process start times use, to tell processes born in between. */
+  uint64_t started_after;
+  uint64_t started_last;
+
+  _TopPidSlot_t* pid_table;
+  uint32_t pid_mask;
+  uint32_t pid_used;
+
+  /* Live records, kept dense so that the per sample passes walk an array rather than a tree. */
+  _TopProcessInfo_t** records;
+  uint32_t records_count;
+  uint32_t records_capacity;
+
+  /* Records are carved from slabs that are only released with the context, dead ones go back onto the free
+     list. */
+  _TopProcessInfo_t* free_list;
+  _TopProcessInfo_t** slabs;
+  uint32_t slabs_count;
+
+  /* Ranked processes, best first; while ranking the first ranked_count entries are a min heap on cpu. */
+  _TopProcessInfo_t** ranked;
+  uint32_t ranked_count;
+  uint32_t ranked_capacity;
+  uint32_t limit;               /* 0 ranks every process */
+
+  /* Group roots ranked on cpu_tree, best first, and the preorder walk of the process forest that sums it. */
+  _TopProcessInfo_t** groups;
+  uint32_t groups_count;
+  uint32_t groups_capacity;
+  _TopProcessInfo_t** tree_order;
+  uint32_t tree_capacity;
+
+  /* Pids of the current sample and their records, the records are read in parallel by the worker pool. */
+  pid_t* pids;
+  _TopProcessInfo_t** pids_records;
+  uint32_t pids_count;
+  uint32_t pids_capacity;
+
+  _TopWorker_t* workers;
+  uint32_t workers_count;
+  uint32_t workers_requested;
 
-static Boolean stringEqual(const void *value1, const void *value2)
+  /* Metrics besides cpu and the rank weights, set from any thread and picked up by the next sample. */
+  pthread_mutex_t settings_lock;
+  uint32_t metrics_requested;
+  double rank_weights_requested[TOP_RANK_KEYS];
+  uint32_t metrics;
+  double rank_weights[TOP_RANK_KEYS];
+  boolean_t rank_cpu_only;
+  uint32_t rank_cpu_requested;
+  uint32_t rank_cpu;
+  double half_life_requested;
+  double half_life;
+  double smooth_alpha;          /* weight of the latest interval in cpu_smooth, for the elapsed time */
+
+  pthread_mutex_t pool_lock;
+  pthread_cond_t pool_start;
+  pthread_cond_t pool_done;
+  uint64_t pool_generation;
+  uint32_t pool_pending;
+  boolean_t pool_shutdown;
+  _TopPoolFunc pool_func;
+  uint32_t pool_count;
+  uint32_t pool_next;
+
+  /* Threads of the one process TopContextSampleThreads watches, each sample in tid order so it can be matched
+     against the previous one. After the match the previous array is reused to rank the threads. */
+  TopThreadSample_t* threads;
+  TopThreadSample_t* threads_last;
+  uint32_t threads_count;
+  uint32_t threads_last_count;
+  uint32_t threads_capacity;
+  pid_t threads_pid;
+  uint64_t threads_timens;
+
+  /* Exits the lifecycle thread queues for the next sample, which swaps the two arrays. */
+  int lifecycle_fd;             /* proc connector socket or kqueue, -1 while exits are not watched */
+  int lifecycle_wake[2];        /* pipe that stops the lifecycle thread */
+  pthread_t lifecycle_thread;
+  pthread_mutex_t lifecycle_lock;
+  _TopExit_t* exits;
+  uint32_t exits_count;
+  uint32_t exits_capacity;
+  _TopExit_t* exits_folded;
+  uint32_t exits_folded_capacity;
+  uint32_t exits_missed;        /* exits whose cpu could not be read any more, or that overflowed the queue */
+  _TopCredit_t* credits;
+  uint32_t credits_count;
+  uint32_t credits_capacity;
+
+  /* Names of exited processes, found through an open addressing index of their positions plus one. */
+  _TopExited_t* exited;
+  uint32_t exited_count;
+  uint32_t exited_capacity;
+  uint32_t* exited_index;
+  uint32_t exited_mask;
+};
+
+/* Constants of the host, set up once for all contexts. */
+static pthread_once_t _top_once = PTHREAD_ONCE_INIT;
+#ifdef __linux__
+static uint64_t _top_tick_nanos;      /* length of a USER_HZ clock tick */
+static uint64_t _top_page_size;       /* statm counts pages */
+static uint32_t _top_stat_fds;        /* per process descriptors currently held open, by every context */
+static uint32_t _top_stat_fds_max;    /* half of RLIMIT_NOFILE, the rest is left to the app */
+#else
+static mach_timebase_info_data_t _top_timebase;
+#endif
+/* Every record gets a new generation, and so does one whose pid turns out to belong to a new process. */
+static uint32_t _top_generation;
+
+/* uid->username table, sorted on uid. Names are never freed, so a returned name stays valid. */
+typedef struct _TopUsername _TopUsername_t;
+struct _TopUsername
 {
-  return strcmp(value1, value2) == 0;
-}
+  uid_t uid;
+  const char* name;             /* NULL until the resolver answers, and for a uid without an account */
+};
+static pthread_once_t _top_usernames_once = PTHREAD_ONCE_INIT;
+static pthread_rwlock_t _top_usernames_lock = PTHREAD_RWLOCK_INITIALIZER;
+static _TopUsername_t* _top_usernames;
+static uint32_t _top_usernames_count;
+static uint32_t _top_usernames_capacity;
+
+/* Uids the resolver thread still has to look up, it loads the account database first. */
+static pthread_mutex_t _top_resolver_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _top_resolver_wake = PTHREAD_COND_INITIALIZER;
+static uid_t* _top_resolver_queue;
+static uint32_t _top_resolver_count;
+static uint32_t _top_resolver_capacity;
 
-static int _top_compare_pid_func(const _TopProcessInfo_t *a, const _TopProcessInfo_t *b)
+/* The context behind the TopInit family, with the walks TopIterate and TopIterateGroups keep between calls. */
+static TopContext_t* _top_context;
+static TopCursor_t _top_cursor;
+static TopCursor_t _top_groups_cursor;
+
+typedef boolean_t (*_TopRankFunc)(const _TopProcessInfo_t *a, const _TopProcessInfo_t *b);
+
+/* Strict order for ranking, equal cpu falls back to the lower pid so the order is stable between samples. */
+static boolean_t _top_ranks_before(const _TopProcessInfo_t *a, const _TopProcessInfo_t *b)
 {
-  if (a->sample.pid < b->sample.pid) return -1;
-  if (a->sample.pid > b->sample.pid) return 1;
-  return 0;
+  if (a->sample.cpu != b->sample.cpu)
+  {
+    return a->sample.cpu > b->sample.cpu;
+  }
+  return a->sample.pid < b->sample.pid;
 }
 
-static int _top_compare_cpu_func(const _TopProcessInfo_t *a, const _TopProcessInfo_t *b)
+/* The same order on the weighted score, when ranking on more than cpu. */
+static boolean_t _top_score_ranks_before(const _TopProcessInfo_t *a, const _TopProcessInfo_t *b)
 {
-  if (a->sample.cpu > b->sample.cpu) return -1;
-  if (a->sample.cpu < b->sample.cpu) return 1;
-  return 0;
+  if (a->sample.score != b->sample.score)
+  {
+    return a->sample.score > b->sample.score;
+  }
+  return a->sample.pid < b->sample.pid;
 }
 
-static void _top_insert(_TopProcessInfo_t *pinfo)
+/* The same order for group roots, on the cpu of their whole subtree. */
+static boolean_t _top_tree_ranks_before(const _TopProcessInfo_t *a, const _TopProcessInfo_t *b)
 {
-  rb_node_new(&_top_pid_tree, pinfo, node_new);
-  rb_insert(&_top_pid_tree, pinfo, _top_compare_pid_func, _TopProcessInfo_t, node_new);
+  if (a->sample.cpu_tree != b->sample.cpu_tree)
+  {
+    return a->sample.cpu_tree > b->sample.cpu_tree;
+  }
+  return a->sample.pid < b->sample.pid;
 }
 
-static void _top_remove(_TopProcessInfo_t *pinfo)
+static inline uint32_t _top_pid_hash(pid_t pid)
 {
-  rb_remove(&_top_pid_tree, pinfo, _TopProcessInfo_t, node_new);
+  return (uint32_t)pid * 2654435761u;
 }
 
-static _TopProcessInfo_t* _top_search(pid_t pid)
+static void _top_pid_table_alloc(TopContext_t* ctx, uint32_t capacity)
 {
-  _TopProcessInfo_t* retval, key;
+  _TopPidSlot_t* table = ctx->pid_table;
+  uint32_t mask = ctx->pid_mask;
 
-  key.sample.pid = pid;
-  rb_search(&_top_pid_tree, &key, _top_compare_pid_func, node_new, retval);
-  if (retval == rb_tree_nil(&_top_pid_tree))
+  ctx->pid_table = (_TopPidSlot_t *)calloc(capacity, sizeof(_TopPidSlot_t));
+  ctx->pid_mask = capacity-1;
+  ctx->pid_used = 0;
+  if (table != NULL)
   {
-    retval = NULL;
+    for (uint32_t i=0; i<=mask; i++)
+    {
+      if (table[i].pinfo != NULL)
+      {
+        uint32_t j = _top_pid_hash(table[i].pid) & ctx->pid_mask;
+        while (ctx->pid_table[j].pinfo != NULL)
+        {
+          j = (j+1) & ctx->pid_mask;
+        }
+        ctx->pid_table[j] = table[i];
+        ctx->pid_used++;
+      }
+    }
+    free(table);
   }
-  return retval;
 }
 
-TopProcessSample_t* TopGetSample(pid_t pid)
+static void _top_index_init(TopContext_t* ctx)
 {
-  struct _TopProcessInfo *info = _top_search(pid);
-  if (info != NULL)
+  if (ctx->pid_table == NULL)
   {
-    return &info->sample;
+    _top_pid_table_alloc(ctx, TOP_PID_TABLE_MIN);
+    ctx->records_capacity = TOP_PID_TABLE_MIN;
+    ctx->records = (_TopProcessInfo_t **)malloc(ctx->records_capacity*sizeof(_TopProcessInfo_t *));
   }
-  else
+}
+
+static _TopProcessInfo_t* _top_alloc(TopContext_t* ctx)
+{
+  if (ctx->free_list == NULL)
   {
-    return NULL;
+    _TopProcessInfo_t* slab = (_TopProcessInfo_t *)malloc(TOP_SLAB_RECORDS*sizeof(_TopProcessInfo_t));
+    if (slab == NULL)
+    {
+      return NULL;
+    }
+    ctx->slabs = (_TopProcessInfo_t **)realloc(ctx->slabs, (ctx->slabs_count+1)*sizeof(_TopProcessInfo_t *));
+    ctx->slabs[ctx->slabs_count++] = slab;
+    for (int i=TOP_SLAB_RECORDS-1; i>=0; i--)
+    {
+      slab[i].next = ctx->free_list;
+      ctx->free_list = &slab[i];
+    }
   }
+  _TopProcessInfo_t* pinfo = ctx->free_list;
+  ctx->free_list = pinfo->next;
+  memset(pinfo, 0, sizeof(_TopProcessInfo_t));
+#ifdef __linux__
+  pinfo->stat_fd = -1;
+#endif
+  pinfo->sample.generation = __atomic_add_fetch(&_top_generation, 1, __ATOMIC_RELAXED);
+  return pinfo;
 }
 
-static void _top_destroy(_TopProcessInfo_t *pinfo)
+#ifdef __linux__
+static void _top_close_stat(_TopProcessInfo_t *pinfo)
 {
-  _top_remove(pinfo);
-  free(pinfo);
+  if (pinfo->stat_fd >= 0)
+  {
+    close(pinfo->stat_fd);
+    pinfo->stat_fd = -1;
+    __atomic_fetch_sub(&_top_stat_fds, 1, __ATOMIC_RELAXED);
+  }
 }
+#endif
 
-static int __attribute__((noinline)) _top_kinfo_for_pid(struct kinfo_proc* kinfo, pid_t pid)
+static void _top_free(TopContext_t* ctx, _TopProcessInfo_t *pinfo)
 {
-  size_t miblen = 4;
-  int mib[miblen];
-  mib[0] = CTL_KERN;
-  mib[1] = KERN_PROC;
-  mib[2] = KERN_PROC_PID;
-  mib[3] = pid;
-  size_t len = sizeof(struct kinfo_proc);
-  return sysctl(mib, (u_int)miblen, kinfo, &len, NULL, 0);
+#ifdef __linux__
+  _top_close_stat(pinfo);
+#endif
+  pinfo->next = ctx->free_list;
+  ctx->free_list = pinfo;
 }
 
-static int __attribute__((noinline)) _top_update_for_pid(pid_t pid, double system)
+static void _top_insert(TopContext_t* ctx, _TopProcessInfo_t *pinfo)
 {
-  _TopProcessInfo_t* pinfo = _top_search((pid_t)pid);
-  if (pinfo == NULL)
-  {
-    pinfo = (_TopProcessInfo_t *)calloc(1, sizeof(_TopProcessInfo_t));
-    if (pinfo == NULL)
-    {
-      return (-1);
-    }
-    pinfo->sample.pid = (pid_t)pid;
-    _top_insert(pinfo);
-  }
-  
-#if 1
-  struct proc_taskallinfo pidinfo;
-  memset(&pidinfo, 0, sizeof(pidinfo));
-  proc_pidinfo(pid, PROC_PIDTASKALLINFO, 0, &pidinfo, PROC_PIDTASKALLINFO_SIZE);
-  if (pinfo->sample.name[0] == 0)
-  {
-    pinfo->sample.tprio = pidinfo.ptinfo.pti_priority;
-    pinfo->sample.status = pidinfo.pbsd.pbi_status;
-    pinfo->sample.flags = pidinfo.pbsd.pbi_flags;
-    pinfo->sample.ppid = pidinfo.pbsd.pbi_ppid;
-    strncpy(pinfo->sample.name, pidinfo.pbsd.pbi_name, TOP_MAX_SAMPLE_NAME_SIZE);
-  }
-#else
-  res = _top_parse_args(pinfo, &kinfo);
-  if (res != 0)
-  {
-    _top_destroy(pinfo);
-    return -6;
-  }
-#endif
-  
-  struct kinfo_proc kinfo;
-  int res = _top_kinfo_for_pid(&kinfo, pid);
-  if (res != 0)
+  if ((ctx->pid_used+1)*2 > ctx->pid_mask+1)
   {
-    return (-2);
+    _top_pid_table_alloc(ctx, (ctx->pid_mask+1)*2);
   }
-  
-  if (kinfo.kp_proc.p_stat == SZOMB)
+  uint32_t i = _top_pid_hash(pinfo->sample.pid) & ctx->pid_mask;
+  while (ctx->pid_table[i].pinfo != NULL)
   {
-    return (-3);
-  }
-  
-  pinfo->sample.uid = kinfo.kp_eproc.e_ucred.cr_uid;
-  pinfo->sample.sequence_last = pinfo->sample.sequence;
-  pinfo->sample.sequence = _top_sequence;
-  
-  task_name_t task;
-  kern_return_t kr = task_name_for_pid(mach_task_self(), pid, &task);
-  if (kr != KERN_SUCCESS) {
-    return (-4);
+    i = (i+1) & ctx->pid_mask;
   }
-  
-  struct task_basic_info_64 ti;
-  mach_msg_type_number_t count = TASK_BASIC_INFO_64_COUNT;
-  kr = task_info(task, TASK_BASIC_INFO_64, (task_info_t)&ti, &count);
-  if (kr != KERN_SUCCESS) {
-    mach_port_deallocate(mach_task_self(), task);
-    _top_destroy(pinfo);
-    return (-5);
-  }
-  pinfo->sample.total_timens = TIME_VALUE_TO_NS(&ti.user_time) + TIME_VALUE_TO_NS(&ti.system_time);
-  
-#if 0
-  struct rusage_info_v5 ri;
-  proc_pid_rusage(pid, RUSAGE_INFO_V5, (rusage_info_t)&ri);
-  pinfo->sample.total_timens += (ri.ri_user_time + ri.ri_system_time);
-#else
-  struct task_thread_times_info tti;
-  count = TASK_THREAD_TIMES_INFO_COUNT;
-  kr = task_info(task, TASK_THREAD_TIMES_INFO, (task_info_t)&tti, &count);
-  if (kr != KERN_SUCCESS)
+  ctx->pid_table[i].pid = pinfo->sample.pid;
+  ctx->pid_table[i].pinfo = pinfo;
+  ctx->pid_used++;
+
+  if (ctx->records_count == ctx->records_capacity)
   {
-    fprintf(stderr, "ERROR: task_info(TASK_THREAD_TIMES_INFO)\n");
+    ctx->records_capacity *= 2;
+    ctx->records = (_TopProcessInfo_t **)realloc(ctx->records, ctx->records_capacity*sizeof(_TopProcessInfo_t *));
   }
-  uint64_t process_total_timens = TIME_VALUE_TO_NS(&tti.user_time)+TIME_VALUE_TO_NS(&tti.system_time);
-  pinfo->sample.total_timens += process_total_timens;
-#endif
-  
-  uint64_t last_timens = _p_timens;
-  uint64_t last_total_timens = pinfo->sample.p_total_timens;
-  unsigned long long elapsed_us = (_timens - last_timens) / NSEC_PER_USEC;
-  unsigned long long used_us = (pinfo->sample.total_timens - last_total_timens) / NSEC_PER_USEC;
-  pinfo->sample.cpu = (double)used_us*100.0/(double)elapsed_us;
-  pinfo->sample.p_total_timens = pinfo->sample.total_timens;
-  
-  mach_port_deallocate(mach_task_self(), task);
-  
-  return (0);
+  pinfo->index = ctx->records_count;
+  ctx->records[ctx->records_count++] = pinfo;
 }
 
-static double _top_nanos(void)
+/* Backward shift deletion, so the table never needs tombstones. */
+static void _top_remove(TopContext_t* ctx, _TopProcessInfo_t *pinfo)
 {
-  static mach_timebase_info_data_t mtid = {0, 0};
-  if (mtid.numer == 0)
+  uint32_t i = _top_pid_hash(pinfo->sample.pid) & ctx->pid_mask;
+  while (ctx->pid_table[i].pinfo != pinfo)
   {
-    if (mach_timebase_info(&mtid) != KERN_SUCCESS)
+    if (ctx->pid_table[i].pinfo == NULL)
     {
-      return -1.0;
+      return;
     }
+    i = (i+1) & ctx->pid_mask;
   }
-  
-  static long numProcessors = 0;
-  if (numProcessors <= 0)
+  uint32_t j = i;
+  for (;;)
   {
-    numProcessors = sysconf(_SC_NPROCESSORS_ONLN);
-    if (numProcessors <= 0)
+    j = (j+1) & ctx->pid_mask;
+    if (ctx->pid_table[j].pinfo == NULL)
+    {
+      break;
+    }
+    uint32_t home = _top_pid_hash(ctx->pid_table[j].pid) & ctx->pid_mask;
+    if (((j - home) & ctx->pid_mask) >= ((j - i) & ctx->pid_mask))
     {
-      return -2.0;
+      ctx->pid_table[i] = ctx->pid_table[j];
+      i = j;
     }
   }
-  
-  return (mach_absolute_time() * (double)mtid.numer) / (double)mtid.denom;
+  ctx->pid_table[i].pinfo = NULL;
+  ctx->pid_used--;
+
+  _TopProcessInfo_t* last = ctx->records[--ctx->records_count];
+  ctx->records[pinfo->index] = last;
+  last->index = pinfo->index;
 }
 
-int TopInit()
+static _TopProcessInfo_t* _top_search(TopContext_t* ctx, pid_t pid)
 {
-  _top_port = MACH_PORT_NULL;
-    
-  _top_sequence = 0;
-
+  if (ctx->pid_table == NULL)
   {
-    int  mib[2];
-    mib[0] = CTL_KERN;
-    mib[1] = KERN_ARGMAX;
-
-    size_t size = sizeof(_top_arg_max);
-    if (sysctl(mib, 2, &_top_arg_max, &size, NULL, 0) == -1)
-    {
-      return -1;
-    }
-    _top_arg_buffer = (char *)malloc(_top_arg_max);
-    if (_top_arg_buffer == NULL)
+    return NULL;
+  }
+  uint32_t i = _top_pid_hash(pid) & ctx->pid_mask;
+  while (ctx->pid_table[i].pinfo != NULL)
+  {
+    if (ctx->pid_table[i].pid == pid)
     {
-      return -2;
+      return ctx->pid_table[i].pinfo;
     }
+    i = (i+1) & ctx->pid_mask;
   }
-  
-  _top_port = mach_host_self();
+  return NULL;
+}
 
-  rb_tree_new(&_top_pid_tree, node_new);
+TopProcessSample_t* TopContextGetSample(TopContext_t* ctx, pid_t pid)
+{
+  struct _TopProcessInfo *info = _top_search(ctx, pid);
+  if (info != NULL)
+  {
+    return &info->sample;
+  }
+  else
+  {
+    return NULL;
+  }
+}
 
-  CFDictionaryValueCallBacks tableCallbacks = { 0, stringRetain, simpleFree, NULL, stringEqual };
-  _top_username_hash_table = CFDictionaryCreateMutable(NULL, 0, NULL, &tableCallbacks);
+static void _top_destroy(TopContext_t* ctx, _TopProcessInfo_t *pinfo)
+{
+  _top_remove(ctx, pinfo);
+  _top_free(ctx, pinfo);
+}
 
-//  CFDictionaryValueCallBacks table2Callbacks = { 0, NULL, simpleFree, NULL, NULL };
-//  _top_hash_table = CFDictionaryCreateMutable(NULL, 0, NULL, &table2Callbacks);
-  
-  memset(&_top_process_info, 0, sizeof(TopProcessInfo_t));
-  
-  return TopSample();
+/* The pid of the record now belongs to another process: forget the old one but keep the slot in the index.
+   Runs on any pool worker, which owns the record while it runs. */
+static void _top_renew(_TopProcessInfo_t *pinfo)
+{
+  pid_t pid = pinfo->sample.pid;
+#ifdef __linux__
+  _top_close_stat(pinfo);
+#endif
+  memset(&pinfo->sample, 0, sizeof(TopProcessSample_t));
+  pinfo->sample.pid = pid;
+  pinfo->sample.generation = __atomic_add_fetch(&_top_generation, 1, __ATOMIC_RELAXED);
+  pinfo->fetched = FALSE;
+  pinfo->disk_sequence = 0;
+  pinfo->children_sequence = 0;
+  pinfo->children_timens = 0;
+  pinfo->children_grown = 0;
+  pinfo->children_credit = 0;
 }
 
-void TopSort(void)
+/* The first time a process is seen its whole lifetime is only charged to the interval when it was born
+   within it, an older process just records its baseline. The first sample has no interval at all. */
+static inline boolean_t _top_seen_late(const TopContext_t* ctx, const _TopProcessInfo_t *pinfo)
 {
-  _TopProcessInfo_t  *pinfo, *ppinfo;
-  
-  _top_iterator = NULL;
-  
-  _top_is_sorted = 1;
-    
-  _top_process_count = 0;
-  
-  rb_tree_new(&_top_sorted_tree, node_sorted);
-  rb_first(&_top_pid_tree, node_new, pinfo);
-  for (; pinfo != rb_tree_nil(&_top_pid_tree); pinfo = ppinfo)
+  return (pinfo->sample.sequence_last == 0) && ((ctx->sequence == 1) || (pinfo->sample.start_timens < ctx->started_after));
+}
+
+/* Adds the latest interval to the ring, the moving average and the peak of the ring. */
+static void _top_history_push(const TopContext_t* ctx, TopProcessSample_t* sample)
+{
+  sample->cpu_smooth = (sample->history_count == 0) ? sample->cpu : sample->cpu_smooth + (ctx->smooth_alpha * (sample->cpu - sample->cpu_smooth));
+  sample->history_head = (uint8_t)((sample->history_head+1) % TOP_HISTORY_SIZE);
+  sample->cpu_history[sample->history_head] = (float)sample->cpu;
+  if (sample->history_count < TOP_HISTORY_SIZE)
   {
-    rb_next(&_top_pid_tree, pinfo, _TopProcessInfo_t, node_new, ppinfo);
-    
-    if (pinfo->sample.sequence == _top_sequence)
-    {
-      rb_node_new(&_top_sorted_tree, pinfo, node_sorted);
-      rb_insert(&_top_sorted_tree, pinfo, _top_compare_cpu_func, _TopProcessInfo_t, node_sorted);
-      
-      _top_process_count++;
-    }
-    else
+    sample->history_count++;
+  }
+  float peak = 0.0f;
+  for (uint32_t i=0; i<sample->history_count; i++)
+  {
+    float value = sample->cpu_history[(sample->history_head + TOP_HISTORY_SIZE - i) % TOP_HISTORY_SIZE];
+    if (value > peak)
     {
-      _top_destroy(pinfo);
+      peak = value;
     }
   }
+  sample->cpu_peak = peak;
 }
 
-int TopSample(void)
+/* cpu% over the interval since the previous sample. */
+static void _top_account(TopContext_t* ctx, _TopProcessInfo_t *pinfo)
 {
-  static double _top_cpu_system_last = 0.0;
+  if (_top_seen_late(ctx, pinfo))
+  {
+    pinfo->sample.cpu = 0.0;
+    pinfo->sample.p_total_timens = pinfo->sample.total_timens;
+    return;
+  }
 
-  _top_sequence++;
-  
-  _top_iterator = NULL;
-  
-  _top_is_sorted = 0;
-  
-  double system = 0.0;
-  double top_cpu_system = _top_nanos();
-  if (top_cpu_system > _top_cpu_system_last)
+  uint64_t last_timens = ctx->p_timens;
+  uint64_t last_total_timens = pinfo->sample.p_total_timens;
+  unsigned long long elapsed_us = (ctx->timens - last_timens) / NSEC_PER_USEC;
+  unsigned long long used_us = (pinfo->sample.total_timens - last_total_timens) / NSEC_PER_USEC;
+  pinfo->sample.cpu = (double)used_us*100.0/(double)elapsed_us;
+  pinfo->sample.p_total_timens = pinfo->sample.total_timens;
+  _top_history_push(ctx, &pinfo->sample);
+}
+
+/* Disk bytes per second since the previous sample, from the running totals of the process. Totals that were
+   not read in the previous sample, because the metric was off, only set the baseline. */
+static void _top_account_disk(TopContext_t* ctx, _TopProcessInfo_t *pinfo, uint64_t read, uint64_t written)
+{
+  double elapsed = (double)(ctx->timens - ctx->p_timens) / (double)NSEC_PER_SEC;
+  if ((pinfo->disk_sequence != pinfo->sample.sequence_last) || _top_seen_late(ctx, pinfo) || (elapsed <= 0.0))
   {
-    system = top_cpu_system - _top_cpu_system_last;
+    pinfo->sample.disk_read = 0.0;
+    pinfo->sample.disk_write = 0.0;
   }
-  
-  if (_top_sequence != 1)
+  else
   {
-    _p_timens = _timens;
-    _timens = clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+    pinfo->sample.disk_read = (read > pinfo->sample.disk_read_total) ? (double)(read - pinfo->sample.disk_read_total) / elapsed : 0.0;
+    pinfo->sample.disk_write = (written > pinfo->sample.disk_write_total) ? (double)(written - pinfo->sample.disk_write_total) / elapsed : 0.0;
   }
-  
-  static pid_t* pids = NULL;
-  int num_pids = proc_listallpids(NULL, 0);
-  if (num_pids > 0)
+  pinfo->sample.disk_read_total = read;
+  pinfo->sample.disk_write_total = written;
+  pinfo->disk_sequence = pinfo->sample.sequence;
+}
+
+/* The reaped children total of a parent grows by the whole life of every child it reaps, which covers the
+   processes whose exit was never read. Runs on any pool worker, _top_lifecycle_fold takes out what the exits
+   already accounted for. A process born since the previous sample has reaped nothing before it, an older one
+   or one seen before the exits were watched just records its baseline. */
+static void _top_account_children(TopContext_t* ctx, _TopProcessInfo_t* pinfo, uint64_t children)
+{
+  if (pinfo->children_sequence != 0)
   {
-    int size = num_pids*sizeof(pid_t);
-    pids = realloc(pids, size);
-    {
-      num_pids = proc_listallpids(pids, size);
-      for (int i=0; i<num_pids; i++)
-      {
-        int err = _top_update_for_pid(pids[i], system);
-        if (err != 0)
-        {
-          fprintf(stderr, "_top_update_for_pid(%d) returned %d\n", pids[i], err);
-        }
-      }
-    }
+    pinfo->children_grown = (children > pinfo->children_timens) ? children - pinfo->children_timens : 0;
+  }
+  else if ((pinfo->sample.sequence_last == 0) && !_top_seen_late(ctx, pinfo))
+  {
+    pinfo->children_grown = children;
   }
+  pinfo->children_timens = children;
+  pinfo->children_sequence = ctx->sequence;
+}
 
-  _top_cpu_system_last = top_cpu_system;
-  
-  TopSort();
-  
-  return _top_process_count;
+static void _top_pids_reserve(TopContext_t* ctx, uint32_t count)
+{
+  if (count > ctx->pids_capacity)
+  {
+    ctx->pids_capacity = (count > 2*ctx->pids_capacity) ? count : 2*ctx->pids_capacity;
+    ctx->pids = (pid_t *)realloc(ctx->pids, ctx->pids_capacity*sizeof(pid_t));
+    ctx->pids_records = (_TopProcessInfo_t **)realloc(ctx->pids_records, ctx->pids_capacity*sizeof(_TopProcessInfo_t *));
+  }
 }
 
-const TopProcessSample_t* TopIterate(void)
+static TopThreadSample_t* _top_threads_append(TopContext_t* ctx)
 {
-  if (_top_is_sorted)
+  if (ctx->threads_count == ctx->threads_capacity)
   {
-    if (_top_iterator == NULL)
-    {
-      rb_first(&_top_sorted_tree, node_sorted, _top_iterator);
-    }
-    else
+    ctx->threads_capacity = (ctx->threads_capacity > 0) ? 2*ctx->threads_capacity : 64;
+    ctx->threads = (TopThreadSample_t *)realloc(ctx->threads, ctx->threads_capacity*sizeof(TopThreadSample_t));
+    ctx->threads_last = (TopThreadSample_t *)realloc(ctx->threads_last, ctx->threads_capacity*sizeof(TopThreadSample_t));
+  }
+  TopThreadSample_t* thread = &ctx->threads[ctx->threads_count++];
+  memset(thread, 0, sizeof(TopThreadSample_t));
+  return thread;
+}
+
+/* Runs on the lifecycle thread. A missed exit is still queued, so the fold can pass its credit on. */
+static void _top_lifecycle_queue(TopContext_t* ctx, const _TopExit_t* exit)
+{
+  pthread_mutex_lock(&ctx->lifecycle_lock);
+  if ((exit != NULL) && (ctx->exits_count < TOP_EXITS_MAX))
+  {
+    if (ctx->exits_count == ctx->exits_capacity)
     {
-      rb_next(&_top_sorted_tree, _top_iterator, _TopProcessInfo_t, node_sorted, _top_iterator);
+      ctx->exits_capacity = (ctx->exits_capacity > 0) ? 2*ctx->exits_capacity : 256;
+      ctx->exits = (_TopExit_t *)realloc(ctx->exits, ctx->exits_capacity*sizeof(_TopExit_t));
     }
-    if (_top_iterator == rb_tree_nil(&_top_sorted_tree))
+    ctx->exits[ctx->exits_count++] = *exit;
+    if (exit->missed)
     {
-      _top_iterator = NULL;
+      ctx->exits_missed++;
     }
   }
   else
   {
-    boolean_t dead;
+    ctx->exits_missed++;
+  }
+  pthread_mutex_unlock(&ctx->lifecycle_lock);
+}
+
+#ifdef __linux__
+
+static uint64_t _top_clock_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * NSEC_PER_SEC) + (uint64_t)ts.tv_nsec;
+}
+
+/* The starttime field of /proc/<pid>/stat counts clock ticks from boot, suspend included, so this is rounded
+   down to a tick as well. */
+static uint64_t _top_start_clock_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_BOOTTIME, &ts);
+  uint64_t nanos = ((uint64_t)ts.tv_sec * NSEC_PER_SEC) + (uint64_t)ts.tv_nsec;
+  return nanos - (nanos % _top_tick_nanos);
+}
 
-    if (_top_iterator == NULL)
+/* Reads /proc/<pid>/stat into the worker buffer, NULL terminated, returns its length. The first read opens it
+   relative to the cached /proc descriptor and takes the uid from fstat, later ones are a single pread on the
+   descriptor kept in the record, as long as the budget allows it. */
+static ssize_t _top_read_stat(_TopWorker_t* worker, _TopProcessInfo_t* pinfo, pid_t pid)
+{
+  TopContext_t* ctx = worker->context;
+  int fd = pinfo->stat_fd;
+  if (fd < 0)
+  {
+    char path[32];
+    snprintf(path, sizeof(path), "%d/stat", (int)pid);
+    worker->syscalls++;
+    fd = openat(ctx->proc_fd, path, O_RDONLY|O_CLOEXEC);
+    if (fd < 0)
     {
-      rb_first(&_top_pid_tree, node_new, _top_iterator);
+      return -1;
     }
-    else
+    if (!pinfo->fetched)
     {
-      rb_next(&_top_pid_tree, _top_iterator, _TopProcessInfo_t, node_new, _top_iterator);
+      // /proc/<pid> belongs to the effective uid of the process
+      struct stat st;
+      worker->syscalls++;
+      if (fstat(fd, &st) != 0)
+      {
+        close(fd);
+        return -1;
+      }
+      pinfo->sample.uid = st.st_uid;
     }
+  }
 
-    do
+  worker->syscalls++;
+  ssize_t length = pread(fd, worker->buffer, PROC_PID_STAT_MAX-1, 0);
+  if (pinfo->stat_fd < 0)
+  {
+    if ((length > 0) && (__atomic_add_fetch(&_top_stat_fds, 1, __ATOMIC_RELAXED) <= _top_stat_fds_max))
     {
-      dead = FALSE;
-      
-      if (_top_iterator == rb_tree_nil(&_top_pid_tree))
-      {
-        _top_iterator = NULL;
-        break;
-      }
-      
-      if (_top_iterator->sample.sequence != _top_sequence)
+      pinfo->stat_fd = fd;
+    }
+    else
+    {
+      if (length > 0)
       {
-        _TopProcessInfo_t  *pinfo;
-        
-        pinfo = _top_iterator;
-        rb_next(&_top_pid_tree, _top_iterator, _TopProcessInfo_t, node_new, _top_iterator);
-        
-        _top_destroy(pinfo);
-        
-        dead = TRUE;
+        __atomic_fetch_sub(&_top_stat_fds, 1, __ATOMIC_RELAXED);
       }
+      worker->syscalls++;
+      close(fd);
     }
-    while (dead);
   }
-
-  return &_top_iterator->sample;
+  if (length > 0)
+  {
+    worker->buffer[length] = '\0';
+  }
+  return length;
 }
 
-const char* TopGetUsername(uid_t uid)
+/* Reads /proc/<pid>/<name> into the worker buffer, NULL terminated, returns its length. */
+static ssize_t _top_read_proc_file(_TopWorker_t* worker, pid_t pid, const char* name)
 {
-  const void* k = (const void *)(uintptr_t)uid;
-  
-  if (!CFDictionaryContainsKey(_top_username_hash_table, k))
+  TopContext_t* ctx = worker->context;
+  char path[32];
+  snprintf(path, sizeof(path), "%d/%s", (int)pid, name);
+  worker->syscalls++;
+  int fd = openat(ctx->proc_fd, path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
   {
-    struct passwd *pwd = getpwuid(uid);
-    if (pwd == NULL)
-      return NULL;
-    CFDictionarySetValue(_top_username_hash_table, k, pwd->pw_name);
+    return -1;
+  }
+  worker->syscalls += 2;
+  ssize_t length = pread(fd, worker->buffer, PROC_PID_STAT_MAX-1, 0);
+  close(fd);
+  if (length > 0)
+  {
+    worker->buffer[length] = '\0';
   }
-  return CFDictionaryGetValue(_top_username_hash_table, k);
+  return length;
 }
 
-//#define DEBUG_ARGS
-#ifdef DEBUG_ARGS
-static inline void _spewraw(char *ptr, unsigned long left)
+static void _top_read_metrics(_TopWorker_t* worker, _TopProcessInfo_t* pinfo, pid_t pid)
 {
-  fprintf(stderr, ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
-  for (int i=0; i<left; i++)
+  TopContext_t* ctx = worker->context;
+  if (ctx->metrics & TOP_METRIC_MEMORY)
   {
-    if (isprint(ptr[i]))
+    // size resident shared text lib data dt, in pages
+    unsigned long long resident = 0, shared = 0;
+    if ((_top_read_proc_file(worker, pid, "statm") > 0) && (sscanf(worker->buffer, "%*u %llu %llu", &resident, &shared) == 2))
     {
-      fprintf(stderr, "%c", ptr[i]);
+      pinfo->sample.resident = resident * _top_page_size;
+      pinfo->sample.footprint = (shared < resident) ? (resident - shared) * _top_page_size : 0;
     }
-    else
+  }
+  if (ctx->metrics & TOP_METRIC_DISK)
+  {
+    // only readable for processes the user may ptrace, the others keep reporting 0
+    unsigned long long read = 0, written = 0;
+    if (_top_read_proc_file(worker, pid, "io") > 0)
     {
-      fprintf(stderr, "[%x]", ptr[i]);
+      char* line = strstr(worker->buffer, "\nread_bytes:");
+      if (line != NULL)
+      {
+        sscanf(line, "\nread_bytes: %llu", &read);
+      }
+      line = strstr(worker->buffer, "\nwrite_bytes:");
+      if (line != NULL)
+      {
+        sscanf(line, "\nwrite_bytes: %llu", &written);
+      }
+      _top_account_disk(ctx, pinfo, read, written);
     }
   }
-  fprintf(stderr, "\n<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n\n\n");
 }
-static inline void _spewbytes(char *ptr, unsigned long left)
+
+/* Runs on any pool worker, records that are not brought up to the current sequence are reaped by _top_rank. */
+static int __attribute__((noinline)) _top_read_pid(_TopWorker_t* worker, _TopProcessInfo_t* pinfo, pid_t pid)
 {
-  fprintf(stderr, ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
-  for (int i=0; i<left; i++)
+  TopContext_t* ctx = worker->context;
+  ssize_t length = _top_read_stat(worker, pinfo, pid);
+  if (length <= 0)
   {
-    if (ptr[i] == 0)
+    if ((length < 0) && (errno == ESRCH) && (pinfo->stat_fd >= 0))
     {
-      fprintf(stderr, "\'\\0\'");
+      // a kept descriptor outlives its process, the pid may already belong to a new one
+      _top_renew(pinfo);
+      return _top_read_pid(worker, pinfo, pid);
     }
-    else if (ptr[i] == '\n')
+    // exited since /proc was listed
+    return ((length == 0) || (errno == ENOENT) || (errno == ESRCH)) ? 0 : (-2);
+  }
+
+  // the comm field may hold spaces and parentheses, the fields that follow start after the last ')'
+  char* comm = strchr(worker->buffer, '(');
+  char* fields = strrchr(worker->buffer, ')');
+  if ((comm == NULL) || (fields == NULL) || (fields < comm))
+  {
+    return (-2);
+  }
+  char state = 0;
+  int ppid = 0;
+  unsigned int flags = 0;
+  unsigned long long utime = 0, stime = 0, start = 0;
+  long long cutime = 0, cstime = 0;
+  long priority = 0;
+  // fields 3 to 22 of proc(5): state ppid pgrp session tty_nr tpgid flags minflt cminflt majflt cmajflt utime stime cutime cstime
+  // priority nice num_threads itrealvalue starttime
+  if (sscanf(fields+1, " %c %d %*d %*d %*d %*d %u %*u %*u %*u %*u %llu %llu %lld %lld %ld %*d %*d %*d %llu",
+             &state, &ppid, &flags, &utime, &stime, &cutime, &cstime, &priority, &start) != 9)
+  {
+    return (-2);
+  }
+  if (state == 'Z')
+  {
+    return (-3);
+  }
+  if (pinfo->fetched && (pinfo->sample.start_timens != start * _top_tick_nanos))
+  {
+    // the pid was reused between two samples without a kept descriptor, start over with the new process
+    _top_renew(pinfo);
+    return _top_read_pid(worker, pinfo, pid);
+  }
+
+  if (!pinfo->fetched)
+  {
+    size_t length = (size_t)(fields - comm - 1);
+    if (length > TOP_MAX_SAMPLE_NAME_SIZE)
     {
-      fprintf(stderr, "\n");
+      length = TOP_MAX_SAMPLE_NAME_SIZE;
     }
-    else if (isprint(ptr[i]))
+    memcpy(pinfo->sample.name, comm+1, length);
+    pinfo->sample.name[length] = '\0';
+    pinfo->sample.start_timens = start * _top_tick_nanos;
+    pinfo->fetched = TRUE;
+  }
+  // the parent changes when the original one exits and the process is reparented
+  pinfo->sample.ppid = (pid_t)ppid;
+  pinfo->sample.tprio = (int32_t)priority;
+  pinfo->sample.status = (uint32_t)state;
+  pinfo->sample.flags = flags;
+
+  pinfo->sample.sequence_last = pinfo->sample.sequence;
+  pinfo->sample.sequence = ctx->sequence;
+
+  pinfo->sample.total_timens = (utime + stime) * _top_tick_nanos;
+  _top_account(ctx, pinfo);
+
+  pinfo->children_grown = 0;
+  if (ctx->lifecycle_fd >= 0)
+  {
+    long long children = ((cutime > 0) ? cutime : 0) + ((cstime > 0) ? cstime : 0);
+    _top_account_children(ctx, pinfo, (uint64_t)children * _top_tick_nanos);
+  }
+
+  if (ctx->metrics != 0)
+  {
+    _top_read_metrics(worker, pinfo, pid);
+  }
+
+  return (0);
+}
+
+static void _top_init_once(void)
+{
+  long ticks = sysconf(_SC_CLK_TCK);
+  _top_tick_nanos = NSEC_PER_SEC / (uint64_t)((ticks > 0) ? ticks : 100);
+  long page = sysconf(_SC_PAGESIZE);
+  _top_page_size = (uint64_t)((page > 0) ? page : 4096);
+  // raise the soft descriptor limit towards the hard one, so the budget covers a busy host
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0)
+  {
+    rlim_t wanted = (limit.rlim_max < PROC_STAT_FDS_WANTED) ? limit.rlim_max : PROC_STAT_FDS_WANTED;
+    if (limit.rlim_cur < wanted)
     {
-      fprintf(stderr, "%c", ptr[i]);
+      limit.rlim_cur = wanted;
+      setrlimit(RLIMIT_NOFILE, &limit);
+      getrlimit(RLIMIT_NOFILE, &limit);
     }
-    else
+    _top_stat_fds_max = (limit.rlim_cur == RLIM_INFINITY) ? (UINT32_MAX/2) : (uint32_t)(limit.rlim_cur/2);
+  }
+}
+
+static int _top_proc_open(TopContext_t* ctx)
+{
+  if (ctx->proc_fd >= 0)
+  {
+    return 0;
+  }
+  ctx->proc_fd = open(PROC_PATH, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (ctx->proc_fd < 0)
+  {
+    return -1;
+  }
+  ctx->dirent_buffer = (char *)malloc(PROC_DIRENT_BUFFER);
+  if (ctx->dirent_buffer == NULL)
+  {
+    return -2;
+  }
+  return 0;
+}
+
+/* The numeric value of a /proc entry name, 0 for anything that is not a pid. */
+static long _top_parse_id(const char* name)
+{
+  if ((name[0] < '1') || (name[0] > '9'))
+  {
+    return 0;
+  }
+  long id = 0;
+  while ((*name >= '0') && (*name <= '9'))
+  {
+    id = (id*10) + (*name++ - '0');
+  }
+  return (*name == '\0') ? id : 0;
+}
+
+/* Lists /proc with getdents64 on the persistent descriptor, keeping every numeric entry. */
+static void _top_list_pids(TopContext_t* ctx)
+{
+  ctx->pids_count = 0;
+  ctx->list_syscalls = 1;
+  if (lseek(ctx->proc_fd, 0, SEEK_SET) != 0)
+  {
+    return;
+  }
+  for (;;)
+  {
+    ctx->list_syscalls++;
+    long size = syscall(SYS_getdents64, ctx->proc_fd, ctx->dirent_buffer, PROC_DIRENT_BUFFER);
+    if (size <= 0)
     {
-      fprintf(stderr, "[%x]", ptr[i]);
+      break;
+    }
+    long offset = 0;
+    while (offset < size)
+    {
+      struct linux_dirent64* entry = (struct linux_dirent64 *)(ctx->dirent_buffer + offset);
+      offset += entry->d_reclen;
+
+      long pid = _top_parse_id(entry->d_name);
+      if (pid <= 0)
+      {
+        continue;
+      }
+      _top_pids_reserve(ctx, ctx->pids_count+1);
+      ctx->pids[ctx->pids_count++] = (pid_t)pid;
     }
   }
-  fprintf(stderr, "\n<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n\n\n");
 }
-#endif
 
-// http://search.cpan.org/src/DURIST/Proc-ProcessTable-0.43/os/darwin.c
-TopProcessInfo_t* TopGetArgs(pid_t pid)
-{  
-  _top_process_info.args_count = 0;
-  _top_process_info.args_length = 0;
-  _top_process_info.envs_count = 0;
-  _top_process_info.envs_length = 0;
-  
-  int mib[3];
-  mib[0] = CTL_KERN;
-  mib[1] = KERN_PROCARGS2;
-  mib[2] = pid;
-  size_t size = _top_arg_max;
-  if (sysctl(mib, 3, _top_arg_buffer, &size, NULL, 0) == KERN_SUCCESS)
+/* Lists /proc/<pid>/task and reads the stat of every thread. Runs on the sampling thread, after TopSample,
+   so it shares the dirent buffer with _top_list_pids. */
+static void _top_list_threads(TopContext_t* ctx, pid_t pid)
+{
+  char path[32];
+  snprintf(path, sizeof(path), "%d/task", (int)pid);
+  int dir = openat(ctx->proc_fd, path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (dir < 0)
   {
-#ifdef DEBUG_ARGS
-    fprintf(stderr, "\n");
-    fprintf(stderr, "\n");
-    _spewraw(_top_arg_buffer, size);
-    fprintf(stderr, "\n");
-    fprintf(stderr, "\n");
-#endif
-    size_t left = size;
-    if (left >= sizeof(int))
-    {
-      char *data = _top_arg_buffer;
-      
-      memcpy(&_top_process_info.args_count, data, sizeof(int));
-      left -= sizeof(int);
-      data += sizeof(int);
-      
-#ifdef DEBUG_ARGS
-      fprintf(stderr, "   args_count: %d\n", _top_process_info.args_count);
-#endif
-      
-      if (left > 0)
-      {
-        // full path
-        size_t length = strlen(data);
-        _top_process_info.command = realloc(_top_process_info.command, length+1);
-        memcpy(_top_process_info.command, data, length);
-        _top_process_info.command[length] ='\0';
-        data += length;
-        left -= length;
-#ifdef DEBUG_ARGS
-        fprintf(stderr, "   args_command: %s\n", _top_process_info.command);
-#endif
-        
-        // skip empty space
-        while ((left > 0) && (data[0] == '\0'))
-        {
-          data++;
-          left--;
-        }
-        
-        // rest of arguments
-        if (left > 0)
+    return;
+  }
+  char buffer[PROC_PID_STAT_MAX];
+  for (;;)
+  {
+    long size = syscall(SYS_getdents64, dir, ctx->dirent_buffer, PROC_DIRENT_BUFFER);
+    if (size <= 0)
+    {
+      break;
+    }
+    long offset = 0;
+    while (offset < size)
+    {
+      struct linux_dirent64* entry = (struct linux_dirent64 *)(ctx->dirent_buffer + offset);
+      offset += entry->d_reclen;
+
+      long tid = _top_parse_id(entry->d_name);
+      if (tid <= 0)
+      {
+        continue;
+      }
+      snprintf(path, sizeof(path), "%ld/stat", tid);
+      int fd = openat(dir, path, O_RDONLY|O_CLOEXEC);
+      if (fd < 0)
+      {
+        continue;
+      }
+      ssize_t length = pread(fd, buffer, sizeof(buffer)-1, 0);
+      close(fd);
+      if (length <= 0)
+      {
+        continue;
+      }
+      buffer[length] = '\0';
+
+      // same layout as the process stat, comm is the thread name
+      char* comm = strchr(buffer, '(');
+      char* fields = strrchr(buffer, ')');
+      if ((comm == NULL) || (fields == NULL) || (fields < comm))
+      {
+        continue;
+      }
+      char state = 0;
+      unsigned long long utime = 0, stime = 0;
+      long priority = 0;
+      if (sscanf(fields+1, " %c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %*d %*d %ld",
+                 &state, &utime, &stime, &priority) != 4)
+      {
+        continue;
+      }
+
+      TopThreadSample_t* thread = _top_threads_append(ctx);
+      thread->tid = (uint64_t)tid;
+      size_t name_length = (size_t)(fields - comm - 1);
+      if (name_length > TOP_MAX_THREAD_NAME_SIZE)
+      {
+        name_length = TOP_MAX_THREAD_NAME_SIZE;
+      }
+      memcpy(thread->name, comm+1, name_length);
+      thread->name[name_length] = '\0';
+      thread->priority = (int32_t)priority;
+      thread->state = (uint32_t)state;
+      thread->total_timens = (utime + stime) * _top_tick_nanos;
+    }
+  }
+  close(dir);
+}
+
+/* Subscribes a proc connector socket to the fork, exec and exit events of every process. Needs
+   CAP_NET_ADMIN on most kernels. */
+static int _top_lifecycle_open(TopContext_t* ctx)
+{
+  (void)ctx;
+  int fd = socket(PF_NETLINK, SOCK_DGRAM|SOCK_CLOEXEC, NETLINK_CONNECTOR);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  // a fork storm sends a burst of events, a bigger buffer overruns later
+  int size = 4*1024*1024;
+  if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) != 0)
+  {
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  }
+  struct sockaddr_nl address;
+  memset(&address, 0, sizeof(address));
+  address.nl_family = AF_NETLINK;
+  address.nl_groups = CN_IDX_PROC;
+  if (bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0)
+  {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+
+  union
+  {
+    struct nlmsghdr header;
+    char bytes[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+  } request;
+  memset(&request, 0, sizeof(request));
+  request.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op));
+  request.header.nlmsg_type = NLMSG_DONE;
+  struct cn_msg* message = (struct cn_msg *)NLMSG_DATA(&request.header);
+  message->id.idx = CN_IDX_PROC;
+  message->id.val = CN_VAL_PROC;
+  message->len = sizeof(enum proc_cn_mcast_op);
+  enum proc_cn_mcast_op op = PROC_CN_MCAST_LISTEN;
+  memcpy(message->data, &op, sizeof(op));
+  if (send(fd, &request, request.header.nlmsg_len, 0) < 0)
+  {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+/* The exit event carries no usage, the final times are read from the zombie before its parent reaps it. A
+   process that is already gone is queued as missed, its parent's reaped children total accounts for it. Returns
+   1 while other threads of the process still run, its final times are read when the last one exits. A leader
+   that is not a zombie was replaced by the thread that called execve, the process goes on. */
+static int _top_lifecycle_exit(TopContext_t* ctx, pid_t pid, pid_t ppid, char* buffer)
+{
+  _TopExit_t exit;
+  memset(&exit, 0, sizeof(exit));
+  exit.pid = pid;
+  exit.ppid = ppid;
+  exit.missed = TRUE;
+
+  char path[32];
+  snprintf(path, sizeof(path), "%d/stat", (int)pid);
+  int fd = openat(ctx->proc_fd, path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+  {
+    _top_lifecycle_queue(ctx, &exit);
+    return 0;
+  }
+  ssize_t length = pread(fd, buffer, PROC_PID_STAT_MAX-1, 0);
+  close(fd);
+  if (length <= 0)
+  {
+    _top_lifecycle_queue(ctx, &exit);
+    return 0;
+  }
+  buffer[length] = '\0';
+
+  char* comm = strchr(buffer, '(');
+  char* fields = strrchr(buffer, ')');
+  char state = 0;
+  int parent = 0;
+  unsigned long long utime = 0, stime = 0, start = 0;
+  long long cutime = 0, cstime = 0;
+  long threads = 0;
+  if ((comm == NULL) || (fields == NULL) || (fields < comm) ||
+      (sscanf(fields+1, " %c %d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu %lld %lld %*d %*d %ld %*d %llu",
+              &state, &parent, &utime, &stime, &cutime, &cstime, &threads, &start) != 8))
+  {
+    _top_lifecycle_queue(ctx, &exit);
+    return 0;
+  }
+  if ((state != 'Z') && (state != 'X'))
+  {
+    return 0;
+  }
+  if (threads > 1)
+  {
+    return 1;
+  }
+  exit.missed = FALSE;
+  exit.ppid = (pid_t)parent;
+  exit.start_timens = start * _top_tick_nanos;
+  exit.total_timens = (utime + stime) * _top_tick_nanos;
+  exit.children_timens = (uint64_t)(((cutime > 0) ? cutime : 0) + ((cstime > 0) ? cstime : 0)) * _top_tick_nanos;
+  exit.timens = _top_clock_nanos();
+  size_t name_length = (size_t)(fields - comm - 1);
+  if (name_length > TOP_MAX_SAMPLE_NAME_SIZE)
+  {
+    name_length = TOP_MAX_SAMPLE_NAME_SIZE;
+  }
+  memcpy(exit.name, comm+1, name_length);
+
+  // stat counts whole ticks, which rounds most short lived processes down to nothing. schedstat has the
+  // nanoseconds of the main thread, the other threads of a process that ends by exit_group are mostly gone
+  // by now and already part of stat
+  snprintf(path, sizeof(path), "%d/schedstat", (int)pid);
+  fd = openat(ctx->proc_fd, path, O_RDONLY|O_CLOEXEC);
+  if (fd >= 0)
+  {
+    length = pread(fd, buffer, PROC_PID_STAT_MAX-1, 0);
+    close(fd);
+    if (length > 0)
+    {
+      buffer[length] = '\0';
+      unsigned long long runtime = strtoull(buffer, NULL, 10);
+      if (runtime > exit.total_timens)
+      {
+        exit.total_timens = runtime;
+      }
+    }
+  }
+  _top_lifecycle_queue(ctx, &exit);
+  return 0;
+}
+
+/* Processes whose leader thread exited while other threads kept running, until the last of them exits. */
+#define TOP_LIFECYCLE_PENDING (64)
+
+static void* _top_lifecycle_thread(void* arg)
+{
+  TopContext_t* ctx = (TopContext_t *)arg;
+  union
+  {
+    struct nlmsghdr header;
+    char bytes[16*1024];
+  } events;
+  char buffer[PROC_PID_STAT_MAX];
+  pid_t pending[TOP_LIFECYCLE_PENDING];
+  int pending_count = 0;
+  struct pollfd fds[2] = {{ctx->lifecycle_fd, POLLIN, 0}, {ctx->lifecycle_wake[0], POLLIN, 0}};
+  for (;;)
+  {
+    if (poll(fds, 2, -1) < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      break;
+    }
+    if (fds[1].revents != 0)
+    {
+      break;
+    }
+    int length = (int)recv(ctx->lifecycle_fd, &events, sizeof(events), MSG_DONTWAIT);
+    if (length <= 0)
+    {
+      if ((length < 0) && (errno == ENOBUFS))
+      {
+        // the socket overran, how many events were dropped is not known
+        _top_lifecycle_queue(ctx, NULL);
+        continue;
+      }
+      if ((length < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+      {
+        continue;
+      }
+      break;
+    }
+    for (struct nlmsghdr* header = &events.header; NLMSG_OK(header, (unsigned int)length); header = NLMSG_NEXT(header, length))
+    {
+      if ((header->nlmsg_type == NLMSG_ERROR) || (header->nlmsg_type == NLMSG_NOOP))
+      {
+        continue;
+      }
+      struct cn_msg* message = (struct cn_msg *)NLMSG_DATA(header);
+      if ((message->id.idx != CN_IDX_PROC) || (message->id.val != CN_VAL_PROC))
+      {
+        continue;
+      }
+      // the event follows the 20 byte connector header, which leaves it only 4 byte aligned
+      struct proc_event event;
+      memset(&event, 0, sizeof(event));
+      memcpy(&event, message->data, (message->len < sizeof(event)) ? message->len : sizeof(event));
+      if (event.what != PROC_EVENT_EXIT)
+      {
+        continue;
+      }
+      // every thread exit is reported, the process only ends with its last thread. That is the leader unless
+      // the leader exited early, then it is one of the threads that follow
+      pid_t tgid = event.event_data.exit.process_tgid;
+      int index = 0;
+      while ((index < pending_count) && (pending[index] != tgid))
+      {
+        index++;
+      }
+      if ((event.event_data.exit.process_pid != tgid) && (index == pending_count))
+      {
+        continue;
+      }
+      int running = _top_lifecycle_exit(ctx, tgid, event.event_data.exit.parent_tgid, buffer);
+      if (!running && (index < pending_count))
+      {
+        memmove(pending+index, pending+index+1, (pending_count-index-1)*sizeof(pid_t));
+        pending_count--;
+      }
+      else if (running && (index == pending_count))
+      {
+        if (pending_count == TOP_LIFECYCLE_PENDING)
         {
-          int index = 0;
-          while ((left > 0) && (index < _top_process_info.args_count))
-          {
-            length = strlen(data)+1;
-            if (length > 1)
-            {
-              _top_process_info.args_length += length;
-              _top_process_info.args_info = realloc(_top_process_info.args_info, _top_process_info.args_length+1);
-              
-              char *string = &_top_process_info.args_info[_top_process_info.args_length-length];
-              memcpy(string, data, length);
-              string[length-1] = '\n';
-              string[length] = '\0';
-            }
-            data += length;
-            left -= length;
-            index++;
-          }
-#ifdef DEBUG_ARGS
-          fprintf(stderr, "---- args_length: [%d]\n", _top_process_info.args_length);
-          fprintf(stderr, "---- args_count: [%d]\n", _top_process_info.args_count);
-          _spewbytes(_top_process_info.args_info, _top_process_info.args_length);
-          fprintf(stderr, "\n");
-#endif
-          
-          if (left > 0)
-          {
-            // skip empty space
-            while ((left > 0) && (data[0] == '\0'))
-            {
-              data++;
-              left--;
-            }
-            
-            // environment
-            if (left > 0)
-            {
-              while (left > 0)
-              {
-                length = strlen(data)+1;
-                if (length > 1)
-                {
-                  _top_process_info.envs_length += length;
-                  _top_process_info.envs_info = realloc(_top_process_info.envs_info, _top_process_info.envs_length+1);
-                  _top_process_info.envs_count++;
-                  
-                  char *string = &_top_process_info.envs_info[_top_process_info.envs_length-length];
-                  memcpy(string, data, length);
-                  string[length-1] = '\n';
-                  string[length] = '\0';
-                }
-
-                data += length;
-                left -= length;
-              }
-#ifdef DEBUG_ARGS
-              fprintf(stderr, "---- envs_length: [%d]\n", _top_process_info.envs_length);
-              fprintf(stderr, "---- envs_count: [%d]\n", _top_process_info.envs_count);
-              _spewbytes(_top_process_info.envs_info, _top_process_info.envs_length);
-#endif
-            }
-          }
+          // the oldest most likely ended while the socket overran
+          memmove(pending, pending+1, (TOP_LIFECYCLE_PENDING-1)*sizeof(pid_t));
+          pending_count--;
         }
+        pending[pending_count++] = tgid;
       }
     }
   }
-  
-  struct kinfo_proc kinfo;
-  int res = _top_kinfo_for_pid(&kinfo, pid);
-  if (res != 0)
+  return NULL;
+}
+
+#else
+
+static int __attribute__((noinline)) _top_kinfo_for_pid(struct kinfo_proc* kinfo, pid_t pid)
+{
+  size_t miblen = 4;
+  int mib[miblen];
+  mib[0] = CTL_KERN;
+  mib[1] = KERN_PROC;
+  mib[2] = KERN_PROC_PID;
+  mib[3] = pid;
+  size_t len = sizeof(struct kinfo_proc);
+  return sysctl(mib, (u_int)miblen, kinfo, &len, NULL, 0);
+}
+
+/* Runs on any pool worker, records that are not brought up to the current sequence are reaped by _top_rank.
+   Every sample is a single PROC_PIDTASKALLINFO call, which replaces the sysctl, task_name_for_pid and the two
+   task_info calls. Its bsd half carries the start time that tells a reused pid, the static fields are only
+   copied out of it once per process. */
+static int __attribute__((noinline)) _top_read_pid(_TopWorker_t* worker, _TopProcessInfo_t* pinfo, pid_t pid)
+{
+  TopContext_t* ctx = worker->context;
+  // zombies have no task left, so this fails for them as well
+  struct proc_taskallinfo allinfo;
+  worker->syscalls++;
+  if (proc_pidinfo(pid, PROC_PIDTASKALLINFO, 0, &allinfo, PROC_PIDTASKALLINFO_SIZE) != PROC_PIDTASKALLINFO_SIZE)
+  {
+    return (errno == ESRCH) ? 0 : (-2);
+  }
+  if (allinfo.pbsd.pbi_status == SZOMB)
+  {
+    return (-3);
+  }
+
+  uint64_t start = (allinfo.pbsd.pbi_start_tvsec * NSEC_PER_SEC) + (allinfo.pbsd.pbi_start_tvusec * NSEC_PER_USEC);
+  if (pinfo->fetched && (pinfo->sample.start_timens != start))
+  {
+    // the pid was reused between two samples
+    _top_renew(pinfo);
+  }
+  if (!pinfo->fetched)
+  {
+    pinfo->sample.uid = allinfo.pbsd.pbi_uid;
+    pinfo->sample.start_timens = start;
+    const char* name = (allinfo.pbsd.pbi_name[0] != 0) ? allinfo.pbsd.pbi_name : allinfo.pbsd.pbi_comm;
+    strncpy(pinfo->sample.name, name, TOP_MAX_SAMPLE_NAME_SIZE);
+    pinfo->fetched = TRUE;
+  }
+  // the parent changes when the original one exits and the process is reparented
+  pinfo->sample.ppid = allinfo.pbsd.pbi_ppid;
+  pinfo->sample.tprio = allinfo.ptinfo.pti_priority;
+  pinfo->sample.status = allinfo.pbsd.pbi_status;
+  pinfo->sample.flags = allinfo.pbsd.pbi_flags;
+  pinfo->sample.sequence_last = pinfo->sample.sequence;
+  pinfo->sample.sequence = ctx->sequence;
+
+  // terminated and live threads together, in mach absolute time units
+  uint64_t total = allinfo.ptinfo.pti_total_user + allinfo.ptinfo.pti_total_system;
+  pinfo->sample.total_timens = (total * _top_timebase.numer) / _top_timebase.denom;
+  _top_account(ctx, pinfo);
+
+  // memory, disk and the reaped children come from the same call
+  boolean_t lifecycle = (ctx->lifecycle_fd >= 0);
+  pinfo->children_grown = 0;
+  if ((ctx->metrics != 0) || lifecycle)
   {
-    if (_top_process_info.name != NULL)
+    struct rusage_info_v2 ri;
+    worker->syscalls++;
+    if (proc_pid_rusage(pid, RUSAGE_INFO_V2, (rusage_info_t *)&ri) == 0)
     {
-      _top_process_info.name[0] = '\0';
+      if (ctx->metrics != 0)
+      {
+        pinfo->sample.resident = ri.ri_resident_size;
+        pinfo->sample.footprint = ri.ri_phys_footprint;
+      }
+      if (ctx->metrics & TOP_METRIC_DISK)
+      {
+        _top_account_disk(ctx, pinfo, ri.ri_diskio_bytesread, ri.ri_diskio_byteswritten);
+      }
+      if (lifecycle)
+      {
+        _top_account_children(ctx, pinfo, ((ri.ri_child_user_time + ri.ri_child_system_time) * _top_timebase.numer) / _top_timebase.denom);
+      }
     }
-    fprintf(stderr, "ERR kinfo_for_pid\n");
-    return &_top_process_info;
   }
-  size = strlen(kinfo.kp_proc.p_comm);
-  _top_process_info.name = realloc(_top_process_info.name, size+1);
-  strcpy(_top_process_info.name, kinfo.kp_proc.p_comm);
+
+  return (0);
+}
+
+static uint64_t _top_clock_nanos(void)
+{
+  return clock_gettime_nsec_np(CLOCK_MONOTONIC_RAW);
+}
+
+static void _top_init_once(void)
+{
+  mach_timebase_info(&_top_timebase);
+}
+
+/* pbi_start_tvsec is wall clock time. */
+static uint64_t _top_start_clock_nanos(void)
+{
+  return clock_gettime_nsec_np(CLOCK_REALTIME);
+}
+
+static void _top_list_pids(TopContext_t* ctx)
+{
+  ctx->pids_count = 0;
+  ctx->list_syscalls = 2;
+  int num_pids = proc_listallpids(NULL, 0);
+  if (num_pids > 0)
+  {
+    // leave room for processes started between the two calls
+    _top_pids_reserve(ctx, num_pids+64);
+    num_pids = proc_listallpids(ctx->pids, ctx->pids_capacity*sizeof(pid_t));
+    if (num_pids > 0)
+    {
+      ctx->pids_count = (uint32_t)num_pids;
+    }
+  }
+}
+
+/* task_for_pid, which task_threads needs, is refused for nearly every process without the debugger
+   entitlement, libproc hands out the same thread_basic_info for any process of the user. */
+static void _top_list_threads(TopContext_t* ctx, pid_t pid)
+{
+  int count = 0;
+  for (;;)
+  {
+    if (ctx->thread_handles_capacity > 0)
+    {
+      int size = proc_pidinfo(pid, PROC_PIDLISTTHREADS, 0, ctx->thread_handles, (int)(ctx->thread_handles_capacity*sizeof(uint64_t)));
+      if (size <= 0)
+      {
+        return;
+      }
+      count = size / (int)sizeof(uint64_t);
+      if ((uint32_t)count < ctx->thread_handles_capacity)
+      {
+        break;
+      }
+    }
+    // a full buffer may have cut the list short
+    ctx->thread_handles_capacity = (ctx->thread_handles_capacity > 0) ? 2*ctx->thread_handles_capacity : 256;
+    ctx->thread_handles = (uint64_t *)realloc(ctx->thread_handles, ctx->thread_handles_capacity*sizeof(uint64_t));
+  }
+
+  for (int i=0; i<count; i++)
+  {
+    struct proc_threadinfo info;
+    if (proc_pidinfo(pid, PROC_PIDTHREADINFO, ctx->thread_handles[i], &info, PROC_PIDTHREADINFO_SIZE) != PROC_PIDTHREADINFO_SIZE)
+    {
+      continue;
+    }
+    TopThreadSample_t* thread = _top_threads_append(ctx);
+    thread->tid = ctx->thread_handles[i];
+    strncpy(thread->name, info.pth_name, TOP_MAX_THREAD_NAME_SIZE);
+    thread->priority = info.pth_curpri;
+    thread->state = (uint32_t)info.pth_run_state;
+    thread->total_timens = info.pth_user_time + info.pth_system_time;
+  }
+}
+
+/* There is no system wide exit feed without an entitlement, the kqueue only hears about the processes a
+   sample has listed, see _top_lifecycle_watch. */
+static int _top_lifecycle_open(TopContext_t* ctx)
+{
+  int fd = kqueue();
+  if (fd < 0)
+  {
+    return -1;
+  }
+  struct kevent change;
+  EV_SET(&change, ctx->lifecycle_wake[0], EVFILT_READ, EV_ADD, 0, 0, NULL);
+  if (kevent(fd, &change, 1, NULL, 0, NULL) != 0)
+  {
+    int err = errno;
+    close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+/* Runs on the sampling thread after every record is read. Asks for the exit of every new process. */
+static void _top_lifecycle_watch(TopContext_t* ctx)
+{
+  struct kevent changes[256];
+  struct kevent receipts[256];
+  int count = 0;
+  for (uint32_t i=0; i<=ctx->pids_count; i++)
+  {
+    if ((count == 256) || ((i == ctx->pids_count) && (count > 0)))
+    {
+      // receipts keep the errors of processes that are already gone out of the event queue
+      kevent(ctx->lifecycle_fd, changes, count, receipts, count, NULL);
+      count = 0;
+    }
+    if (i == ctx->pids_count)
+    {
+      break;
+    }
+    _TopProcessInfo_t* pinfo = ctx->pids_records[i];
+    if ((pinfo->sample.sequence != ctx->sequence) || (pinfo->watched == pinfo->sample.generation))
+    {
+      continue;
+    }
+    EV_SET(&changes[count], pinfo->sample.pid, EVFILT_PROC, EV_ADD|EV_ONESHOT|EV_RECEIPT, NOTE_EXIT, 0,
+           (void *)(uintptr_t)pinfo->sample.generation);
+    pinfo->watched = pinfo->sample.generation;
+    count++;
+  }
+}
+
+static void* _top_lifecycle_thread(void* arg)
+{
+  TopContext_t* ctx = (TopContext_t *)arg;
+  struct kevent events[64];
+  for (;;)
+  {
+    int count = kevent(ctx->lifecycle_fd, NULL, 0, events, 64, NULL);
+    if (count < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      break;
+    }
+    for (int i=0; i<count; i++)
+    {
+      if (events[i].filter == EVFILT_READ)
+      {
+        return NULL;
+      }
+      if ((events[i].filter != EVFILT_PROC) || ((events[i].fflags & NOTE_EXIT) == 0))
+      {
+        continue;
+      }
+      // the zombie keeps its usage until the parent reaps it
+      pid_t pid = (pid_t)events[i].ident;
+      _TopExit_t exit;
+      memset(&exit, 0, sizeof(exit));
+      exit.pid = pid;
+      exit.generation = (uint32_t)(uintptr_t)events[i].udata;
+      struct rusage_info_v2 ri;
+      if (proc_pid_rusage(pid, RUSAGE_INFO_V2, (rusage_info_t *)&ri) != 0)
+      {
+        exit.missed = TRUE;
+        _top_lifecycle_queue(ctx, &exit);
+        continue;
+      }
+      exit.total_timens = ((ri.ri_user_time + ri.ri_system_time) * _top_timebase.numer) / _top_timebase.denom;
+      exit.children_timens = ((ri.ri_child_user_time + ri.ri_child_system_time) * _top_timebase.numer) / _top_timebase.denom;
+      exit.timens = _top_clock_nanos();
+      proc_name(pid, exit.name, sizeof(exit.name));
+      _top_lifecycle_queue(ctx, &exit);
+    }
+  }
+  return NULL;
+}
+
+#endif
+
+static void _top_pool_work(_TopWorker_t* worker)
+{
+  TopContext_t* ctx = worker->context;
+  for (;;)
+  {
+    uint32_t start = __atomic_fetch_add(&ctx->pool_next, TOP_POOL_CHUNK, __ATOMIC_RELAXED);
+    if (start >= ctx->pool_count)
+    {
+      break;
+    }
+    uint32_t end = (start+TOP_POOL_CHUNK < ctx->pool_count) ? start+TOP_POOL_CHUNK : ctx->pool_count;
+    for (uint32_t i=start; i<end; i++)
+    {
+      ctx->pool_func(worker, i);
+    }
+  }
+}
+
+static void* _top_pool_thread(void* arg)
+{
+  _TopWorker_t* worker = (_TopWorker_t *)arg;
+  TopContext_t* ctx = worker->context;
+  pthread_mutex_lock(&ctx->pool_lock);
+  for (;;)
+  {
+    while ((ctx->pool_generation == worker->generation) && !ctx->pool_shutdown)
+    {
+      pthread_cond_wait(&ctx->pool_start, &ctx->pool_lock);
+    }
+    if (ctx->pool_shutdown)
+    {
+      break;
+    }
+    worker->generation = ctx->pool_generation;
+    pthread_mutex_unlock(&ctx->pool_lock);
+
+    _top_pool_work(worker);
+
+    pthread_mutex_lock(&ctx->pool_lock);
+    if (--ctx->pool_pending == 0)
+    {
+      pthread_cond_signal(&ctx->pool_done);
+    }
+  }
+  pthread_mutex_unlock(&ctx->pool_lock);
+  return NULL;
+}
+
+static void _top_pool_stop(TopContext_t* ctx)
+{
+  if (ctx->workers_count > 1)
+  {
+    pthread_mutex_lock(&ctx->pool_lock);
+    ctx->pool_shutdown = 1;
+    pthread_cond_broadcast(&ctx->pool_start);
+    pthread_mutex_unlock(&ctx->pool_lock);
+    for (uint32_t i=1; i<ctx->workers_count; i++)
+    {
+      pthread_join(ctx->workers[i].thread, NULL);
+    }
+    ctx->pool_shutdown = 0;
+  }
+#ifdef __linux__
+  for (uint32_t i=0; i<ctx->workers_count; i++)
+  {
+    free(ctx->workers[i].buffer);
+  }
+#endif
+  free(ctx->workers);
+  ctx->workers = NULL;
+  ctx->workers_count = 0;
+}
+
+static void _top_pool_resize(TopContext_t* ctx, uint32_t count)
+{
+  if ((count == ctx->workers_count) && (ctx->workers != NULL))
+  {
+    return;
+  }
+
+  _top_pool_stop(ctx);
+  ctx->workers = (_TopWorker_t *)calloc(count, sizeof(_TopWorker_t));
+  ctx->workers_count = 1;
+  for (uint32_t i=0; i<count; i++)
+  {
+#ifdef __linux__
+    ctx->workers[i].buffer = (char *)malloc(PROC_PID_STAT_MAX);
+#endif
+    ctx->workers[i].context = ctx;
+    ctx->workers[i].generation = ctx->pool_generation;
+    if ((i > 0) && (pthread_create(&ctx->workers[i].thread, NULL, _top_pool_thread, &ctx->workers[i]) != 0))
+    {
+      break;
+    }
+    ctx->workers_count = i+1;
+  }
+}
+
+/* Calls func for every index below count, spread over the pool in chunks claimed with an atomic cursor. */
+static void _top_pool_run(TopContext_t* ctx, uint32_t count, _TopPoolFunc func)
+{
+  if ((ctx->workers_count <= 1) || (count <= TOP_POOL_CHUNK))
+  {
+    for (uint32_t i=0; i<count; i++)
+    {
+      func(&ctx->workers[0], i);
+    }
+    return;
+  }
+
+  pthread_mutex_lock(&ctx->pool_lock);
+  ctx->pool_func = func;
+  ctx->pool_count = count;
+  ctx->pool_next = 0;
+  ctx->pool_pending = ctx->workers_count-1;
+  ctx->pool_generation++;
+  pthread_cond_broadcast(&ctx->pool_start);
+  pthread_mutex_unlock(&ctx->pool_lock);
+
+  _top_pool_work(&ctx->workers[0]);
+
+  pthread_mutex_lock(&ctx->pool_lock);
+  while (ctx->pool_pending > 0)
+  {
+    pthread_cond_wait(&ctx->pool_done, &ctx->pool_lock);
+  }
+  pthread_mutex_unlock(&ctx->pool_lock);
+}
+
+static void _top_sample_pid(_TopWorker_t* worker, uint32_t index)
+{
+  TopContext_t* ctx = worker->context;
+  _TopProcessInfo_t* pinfo = ctx->pids_records[index];
+  if (pinfo != NULL)
+  {
+    int err = _top_read_pid(worker, pinfo, ctx->pids[index]);
+    if (err != 0)
+    {
+      fprintf(stderr, "_top_read_pid(%d) returned %d\n", ctx->pids[index], err);
+    }
+  }
+}
+
+/* The pid index is only changed here, on the sampling thread, before the pool reads the records. */
+static void _top_update_all(TopContext_t* ctx)
+{
+  _top_pool_resize(ctx, __atomic_load_n(&ctx->workers_requested, __ATOMIC_RELAXED));
+
+  _top_list_pids(ctx);
+  for (uint32_t i=0; i<ctx->pids_count; i++)
+  {
+    _TopProcessInfo_t* pinfo = _top_search(ctx, ctx->pids[i]);
+    if (pinfo == NULL)
+    {
+      pinfo = _top_alloc(ctx);
+      if (pinfo != NULL)
+      {
+        pinfo->sample.pid = ctx->pids[i];
+        _top_insert(ctx, pinfo);
+      }
+    }
+    ctx->pids_records[i] = pinfo;
+  }
+
+  for (uint32_t i=0; i<ctx->workers_count; i++)
+  {
+    ctx->workers[i].syscalls = 0;
+  }
+  _top_pool_run(ctx, ctx->pids_count, _top_sample_pid);
+  ctx->syscalls = ctx->list_syscalls;
+  for (uint32_t i=0; i<ctx->workers_count; i++)
+  {
+    ctx->syscalls += ctx->workers[i].syscalls;
+  }
+#ifndef __linux__
+  if (ctx->lifecycle_fd >= 0)
+  {
+    _top_lifecycle_watch(ctx);
+  }
+#endif
+}
+
+uint32_t TopContextGetSyscalls(const TopContext_t* ctx)
+{
+  return ctx->syscalls;
+}
+
+void TopContextSetWorkers(TopContext_t* ctx, int workers)
+{
+  if (workers < 1)
+  {
+    workers = 1;
+  }
+  if (workers > TOP_WORKERS_MAX)
+  {
+    workers = TOP_WORKERS_MAX;
+  }
+  __atomic_store_n(&ctx->workers_requested, (uint32_t)workers, __ATOMIC_RELAXED);
+}
+
+void TopContextSetMetrics(TopContext_t* ctx, uint32_t metrics)
+{
+  pthread_mutex_lock(&ctx->settings_lock);
+  ctx->metrics_requested = metrics & (TOP_METRIC_MEMORY|TOP_METRIC_DISK);
+  pthread_mutex_unlock(&ctx->settings_lock);
+}
+
+void TopContextSetRankWeights(TopContext_t* ctx, const double* weights)
+{
+  pthread_mutex_lock(&ctx->settings_lock);
+  for (int k = 0; k < TOP_RANK_KEYS; k++)
+  {
+    double weight = (weights != NULL) ? weights[k] : ((k == TOP_RANK_CPU) ? 1.0 : 0.0);
+    ctx->rank_weights_requested[k] = (weight > 0.0) ? weight : 0.0;
+  }
+  pthread_mutex_unlock(&ctx->settings_lock);
+}
+
+void TopContextSetRankCpu(TopContext_t* ctx, int rank_cpu)
+{
+  pthread_mutex_lock(&ctx->settings_lock);
+  ctx->rank_cpu_requested = ((rank_cpu == TOP_CPU_SMOOTH) || (rank_cpu == TOP_CPU_PEAK)) ? (uint32_t)rank_cpu : TOP_CPU_LAST;
+  pthread_mutex_unlock(&ctx->settings_lock);
+}
+
+void TopContextSetHalfLife(TopContext_t* ctx, double seconds)
+{
+  pthread_mutex_lock(&ctx->settings_lock);
+  ctx->half_life_requested = (seconds > 0.0) ? seconds : 0.0;
+  pthread_mutex_unlock(&ctx->settings_lock);
+}
+
+/* Takes over the settings for this sample, a metric that is weighted is collected even when not asked for. */
+static void _top_apply_settings(TopContext_t* ctx)
+{
+  pthread_mutex_lock(&ctx->settings_lock);
+  ctx->metrics = ctx->metrics_requested;
+  ctx->rank_cpu = ctx->rank_cpu_requested;
+  ctx->half_life = ctx->half_life_requested;
+  ctx->rank_cpu_only = TRUE;
+  for (int k = 0; k < TOP_RANK_KEYS; k++)
+  {
+    ctx->rank_weights[k] = ctx->rank_weights_requested[k];
+    if ((k != TOP_RANK_CPU) && (ctx->rank_weights[k] > 0.0))
+    {
+      ctx->rank_cpu_only = FALSE;
+      ctx->metrics |= ((k == TOP_RANK_RESIDENT) || (k == TOP_RANK_FOOTPRINT)) ? TOP_METRIC_MEMORY : TOP_METRIC_DISK;
+    }
+  }
+  pthread_mutex_unlock(&ctx->settings_lock);
+}
+
+static inline double _top_rank_cpu(const TopContext_t* ctx, const TopProcessSample_t *sample)
+{
+  switch (ctx->rank_cpu)
+  {
+    case TOP_CPU_SMOOTH: return sample->cpu_smooth;
+    case TOP_CPU_PEAK: return sample->cpu_peak;
+    default: return sample->cpu;
+  }
+}
+
+static inline double _top_rank_value(const TopContext_t* ctx, const TopProcessSample_t *sample, int key)
+{
+  switch (key)
+  {
+    case TOP_RANK_CPU: return _top_rank_cpu(ctx, sample);
+    case TOP_RANK_RESIDENT: return (double)sample->resident;
+    case TOP_RANK_FOOTPRINT: return (double)sample->footprint;
+    case TOP_RANK_DISK_READ: return sample->disk_read;
+    default: return sample->disk_write;
+  }
+}
+
+/* Scores the live records on the weighted sum of each key over its largest value in this sample, so that
+   percentages, bytes and bytes per second weigh in on the same 0..1 scale. */
+static void _top_score(TopContext_t* ctx)
+{
+  double scale[TOP_RANK_KEYS];
+  for (int k = 0; k < TOP_RANK_KEYS; k++)
+  {
+    scale[k] = 0.0;
+  }
+  for (uint32_t i = 0; i < ctx->records_count; i++)
+  {
+    const TopProcessSample_t *sample = &ctx->records[i]->sample;
+    if (sample->sequence != ctx->sequence)
+    {
+      continue;
+    }
+    for (int k = 0; k < TOP_RANK_KEYS; k++)
+    {
+      double value = _top_rank_value(ctx, sample, k);
+      if (value > scale[k])
+      {
+        scale[k] = value;
+      }
+    }
+  }
+  for (int k = 0; k < TOP_RANK_KEYS; k++)
+  {
+    scale[k] = ((ctx->rank_weights[k] > 0.0) && (scale[k] > 0.0)) ? ctx->rank_weights[k] / scale[k] : 0.0;
+  }
+  for (uint32_t i = 0; i < ctx->records_count; i++)
+  {
+    TopProcessSample_t *sample = &ctx->records[i]->sample;
+    double score = 0.0;
+    for (int k = 0; k < TOP_RANK_KEYS; k++)
+    {
+      score += scale[k] * _top_rank_value(ctx, sample, k);
+    }
+    sample->score = score;
+  }
+}
+
+static int _top_username_compare(const void* a, const void* b)
+{
+  uid_t ua = ((const _TopUsername_t *)a)->uid;
+  uid_t ub = ((const _TopUsername_t *)b)->uid;
+  return (ua < ub) ? -1 : ((ua > ub) ? 1 : 0);
+}
+
+/* Binary search, with the lock held. */
+static _TopUsername_t* _top_username_search(uid_t uid)
+{
+  uint32_t low = 0;
+  uint32_t high = _top_usernames_count;
+  while (low < high)
+  {
+    uint32_t middle = (low+high)/2;
+    if (_top_usernames[middle].uid < uid)
+    {
+      low = middle+1;
+    }
+    else
+    {
+      high = middle;
+    }
+  }
+  return ((low < _top_usernames_count) && (_top_usernames[low].uid == uid)) ? &_top_usernames[low] : NULL;
+}
+
+static void _top_usernames_reserve(uint32_t count)
+{
+  if (count > _top_usernames_capacity)
+  {
+    _top_usernames_capacity = (count > 2*_top_usernames_capacity) ? count : 2*_top_usernames_capacity;
+    _top_usernames = (_TopUsername_t *)realloc(_top_usernames, _top_usernames_capacity*sizeof(_TopUsername_t));
+  }
+}
+
+static void _top_usernames_append(_TopUsername_t** entries, uint32_t* count, uint32_t* capacity, uid_t uid, const char* name)
+{
+  if (*count == *capacity)
+  {
+    *capacity = (*capacity > 0) ? 2*(*capacity) : 64;
+    *entries = (_TopUsername_t *)realloc(*entries, (*capacity)*sizeof(_TopUsername_t));
+  }
+  (*entries)[*count].uid = uid;
+  (*entries)[*count].name = strdup(name);
+  (*count)++;
+}
+
+/* Reads every local account at once: /etc/passwd on linux, which never waits on NSS, getpwent on darwin. The
+   entries are merged with the uids that were looked up meanwhile, which stay queued for getpwuid_r when the
+   database does not know them. */
+static void _top_usernames_load(void)
+{
+  _TopUsername_t* loaded = NULL;
+  uint32_t count = 0;
+  uint32_t capacity = 0;
+#ifdef __linux__
+  FILE* file = fopen("/etc/passwd", "re");
+  if (file != NULL)
+  {
+    char* line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, file) > 0)
+    {
+      // name:password:uid:...
+      char* colon = strchr(line, ':');
+      char* field = (colon != NULL) ? strchr(colon+1, ':') : NULL;
+      if ((field == NULL) || (line[0] == '#') || (colon == line))
+      {
+        continue;
+      }
+      char* end = NULL;
+      unsigned long uid = strtoul(field+1, &end, 10);
+      if ((end == field+1) || (*end != ':'))
+      {
+        continue;
+      }
+      *colon = '\0';
+      _top_usernames_append(&loaded, &count, &capacity, (uid_t)uid, line);
+    }
+    free(line);
+    fclose(file);
+  }
+#else
+  setpwent();
+  struct passwd* pwd;
+  while ((pwd = getpwent()) != NULL)
+  {
+    _top_usernames_append(&loaded, &count, &capacity, pwd->pw_uid, pwd->pw_name);
+  }
+  endpwent();
+#endif
+  qsort(loaded, count, sizeof(_TopUsername_t), _top_username_compare);
+
+  // both are sorted, so they merge in one pass; a uid listed twice keeps one of its names
+  pthread_rwlock_wrlock(&_top_usernames_lock);
+  uint32_t merged_capacity = _top_usernames_count+count+1;
+  _TopUsername_t* merged = (_TopUsername_t *)malloc(merged_capacity*sizeof(_TopUsername_t));
+  uint32_t merged_count = 0;
+  uint32_t i = 0, j = 0;
+  while ((i < _top_usernames_count) || (j < count))
+  {
+    _TopUsername_t entry;
+    if ((j == count) || ((i < _top_usernames_count) && (_top_usernames[i].uid < loaded[j].uid)))
+    {
+      entry = _top_usernames[i++];
+    }
+    else
+    {
+      entry = loaded[j++];
+      if ((i < _top_usernames_count) && (_top_usernames[i].uid == entry.uid))
+      {
+        i++;
+      }
+    }
+    if ((merged_count == 0) || (merged[merged_count-1].uid != entry.uid))
+    {
+      merged[merged_count++] = entry;
+    }
+  }
+  free(_top_usernames);
+  _top_usernames = merged;
+  _top_usernames_count = merged_count;
+  _top_usernames_capacity = merged_capacity;
+  pthread_rwlock_unlock(&_top_usernames_lock);
+  free(loaded);
+}
+
+static void* _top_resolver_thread(void* arg)
+{
+  (void)arg;
+  _top_usernames_load();
+
+  long size = sysconf(_SC_GETPW_R_SIZE_MAX);
+  size_t buffer_size = (size > 0) ? (size_t)size : 16384;
+  char* buffer = (char *)malloc(buffer_size);
+  for (;;)
+  {
+    pthread_mutex_lock(&_top_resolver_lock);
+    while (_top_resolver_count == 0)
+    {
+      pthread_cond_wait(&_top_resolver_wake, &_top_resolver_lock);
+    }
+    uid_t uid = _top_resolver_queue[--_top_resolver_count];
+    pthread_mutex_unlock(&_top_resolver_lock);
+
+    pthread_rwlock_rdlock(&_top_usernames_lock);
+    _TopUsername_t* entry = _top_username_search(uid);
+    boolean_t known = (entry != NULL) && (entry->name != NULL);
+    pthread_rwlock_unlock(&_top_usernames_lock);
+    if (known || (buffer == NULL))
+    {
+      continue;
+    }
+
+    // may block for as long as the directory service takes
+    struct passwd pwd;
+    struct passwd* result = NULL;
+    if ((getpwuid_r(uid, &pwd, buffer, buffer_size, &result) == 0) && (result != NULL))
+    {
+      const char* name = strdup(result->pw_name);
+      pthread_rwlock_wrlock(&_top_usernames_lock);
+      entry = _top_username_search(uid);
+      if (entry != NULL)
+      {
+        entry->name = name;
+      }
+      pthread_rwlock_unlock(&_top_usernames_lock);
+    }
+  }
+  return NULL;
+}
+
+static void _top_usernames_start(void)
+{
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, _top_resolver_thread, NULL) == 0)
+  {
+    pthread_detach(thread);
+  }
+}
+
+/* Never waits for the account database: a uid that is not known yet gets an empty entry, so it is only
+   queued once, and reads as NULL until the resolver thread fills it in. */
+const char* TopGetUsername(uid_t uid)
+{
+  pthread_once(&_top_usernames_once, _top_usernames_start);
+
+  pthread_rwlock_rdlock(&_top_usernames_lock);
+  _TopUsername_t* entry = _top_username_search(uid);
+  const char* name = (entry != NULL) ? entry->name : NULL;
+  pthread_rwlock_unlock(&_top_usernames_lock);
+  if (entry != NULL)
+  {
+    return name;
+  }
+
+  pthread_rwlock_wrlock(&_top_usernames_lock);
+  boolean_t queue = (_top_username_search(uid) == NULL);
+  if (queue)
+  {
+    _top_usernames_reserve(_top_usernames_count+1);
+    uint32_t i = _top_usernames_count++;
+    while ((i > 0) && (_top_usernames[i-1].uid > uid))
+    {
+      _top_usernames[i] = _top_usernames[i-1];
+      i--;
+    }
+    _top_usernames[i].uid = uid;
+    _top_usernames[i].name = NULL;
+  }
+  pthread_rwlock_unlock(&_top_usernames_lock);
+
+  if (queue)
+  {
+    pthread_mutex_lock(&_top_resolver_lock);
+    if (_top_resolver_count == _top_resolver_capacity)
+    {
+      _top_resolver_capacity = (_top_resolver_capacity > 0) ? 2*_top_resolver_capacity : 16;
+      _top_resolver_queue = (uid_t *)realloc(_top_resolver_queue, _top_resolver_capacity*sizeof(uid_t));
+    }
+    _top_resolver_queue[_top_resolver_count++] = uid;
+    pthread_cond_signal(&_top_resolver_wake);
+    pthread_mutex_unlock(&_top_resolver_lock);
+  }
+  return NULL;
+}
+
+static inline uint32_t _top_name_hash(const char* name)
+{
+  uint32_t hash = 2166136261u;
+  while (*name != '\0')
+  {
+    hash = (hash ^ (uint8_t)*name++) * 16777619u;
+  }
+  return hash;
+}
+
+/* Rebuilds the name index at capacity, dropping the names without a bucket in the window first. */
+static void _top_exited_rebuild(TopContext_t* ctx, uint32_t capacity, uint64_t second)
+{
+  uint32_t kept = 0;
+  for (uint32_t i=0; i<ctx->exited_count; i++)
+  {
+    if (ctx->exited[i].latest + TOP_EXITED_SECONDS > second)
+    {
+      if (kept != i)
+      {
+        ctx->exited[kept] = ctx->exited[i];
+      }
+      kept++;
+    }
+  }
+  ctx->exited_count = kept;
+
+  free(ctx->exited_index);
+  ctx->exited_index = (uint32_t *)calloc(capacity, sizeof(uint32_t));
+  ctx->exited_mask = capacity-1;
+  for (uint32_t i=0; i<ctx->exited_count; i++)
+  {
+    uint32_t j = _top_name_hash(ctx->exited[i].name) & ctx->exited_mask;
+    while (ctx->exited_index[j] != 0)
+    {
+      j = (j+1) & ctx->exited_mask;
+    }
+    ctx->exited_index[j] = i+1;
+  }
+}
+
+static _TopExited_t* _top_exited_find(TopContext_t* ctx, const char* name, uint64_t second)
+{
+  if ((ctx->exited_index == NULL) || ((ctx->exited_count+1)*2 > ctx->exited_mask+1))
+  {
+    // stale names make room first, the index only grows when that is not enough
+    uint32_t capacity = (ctx->exited_index != NULL) ? ctx->exited_mask+1 : 64;
+    _top_exited_rebuild(ctx, capacity, second);
+    if ((ctx->exited_count+1)*2 > capacity)
+    {
+      _top_exited_rebuild(ctx, 2*capacity, second);
+    }
+  }
+  uint32_t j = _top_name_hash(name) & ctx->exited_mask;
+  while (ctx->exited_index[j] != 0)
+  {
+    _TopExited_t* exited = &ctx->exited[ctx->exited_index[j]-1];
+    if (strcmp(exited->name, name) == 0)
+    {
+      return exited;
+    }
+    j = (j+1) & ctx->exited_mask;
+  }
+  if (ctx->exited_count == ctx->exited_capacity)
+  {
+    ctx->exited_capacity = (ctx->exited_capacity > 0) ? 2*ctx->exited_capacity : 32;
+    ctx->exited = (_TopExited_t *)realloc(ctx->exited, ctx->exited_capacity*sizeof(_TopExited_t));
+  }
+  _TopExited_t* exited = &ctx->exited[ctx->exited_count++];
+  memset(exited, 0, sizeof(_TopExited_t));
+  size_t length = strlen(name);
+  if (length > TOP_MAX_SAMPLE_NAME_SIZE)
+  {
+    length = TOP_MAX_SAMPLE_NAME_SIZE;
+  }
+  memcpy(exited->name, name, length);
+  exited->name[length] = '\0';
+  ctx->exited_index[j] = ctx->exited_count;
+  return exited;
+}
+
+static void _top_exited_add(TopContext_t* ctx, const char* name, uint64_t timens, uint64_t used, uint32_t count)
+{
+  uint64_t second = timens / NSEC_PER_SEC;
+  _TopExited_t* exited = _top_exited_find(ctx, name, second);
+  uint32_t bucket = (uint32_t)(second % TOP_EXITED_SECONDS);
+  if (exited->seconds[bucket] != second)
+  {
+    exited->seconds[bucket] = second;
+    exited->timens[bucket] = 0;
+    exited->count[bucket] = 0;
+  }
+  exited->timens[bucket] += used;
+  exited->count[bucket] += count;
+  if (second > exited->latest)
+  {
+    exited->latest = second;
+  }
+}
+
+/* Takes the credit a parent no sample had listed collected from the exits of its children. */
+static uint64_t _top_credit_take(TopContext_t* ctx, pid_t pid)
+{
+  for (uint32_t i=0; i<ctx->credits_count; i++)
+  {
+    if (ctx->credits[i].pid == pid)
+    {
+      uint64_t timens = ctx->credits[i].timens;
+      ctx->credits[i] = ctx->credits[--ctx->credits_count];
+      return timens;
+    }
+  }
+  return 0;
+}
+
+/* What an exit accounted for, which its parent is not to count again when its reaped children total grows by
+   it. A parent no sample has listed keeps it on the side until it exits itself or a sample lists it. */
+static void _top_credit_add(TopContext_t* ctx, pid_t ppid, uint64_t timens)
+{
+  if ((ppid <= 0) || (timens == 0))
+  {
+    return;
+  }
+  _TopProcessInfo_t* parent = _top_search(ctx, ppid);
+#ifndef __linux__
+  if (parent == NULL)
+  {
+    // the parent of the last sample exited since, the orphan is reaped by launchd
+    parent = _top_search(ctx, 1);
+  }
+#endif
+  if (parent != NULL)
+  {
+    parent->children_credit += timens;
+    return;
+  }
+  for (uint32_t i=0; i<ctx->credits_count; i++)
+  {
+    if (ctx->credits[i].pid == ppid)
+    {
+      ctx->credits[i].timens += timens;
+      return;
+    }
+  }
+  if (ctx->credits_count == TOP_CREDITS_MAX)
+  {
+    return;
+  }
+  if (ctx->credits_count == ctx->credits_capacity)
+  {
+    ctx->credits_capacity = (ctx->credits_capacity > 0) ? 2*ctx->credits_capacity : 64;
+    ctx->credits = (_TopCredit_t *)realloc(ctx->credits, ctx->credits_capacity*sizeof(_TopCredit_t));
+  }
+  ctx->credits[ctx->credits_count].pid = ppid;
+  ctx->credits[ctx->credits_count].timens = timens;
+  ctx->credits_count++;
+}
+
+/* Folds the queued exits into the per name buckets, on the sampling thread before the dead records are
+   reaped. A process a sample has seen only adds what it used since that sample, one that lived and died
+   between two samples adds its whole life. Either adds what it reaped in that time and no exit accounted
+   for, then its parent is credited with all of it. What a parent reaped and no exit accounted for is added
+   under the parent's name, which is how the exits that were missed are counted. */
+static void _top_lifecycle_fold(TopContext_t* ctx)
+{
+  pthread_mutex_lock(&ctx->lifecycle_lock);
+  _TopExit_t* exits = ctx->exits;
+  uint32_t count = ctx->exits_count;
+  uint32_t capacity = ctx->exits_capacity;
+  ctx->exits = ctx->exits_folded;
+  ctx->exits_capacity = ctx->exits_folded_capacity;
+  ctx->exits_count = 0;
+  ctx->exits_folded = exits;
+  ctx->exits_folded_capacity = capacity;
+  pthread_mutex_unlock(&ctx->lifecycle_lock);
+
+  for (uint32_t i=0; i<count; i++)
+  {
+    _TopExit_t* exit = &exits[i];
+    _TopProcessInfo_t* pinfo = _top_search(ctx, exit->pid);
+#ifdef __linux__
+    // a missed exit has no start time, but its pid can not be reused before this event
+    boolean_t seen = (pinfo != NULL) && pinfo->fetched && (exit->missed || (pinfo->sample.start_timens == exit->start_timens));
+    pid_t ppid = (seen && (exit->ppid == 0)) ? pinfo->sample.ppid : exit->ppid;
+#else
+    boolean_t seen = (pinfo != NULL) && pinfo->fetched && (pinfo->sample.generation == exit->generation);
+    pid_t ppid = seen ? pinfo->sample.ppid : 0;
+#endif
+    uint64_t credit = _top_credit_take(ctx, exit->pid);
+    if (seen)
+    {
+      credit += pinfo->children_credit;
+      pinfo->children_credit = 0;
+    }
+    if (exit->missed)
+    {
+      // the parent reaps it all unaccounted, apart from what the exits below it and the samples took
+      if (seen)
+      {
+        credit += pinfo->sample.total_timens + pinfo->children_timens;
+      }
+      _top_credit_add(ctx, ppid, credit);
+      continue;
+    }
+
+    uint64_t used = exit->total_timens;
+    uint64_t before = 0;
+    boolean_t baseline = TRUE;
+    const char* name = exit->name;
+    if (seen)
+    {
+      used = (used > pinfo->sample.total_timens) ? used - pinfo->sample.total_timens : 0;
+      before = pinfo->children_timens;
+      baseline = (pinfo->children_sequence != 0);
+      name = pinfo->sample.name;
+    }
+    uint64_t reaped = (exit->children_timens > before) ? exit->children_timens - before : 0;
+    if (baseline && (reaped > credit))
+    {
+      used += reaped - credit;
+    }
+    // the credit is exact where the children total may be short of a tick, the larger one is what was counted
+    _top_credit_add(ctx, ppid, exit->total_timens + before + ((reaped > credit) ? reaped : credit));
+    if (name[0] == '\0')
+    {
+      continue;
+    }
+    _top_exited_add(ctx, name, exit->timens, used, 1);
+  }
+
+  for (uint32_t i=0; i<ctx->pids_count; i++)
+  {
+    _TopProcessInfo_t* pinfo = ctx->pids_records[i];
+    if (pinfo->sample.sequence != ctx->sequence)
+    {
+      continue;
+    }
+    if ((pinfo->sample.sequence_last == 0) && (ctx->credits_count > 0))
+    {
+      pinfo->children_credit += _top_credit_take(ctx, pinfo->sample.pid);
+    }
+    if (pinfo->children_grown == 0)
+    {
+      continue;
+    }
+    uint64_t credit = (pinfo->children_grown < pinfo->children_credit) ? pinfo->children_grown : pinfo->children_credit;
+    pinfo->children_credit -= credit;
+    if ((pinfo->children_grown > credit) && (pinfo->sample.name[0] != '\0'))
+    {
+      _top_exited_add(ctx, pinfo->sample.name, ctx->timens, pinfo->children_grown - credit, 0);
+    }
+  }
+}
+
+static void _top_lifecycle_stop(TopContext_t* ctx)
+{
+  if (ctx->lifecycle_fd >= 0)
+  {
+    char stop = 0;
+    if (write(ctx->lifecycle_wake[1], &stop, 1) == 1)
+    {
+      pthread_join(ctx->lifecycle_thread, NULL);
+    }
+    close(ctx->lifecycle_fd);
+    ctx->lifecycle_fd = -1;
+  }
+  for (int i=0; i<2; i++)
+  {
+    if (ctx->lifecycle_wake[i] >= 0)
+    {
+      close(ctx->lifecycle_wake[i]);
+      ctx->lifecycle_wake[i] = -1;
+    }
+  }
+}
+
+int TopContextStartLifecycle(TopContext_t* ctx)
+{
+  if (ctx->lifecycle_fd >= 0)
+  {
+    return 0;
+  }
+  if (pipe(ctx->lifecycle_wake) != 0)
+  {
+    ctx->lifecycle_wake[0] = -1;
+    ctx->lifecycle_wake[1] = -1;
+    return -1;
+  }
+  ctx->lifecycle_fd = _top_lifecycle_open(ctx);
+  if ((ctx->lifecycle_fd < 0) || (pthread_create(&ctx->lifecycle_thread, NULL, _top_lifecycle_thread, ctx) != 0))
+  {
+    int err = errno;
+    if (ctx->lifecycle_fd >= 0)
+    {
+      close(ctx->lifecycle_fd);
+      ctx->lifecycle_fd = -1;
+    }
+    _top_lifecycle_stop(ctx);
+    errno = err;
+    return -1;
+  }
+  return 0;
+}
+
+static int _top_exited_compare(const void* a, const void* b)
+{
+  uint64_t ta = ((const TopExitedSample_t *)a)->total_timens;
+  uint64_t tb = ((const TopExitedSample_t *)b)->total_timens;
+  return (ta > tb) ? -1 : ((ta < tb) ? 1 : strcmp(((const TopExitedSample_t *)a)->name, ((const TopExitedSample_t *)b)->name));
+}
+
+int TopContextGetExited(TopContext_t* ctx, double seconds, TopExitedSample_t* exited, int count)
+{
+  uint64_t window = (seconds < 1.0) ? 1 : ((seconds > TOP_EXITED_SECONDS) ? TOP_EXITED_SECONDS : (uint64_t)seconds);
+  uint64_t second = _top_clock_nanos() / NSEC_PER_SEC;
+  TopExitedSample_t* sums = (TopExitedSample_t *)malloc((ctx->exited_count+1)*sizeof(TopExitedSample_t));
+  if (sums == NULL)
+  {
+    return 0;
+  }
+  uint32_t found = 0;
+  for (uint32_t i=0; i<ctx->exited_count; i++)
+  {
+    const _TopExited_t* name = &ctx->exited[i];
+    TopExitedSample_t* sum = &sums[found];
+    sum->count = 0;
+    sum->total_timens = 0;
+    for (uint32_t b=0; b<TOP_EXITED_SECONDS; b++)
+    {
+      if ((name->seconds[b] + window > second) && (name->seconds[b] <= second))
+      {
+        sum->count += name->count[b];
+        sum->total_timens += name->timens[b];
+      }
+    }
+    if ((sum->count > 0) || (sum->total_timens > 0))
+    {
+      memcpy(sum->name, name->name, sizeof(sum->name));
+      sum->cpu = (double)sum->total_timens * 100.0 / (double)(window * NSEC_PER_SEC);
+      found++;
+    }
+  }
+  qsort(sums, found, sizeof(TopExitedSample_t), _top_exited_compare);
+  if ((uint32_t)count > found)
+  {
+    count = (int)found;
+  }
+  memcpy(exited, sums, count*sizeof(TopExitedSample_t));
+  free(sums);
+  return count;
+}
+
+/* A context that owns nothing yet, with the defaults of every setting. */
+static TopContext_t* _top_context_new(void)
+{
+  TopContext_t* ctx = (TopContext_t *)calloc(1, sizeof(TopContext_t));
+  if (ctx == NULL)
+  {
+    return NULL;
+  }
+#ifdef __linux__
+  ctx->proc_fd = -1;
+#else
+  ctx->port = MACH_PORT_NULL;
+#endif
+  ctx->workers_requested = 1;
+  ctx->rank_weights_requested[TOP_RANK_CPU] = 1.0;
+  ctx->rank_weights[TOP_RANK_CPU] = 1.0;
+  ctx->rank_cpu_only = TRUE;
+  ctx->half_life_requested = TOP_HALF_LIFE;
+  ctx->half_life = TOP_HALF_LIFE;
+  ctx->lifecycle_fd = -1;
+  ctx->lifecycle_wake[0] = -1;
+  ctx->lifecycle_wake[1] = -1;
+  pthread_mutex_init(&ctx->lifecycle_lock, NULL);
+  pthread_mutex_init(&ctx->settings_lock, NULL);
+  pthread_mutex_init(&ctx->pool_lock, NULL);
+  pthread_cond_init(&ctx->pool_start, NULL);
+  pthread_cond_init(&ctx->pool_done, NULL);
+  return ctx;
+}
+
+static int _top_context_open(TopContext_t* ctx)
+{
+  pthread_once(&_top_once, _top_init_once);
+  // the account database loads in the background while the first sample runs
+  pthread_once(&_top_usernames_once, _top_usernames_start);
+
+#ifdef __linux__
+  int err = _top_proc_open(ctx);
+  if (err != 0)
+  {
+    return err;
+  }
+#else
+  if (ctx->arg_buffer == NULL)
+  {
+    int  mib[2];
+    mib[0] = CTL_KERN;
+    mib[1] = KERN_ARGMAX;
+
+    size_t size = sizeof(ctx->arg_max);
+    if (sysctl(mib, 2, &ctx->arg_max, &size, NULL, 0) == -1)
+    {
+      return -1;
+    }
+    ctx->arg_buffer = (char *)malloc(ctx->arg_max);
+    if (ctx->arg_buffer == NULL)
+    {
+      return -2;
+    }
+  }
+  
+  if (ctx->port == MACH_PORT_NULL)
+  {
+    ctx->port = mach_host_self();
+  }
+#endif
+
+  _top_index_init(ctx);
+
+  return 0;
+}
+
+TopContext_t* TopContextCreate(void)
+{
+  TopContext_t* ctx = _top_context_new();
+  if (ctx == NULL)
+  {
+    return NULL;
+  }
+  if (_top_context_open(ctx) != 0)
+  {
+    TopContextDestroy(ctx);
+    return NULL;
+  }
+  TopContextSample(ctx);
+  return ctx;
+}
+
+/* Joins the pool threads, frees every record, descriptor and buffer, and finally the context itself. */
+void TopContextDestroy(TopContext_t* ctx)
+{
+  if (ctx == NULL)
+  {
+    return;
+  }
+  _top_pool_stop(ctx);
+  _top_lifecycle_stop(ctx);
+
+  while (ctx->records_count > 0)
+  {
+    _top_destroy(ctx, ctx->records[0]);
+  }
+  for (uint32_t i=0; i<ctx->slabs_count; i++)
+  {
+    free(ctx->slabs[i]);
+  }
+  free(ctx->slabs);
+  free(ctx->records);
+  free(ctx->pid_table);
+  free(ctx->ranked);
+  free(ctx->groups);
+  free(ctx->tree_order);
+  free(ctx->pids);
+  free(ctx->pids_records);
+  free(ctx->threads);
+  free(ctx->threads_last);
+  free(ctx->arg_buffer);
+  free(ctx->arg_spans);
+  free(ctx->exits);
+  free(ctx->exits_folded);
+  free(ctx->credits);
+  free(ctx->exited);
+  free(ctx->exited_index);
+
+  free(ctx->process_info.name);
+  free(ctx->process_info.command);
+  free(ctx->process_info.args_info);
+  free(ctx->process_info.envs_info);
+
+#ifdef __linux__
+  if (ctx->proc_fd >= 0)
+  {
+    close(ctx->proc_fd);
+  }
+  free(ctx->dirent_buffer);
+#else
+  free(ctx->thread_handles);
+  if (ctx->port != MACH_PORT_NULL)
+  {
+    mach_port_deallocate(mach_task_self(), ctx->port);
+  }
+#endif
+
+  pthread_cond_destroy(&ctx->pool_done);
+  pthread_cond_destroy(&ctx->pool_start);
+  pthread_mutex_destroy(&ctx->pool_lock);
+  pthread_mutex_destroy(&ctx->settings_lock);
+  pthread_mutex_destroy(&ctx->lifecycle_lock);
+  free(ctx);
+}
+
+static void _top_heap_down(_TopProcessInfo_t** heap, uint32_t count, uint32_t i, _TopRankFunc before)
+{
+  _TopProcessInfo_t* pinfo = heap[i];
+  for (;;)
+  {
+    uint32_t child = (2*i)+1;
+    if (child >= count)
+    {
+      break;
+    }
+    if ((child+1 < count) && before(heap[child], heap[child+1]))
+    {
+      child++;
+    }
+    if (!before(pinfo, heap[child]))
+    {
+      break;
+    }
+    heap[i] = heap[child];
+    i = child;
+  }
+  heap[i] = pinfo;
+}
+
+static void _top_heap_up(_TopProcessInfo_t** heap, uint32_t i, _TopRankFunc before)
+{
+  _TopProcessInfo_t* pinfo = heap[i];
+  while (i > 0)
+  {
+    uint32_t parent = (i-1)/2;
+    if (!before(heap[parent], pinfo))
+    {
+      break;
+    }
+    heap[i] = heap[parent];
+    i = parent;
+  }
+  heap[i] = pinfo;
+}
+
+/* Offers pinfo to a min heap that keeps the best limit entries. */
+static inline void _top_heap_offer(_TopProcessInfo_t** heap, uint32_t* count, uint32_t limit, _TopProcessInfo_t* pinfo, _TopRankFunc before)
+{
+  if (*count < limit)
+  {
+    heap[*count] = pinfo;
+    _top_heap_up(heap, (*count)++, before);
+  }
+  else if ((limit > 0) && before(pinfo, heap[0]))
+  {
+    heap[0] = pinfo;
+    _top_heap_down(heap, *count, 0, before);
+  }
+}
+
+/* The worst remaining entry sits at the root, moving it to the back leaves the array best first. */
+static void _top_heap_sort(_TopProcessInfo_t** heap, uint32_t count, _TopRankFunc before)
+{
+  for (uint32_t n=count; n>1; n--)
+  {
+    _TopProcessInfo_t* worst = heap[0];
+    heap[0] = heap[n-1];
+    heap[n-1] = worst;
+    _top_heap_down(heap, n-1, 0, before);
+  }
+}
+
+/* One pass over the live records that reaps the dead ones and keeps the best limit processes in a bounded
+   min heap, so ranking costs O(n log limit). The heap is then sorted in place, best first. Ranking on more
+   than cpu first takes one more pass to score the records, ranking on smoothed or peak cpu scores them on
+   the way. */
+static void _top_rank(TopContext_t* ctx, uint32_t limit)
+{
+  _TopRankFunc before = _top_ranks_before;
+  if (!ctx->rank_cpu_only)
+  {
+    _top_score(ctx);
+    before = _top_score_ranks_before;
+  }
+  else if (ctx->rank_cpu != TOP_CPU_LAST)
+  {
+    before = _top_score_ranks_before;
+  }
+
+  ctx->version++;
+  ctx->ranked_count = 0;
+
+  if (limit > ctx->records_count)
+  {
+    limit = ctx->records_count;
+  }
+  if (limit > ctx->ranked_capacity)
+  {
+    ctx->ranked_capacity = limit;
+    ctx->ranked = (_TopProcessInfo_t **)realloc(ctx->ranked, ctx->ranked_capacity*sizeof(_TopProcessInfo_t *));
+  }
+
+  ctx->process_count = 0;
+  uint32_t i = 0;
+  while (i < ctx->records_count)
+  {
+    _TopProcessInfo_t* pinfo = ctx->records[i];
+    if (pinfo->sample.sequence != ctx->sequence)
+    {
+      // the last record moves into slot i
+      _top_destroy(ctx, pinfo);
+      continue;
+    }
+    ctx->process_count++;
+    i++;
+    if (ctx->rank_cpu_only)
+    {
+      pinfo->sample.score = _top_rank_cpu(ctx, &pinfo->sample);
+    }
+    _top_heap_offer(ctx->ranked, &ctx->ranked_count, limit, pinfo, before);
+  }
+  _top_heap_sort(ctx->ranked, ctx->ranked_count, before);
+}
+
+/* Builds the process forest of the live records, which _top_rank has just reaped, and sums cpu per subtree in
+   linear time. Processes started by launchd or init, and those whose parent is gone, are the roots, so every
+   app groups its helpers without everything collapsing into pid 1. Parent links that form a loop, which a
+   stale ppid could, leave those records out of every walk, each one then only counts itself. */
+static void _top_aggregate(TopContext_t* ctx, uint32_t limit)
+{
+  for (uint32_t i=0; i<ctx->records_count; i++)
+  {
+    _TopProcessInfo_t* pinfo = ctx->records[i];
+    pinfo->parent = NULL;
+    pinfo->child = NULL;
+    pinfo->sample.cpu_tree = pinfo->sample.cpu;
+    pinfo->sample.count_tree = 1;
+  }
+  for (uint32_t i=0; i<ctx->records_count; i++)
+  {
+    _TopProcessInfo_t* pinfo = ctx->records[i];
+    pid_t ppid = pinfo->sample.ppid;
+    if ((ppid > 1) && (ppid != pinfo->sample.pid))
+    {
+      _TopProcessInfo_t* parent = _top_search(ctx, ppid);
+      if (parent != NULL)
+      {
+        pinfo->parent = parent;
+        pinfo->sibling = parent->child;
+        parent->child = pinfo;
+      }
+    }
+  }
+
+  if (ctx->records_count > ctx->tree_capacity)
+  {
+    ctx->tree_capacity = ctx->records_capacity;
+    ctx->tree_order = (_TopProcessInfo_t **)realloc(ctx->tree_order, ctx->tree_capacity*sizeof(_TopProcessInfo_t *));
+  }
+  if (limit > ctx->records_count)
+  {
+    limit = ctx->records_count;
+  }
+  if (limit > ctx->groups_capacity)
+  {
+    ctx->groups_capacity = limit;
+    ctx->groups = (_TopProcessInfo_t **)realloc(ctx->groups, ctx->groups_capacity*sizeof(_TopProcessInfo_t *));
+  }
+
+  // every root with its subtree in preorder, walking it backwards folds each child into its parent first
+  uint32_t count = 0;
+  for (uint32_t i=0; i<ctx->records_count; i++)
+  {
+    if (ctx->records[i]->parent != NULL)
+    {
+      continue;
+    }
+    uint32_t start = count;
+    ctx->tree_order[count++] = ctx->records[i];
+    for (uint32_t j=start; j<count; j++)
+    {
+      for (_TopProcessInfo_t* child=ctx->tree_order[j]->child; child!=NULL; child=child->sibling)
+      {
+        ctx->tree_order[count++] = child;
+      }
+    }
+  }
+  for (uint32_t j=count; j>0; j--)
+  {
+    _TopProcessInfo_t* pinfo = ctx->tree_order[j-1];
+    if (pinfo->parent != NULL)
+    {
+      pinfo->parent->sample.cpu_tree += pinfo->sample.cpu_tree;
+      pinfo->parent->sample.count_tree += pinfo->sample.count_tree;
+    }
+  }
+
+  ctx->version++;
+  ctx->groups_count = 0;
+  for (uint32_t i=0; i<ctx->records_count; i++)
+  {
+    if (ctx->records[i]->parent == NULL)
+    {
+      _top_heap_offer(ctx->groups, &ctx->groups_count, limit, ctx->records[i], _top_tree_ranks_before);
+    }
+  }
+  _top_heap_sort(ctx->groups, ctx->groups_count, _top_tree_ranks_before);
+}
+
+void TopContextSetLimit(TopContext_t* ctx, int limit)
+{
+  ctx->limit = (limit > 0) ? (uint32_t)limit : 0;
+}
+
+int TopContextSortAll(TopContext_t* ctx)
+{
+  _top_rank(ctx, UINT32_MAX);
+  return (int)ctx->ranked_count;
+}
+
+int TopContextSample(TopContext_t* ctx)
+{
+  ctx->sequence++;
+  
+  _top_apply_settings(ctx);
+
+  ctx->p_timens = ctx->timens;
+  ctx->timens = _top_clock_nanos();
+  double elapsed = (double)(ctx->timens - ctx->p_timens) / (double)NSEC_PER_SEC;
+  ctx->smooth_alpha = (ctx->half_life > 0.0) ? 1.0 - exp2(-elapsed / ctx->half_life) : 1.0;
+
+  // on the first sample every process counts as already running
+  uint64_t started = _top_start_clock_nanos();
+  ctx->started_after = (ctx->sequence != 1) ? ctx->started_last : started;
+  ctx->started_last = started;
+  
+  _top_update_all(ctx);
+  if (ctx->lifecycle_fd >= 0)
+  {
+    _top_lifecycle_fold(ctx);
+  }
+  
+  uint32_t limit = (ctx->limit > 0) ? ctx->limit : UINT32_MAX;
+  _top_rank(ctx, limit);
+  _top_aggregate(ctx, limit);
+  
+  return ctx->process_count;
+}
+
+int TopGetHistory(const TopProcessSample_t* sample, float* values, int count)
+{
+  if (count < 0)
+  {
+    count = 0;
+  }
+  if (count > sample->history_count)
+  {
+    count = sample->history_count;
+  }
+  for (int i=0; i<count; i++)
+  {
+    values[i] = sample->cpu_history[(sample->history_head + TOP_HISTORY_SIZE - (count-1-i)) % TOP_HISTORY_SIZE];
+  }
+  return count;
+}
+
+void TopCursorInit(TopCursor_t* cursor, const TopContext_t* ctx)
+{
+  cursor->context = ctx;
+  cursor->version = ctx->version;
+  cursor->index = 0;
+  cursor->groups = 0;
+}
+
+void TopCursorInitGroups(TopCursor_t* cursor, const TopContext_t* ctx)
+{
+  TopCursorInit(cursor, ctx);
+  cursor->groups = 1;
+}
+
+const TopProcessSample_t* TopCursorNext(TopCursor_t* cursor)
+{
+  const TopContext_t* ctx = cursor->context;
+  if ((ctx == NULL) || (cursor->version != ctx->version))
+  {
+    return NULL;
+  }
+  _TopProcessInfo_t** entries = cursor->groups ? ctx->groups : ctx->ranked;
+  uint32_t count = cursor->groups ? ctx->groups_count : ctx->ranked_count;
+  if (cursor->index < count)
+  {
+    return &entries[cursor->index++]->sample;
+  }
+  return NULL;
+}
+
+static int _top_thread_compare_tid(const void* a, const void* b)
+{
+  uint64_t ta = ((const TopThreadSample_t *)a)->tid;
+  uint64_t tb = ((const TopThreadSample_t *)b)->tid;
+  return (ta < tb) ? -1 : ((ta > tb) ? 1 : 0);
+}
+
+static int _top_thread_compare_cpu(const void* a, const void* b)
+{
+  const TopThreadSample_t* ta = (const TopThreadSample_t *)a;
+  const TopThreadSample_t* tb = (const TopThreadSample_t *)b;
+  if (ta->cpu != tb->cpu)
+  {
+    return (ta->cpu > tb->cpu) ? -1 : 1;
+  }
+  return _top_thread_compare_tid(a, b);
+}
+
+int TopContextSampleThreads(TopContext_t* ctx, pid_t pid, TopThreadSample_t* threads, int count)
+{
+  // the previous sample only counts for the same process
+  TopThreadSample_t* last = ctx->threads;
+  ctx->threads = ctx->threads_last;
+  ctx->threads_last = last;
+  ctx->threads_last_count = (pid == ctx->threads_pid) ? ctx->threads_count : 0;
+  ctx->threads_count = 0;
+  ctx->threads_pid = pid;
+
+  uint64_t last_timens = ctx->threads_timens;
+  ctx->threads_timens = _top_clock_nanos();
+  if (pid > 0)
+  {
+    _top_list_threads(ctx, pid);
+  }
+  qsort(ctx->threads, ctx->threads_count, sizeof(TopThreadSample_t), _top_thread_compare_tid);
+
+  // both samples are in tid order, a thread seen for the first time has no cpu% yet
+  unsigned long long elapsed_us = (ctx->threads_timens - last_timens) / NSEC_PER_USEC;
+  uint32_t j = 0;
+  for (uint32_t i=0; i<ctx->threads_count; i++)
+  {
+    TopThreadSample_t* thread = &ctx->threads[i];
+    while ((j < ctx->threads_last_count) && (ctx->threads_last[j].tid < thread->tid))
+    {
+      j++;
+    }
+    if ((j < ctx->threads_last_count) && (ctx->threads_last[j].tid == thread->tid) && (elapsed_us > 0))
+    {
+      unsigned long long used_us = (thread->total_timens - ctx->threads_last[j].total_timens) / NSEC_PER_USEC;
+      thread->cpu = (double)used_us*100.0/(double)elapsed_us;
+    }
+  }
+
+  memcpy(ctx->threads_last, ctx->threads, ctx->threads_count*sizeof(TopThreadSample_t));
+  qsort(ctx->threads_last, ctx->threads_count, sizeof(TopThreadSample_t), _top_thread_compare_cpu);
+  if ((uint32_t)count > ctx->threads_count)
+  {
+    count = (int)ctx->threads_count;
+  }
+  memcpy(threads, ctx->threads_last, count*sizeof(TopThreadSample_t));
+  return count;
+}
+
+/* Spans of the NUL terminated strings in arg_buffer from start to end, appended after the first count spans,
+   empty ones skipped. Stops after max strings, empty ones included, and returns where it stopped. The buffer
+   must end in a NUL so that a string cut short by the end is still terminated. */
+static uint32_t _top_args_split(TopContext_t* ctx, uint32_t start, uint32_t end, uint32_t max, uint32_t* count)
+{
+  uint32_t offset = start;
+  for (uint32_t n=0; (n < max) && (offset < end); n++)
+  {
+    const char* string = ctx->arg_buffer + offset;
+    const char* nul = memchr(string, '\0', end - offset);
+    uint32_t length = (nul != NULL) ? (uint32_t)(nul - string) : (end - offset);
+    if (length > 0)
+    {
+      if (*count == ctx->arg_spans_capacity)
+      {
+        ctx->arg_spans_capacity = (ctx->arg_spans_capacity > 0) ? 2*ctx->arg_spans_capacity : 256;
+        ctx->arg_spans = (TopSpan_t *)realloc(ctx->arg_spans, ctx->arg_spans_capacity*sizeof(TopSpan_t));
+      }
+      ctx->arg_spans[*count].offset = offset;
+      ctx->arg_spans[*count].length = length;
+      (*count)++;
+    }
+    offset += length+1;
+  }
+  return offset;
+}
+
+/* Joins the spans with newlines into output, sized up front so it is a single allocation and copy pass. */
+static char* _top_args_join(const char* buffer, const TopSpan_t* spans, int count, char* output, int* length)
+{
+  size_t total = 0;
+  for (int i=0; i<count; i++)
+  {
+    total += spans[i].length+1;
+  }
+  output = realloc(output, total+1);
+  char* cursor = output;
+  for (int i=0; i<count; i++)
+  {
+    memcpy(cursor, buffer+spans[i].offset, spans[i].length);
+    cursor += spans[i].length;
+    *cursor++ = '\n';
+  }
+  *cursor = '\0';
+  *length = (int)total;
+  return output;
+}
+
+static void _top_args_publish(TopContext_t* ctx, int args_count, int envs_count)
+{
+  ctx->process_info.buffer = ctx->arg_buffer;
+  ctx->process_info.args = ctx->arg_spans;
+  ctx->process_info.args_count = args_count;
+  ctx->process_info.envs = ctx->arg_spans + args_count;
+  ctx->process_info.envs_count = envs_count;
+}
+
+static void _top_args_reset(TopContext_t* ctx)
+{
+  ctx->process_info.args_count = 0;
+  ctx->process_info.args_length = 0;
+  ctx->process_info.envs_count = 0;
+  ctx->process_info.envs_length = 0;
+  ctx->process_info.buffer = ctx->arg_buffer;
+  ctx->process_info.args = ctx->arg_spans;
+  ctx->process_info.envs = ctx->arg_spans;
+}
+
+static TopProcessInfo_t* _top_args_parse(TopContext_t* ctx, pid_t pid);
+
+TopProcessInfo_t* TopContextGetArgSpans(TopContext_t* ctx, pid_t pid)
+{
+  return _top_args_parse(ctx, pid);
+}
+
+TopProcessInfo_t* TopContextGetArgs(TopContext_t* ctx, pid_t pid)
+{
+  TopProcessInfo_t* info = _top_args_parse(ctx, pid);
+  info->args_info = _top_args_join(info->buffer, info->args, info->args_count, info->args_info, &info->args_length);
+  info->envs_info = _top_args_join(info->buffer, info->envs, info->envs_count, info->envs_info, &info->envs_length);
+  return info;
+}
+
+#ifdef __linux__
+
+/* Reads all of /proc/<pid>/<name> into arg_buffer at offset, growing it as needed, and NUL terminates it
+   unless it already ends in one; returns the offset after it. */
+static uint32_t _top_args_read(TopContext_t* ctx, pid_t pid, const char* name, uint32_t offset)
+{
+  char path[32];
+  snprintf(path, sizeof(path), "%d/%s", (int)pid, name);
+  int fd = openat(ctx->proc_fd, path, O_RDONLY|O_CLOEXEC);
+  if (fd < 0)
+  {
+    return offset;
+  }
+  uint32_t start = offset;
+  for (;;)
+  {
+    if (offset+1 >= (uint32_t)ctx->arg_max)
+    {
+      ctx->arg_max = (ctx->arg_max > 0) ? 2*ctx->arg_max : 64*1024;
+      ctx->arg_buffer = (char *)realloc(ctx->arg_buffer, ctx->arg_max);
+    }
+    ssize_t length = read(fd, ctx->arg_buffer+offset, ctx->arg_max-offset-1);
+    if (length <= 0)
+    {
+      break;
+    }
+    offset += (uint32_t)length;
+  }
+  close(fd);
+  if ((offset > start) && (ctx->arg_buffer[offset-1] != '\0'))
+  {
+    ctx->arg_buffer[offset++] = '\0';
+  }
+  return offset;
+}
+
+/* cmdline and environ, the latter only for processes the user may ptrace, are read back to back into
+   arg_buffer and split in place. The executable is static, so it is read once and kept with the record. */
+static TopProcessInfo_t* _top_args_parse(TopContext_t* ctx, pid_t pid)
+{
+  _top_args_reset(ctx);
+
+  uint32_t args_end = _top_args_read(ctx, pid, "cmdline", 0);
+  uint32_t envs_end = _top_args_read(ctx, pid, "environ", args_end);
+  uint32_t count = 0;
+  _top_args_split(ctx, 0, args_end, UINT32_MAX, &count);
+  int args_count = (int)count;
+  _top_args_split(ctx, args_end, envs_end, UINT32_MAX, &count);
+  _top_args_publish(ctx, args_count, (int)count - args_count);
+
+  // like the darwin one, this reads the process itself and leaves the records of the samples alone
+  char path[PATH_MAX];
+  char link[32];
+  snprintf(link, sizeof(link), "%d/exe", (int)pid);
+  ssize_t length = readlinkat(ctx->proc_fd, link, path, sizeof(path)-1);
+  if (length < 0)
+  {
+    length = 0;
+  }
+  path[length] = '\0';
+  const char* command = path;
+  if ((length == 0) && (args_count > 0))
+  {
+    // exe is only readable for processes the user may ptrace, argv[0] is the next best thing
+    command = ctx->arg_buffer + ctx->arg_spans[0].offset;
+  }
+  size_t size = strlen(command);
+  ctx->process_info.command = realloc(ctx->process_info.command, size+1);
+  memcpy(ctx->process_info.command, command, size+1);
+
+  char name[TOP_MAX_SAMPLE_NAME_SIZE+1];
+  snprintf(link, sizeof(link), "%d/comm", (int)pid);
+  int fd = openat(ctx->proc_fd, link, O_RDONLY|O_CLOEXEC);
+  length = (fd >= 0) ? pread(fd, name, sizeof(name)-1, 0) : 0;
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  if (length < 0)
+  {
+    length = 0;
+  }
+  if ((length > 0) && (name[length-1] == '\n'))
+  {
+    length--;
+  }
+  name[length] = '\0';
+  ctx->process_info.name = realloc(ctx->process_info.name, (size_t)length+1);
+  memcpy(ctx->process_info.name, name, (size_t)length+1);
+
+  return &ctx->process_info;
+}
+
+#else
+
+//#define DEBUG_ARGS
+#ifdef DEBUG_ARGS
+static inline void _spewraw(char *ptr, unsigned long left)
+{
+  fprintf(stderr, ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
+  for (int i=0; i<left; i++)
+  {
+    if (isprint(ptr[i]))
+    {
+      fprintf(stderr, "%c", ptr[i]);
+    }
+    else
+    {
+      fprintf(stderr, "[%x]", ptr[i]);
+    }
+  }
+  fprintf(stderr, "\n<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n\n\n");
+}
+static inline void _spewbytes(char *ptr, unsigned long left)
+{
+  fprintf(stderr, ">>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>>\n");
+  for (int i=0; i<left; i++)
+  {
+    if (ptr[i] == 0)
+    {
+      fprintf(stderr, "\'\\0\'");
+    }
+    else if (ptr[i] == '\n')
+    {
+      fprintf(stderr, "\n");
+    }
+    else if (isprint(ptr[i]))
+    {
+      fprintf(stderr, "%c", ptr[i]);
+    }
+    else
+    {
+      fprintf(stderr, "[%x]", ptr[i]);
+    }
+  }
+  fprintf(stderr, "\n<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<<\n\n\n");
+}
+#endif
+
+// http://search.cpan.org/src/DURIST/Proc-ProcessTable-0.43/os/darwin.c
+/* The KERN_PROCARGS2 area is argc, the executable path, NUL padding, argc arguments, more padding and the
+   environment, every string NUL terminated, so it is split in place. */
+static TopProcessInfo_t* _top_args_parse(TopContext_t* ctx, pid_t pid)
+{  
+  _top_args_reset(ctx);
+  
+  const char* command = "";
+  int mib[3];
+  mib[0] = CTL_KERN;
+  mib[1] = KERN_PROCARGS2;
+  mib[2] = pid;
+  size_t size = ctx->arg_max;
+  if ((ctx->arg_buffer != NULL) && (sysctl(mib, 3, ctx->arg_buffer, &size, NULL, 0) == KERN_SUCCESS) && (size > sizeof(int)))
+  {
+#ifdef DEBUG_ARGS
+    fprintf(stderr, "\n");
+    fprintf(stderr, "\n");
+    _spewraw(ctx->arg_buffer, size);
+    fprintf(stderr, "\n");
+    fprintf(stderr, "\n");
+#endif
+    char* data = ctx->arg_buffer;
+    uint32_t end = (uint32_t)size;
+    // a truncated area still ends in a terminated string
+    data[end-1] = '\0';
+
+    int argc = 0;
+    memcpy(&argc, data, sizeof(int));
+
+    // full path
+    uint32_t count = 0;
+    uint32_t offset = _top_args_split(ctx, sizeof(int), end, 1, &count);
+    if (count == 1)
+    {
+      command = data + ctx->arg_spans[0].offset;
+    }
+    count = 0;
+
+    // skip empty space, then the arguments
+    while ((offset < end) && (data[offset] == '\0'))
+    {
+      offset++;
+    }
+    offset = _top_args_split(ctx, offset, end, (argc > 0) ? (uint32_t)argc : 0, &count);
+    int args_count = (int)count;
+
+    // skip empty space, then the environment
+    while ((offset < end) && (data[offset] == '\0'))
+    {
+      offset++;
+    }
+    _top_args_split(ctx, offset, end, UINT32_MAX, &count);
+    _top_args_publish(ctx, args_count, (int)count - args_count);
+#ifdef DEBUG_ARGS
+    fprintf(stderr, "---- args_count: [%d]\n", ctx->process_info.args_count);
+    fprintf(stderr, "---- envs_count: [%d]\n", ctx->process_info.envs_count);
+#endif
+  }
+
+  size_t length = strlen(command);
+  ctx->process_info.command = realloc(ctx->process_info.command, length+1);
+  memcpy(ctx->process_info.command, command, length+1);
+  
+  struct kinfo_proc kinfo;
+  int res = _top_kinfo_for_pid(&kinfo, pid);
+  if (res != 0)
+  {
+    if (ctx->process_info.name != NULL)
+    {
+      ctx->process_info.name[0] = '\0';
+    }
+    fprintf(stderr, "ERR kinfo_for_pid\n");
+    return &ctx->process_info;
+  }
+  size = strlen(kinfo.kp_proc.p_comm);
+  ctx->process_info.name = realloc(ctx->process_info.name, size+1);
+  strcpy(ctx->process_info.name, kinfo.kp_proc.p_comm);
   
-  return &_top_process_info;
-}
-
-//void top_fini(void)
-//{
-//  top_pinfo_t *pinfo, *ppinfo;
-//
-//  /* Deallocate the arg string. */
-//  free(top_arg);
-//
-//  /* Clean up the oinfo structures. */
-//  CFRelease(top_oinfo_hash);
-//
-//  /* Clean up the pinfo structures. */
-//  rb_first(&top_ptree, pnode, pinfo);
-//  for (; pinfo != rb_tree_nil(&top_ptree); pinfo = ppinfo)
-//  {
-//    rb_next(&top_ptree, pinfo, top_pinfo_t, pnode, ppinfo);
-//
-//    /* This removes the pinfo from the tree, and frees pinfo and its data. */
-//    top_p_destroy_pinfo(pinfo);
-//  }
-//
-//  /* Clean up the uid->username translation cache. */
-//  CFRelease(top_uhash);
-//}
+  return &ctx->process_info;
+}
+
+#endif
+
+/* The TopInit family on a context of its own. The setters may run before TopInit, so they create it. */
+static pthread_mutex_t _top_context_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static TopContext_t* _top_default(void)
+{
+  TopContext_t* ctx = __atomic_load_n(&_top_context, __ATOMIC_ACQUIRE);
+  if (ctx == NULL)
+  {
+    pthread_mutex_lock(&_top_context_lock);
+    ctx = _top_context;
+    if (ctx == NULL)
+    {
+      ctx = _top_context_new();
+      __atomic_store_n(&_top_context, ctx, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&_top_context_lock);
+  }
+  return ctx;
+}
+
+int TopInit(void)
+{
+  TopContext_t* ctx = _top_default();
+  if (ctx == NULL)
+  {
+    return -2;
+  }
+  int err = _top_context_open(ctx);
+  if (err != 0)
+  {
+    return err;
+  }
+  return TopSample();
+}
+
+void TopFini(void)
+{
+  pthread_mutex_lock(&_top_context_lock);
+  TopContextDestroy(_top_context);
+  __atomic_store_n(&_top_context, NULL, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&_top_context_lock);
+  memset(&_top_cursor, 0, sizeof(TopCursor_t));
+  memset(&_top_groups_cursor, 0, sizeof(TopCursor_t));
+}
+
+int TopSample(void)
+{
+  int count = TopContextSample(_top_default());
+  TopCursorInit(&_top_cursor, _top_context);
+  TopCursorInitGroups(&_top_groups_cursor, _top_context);
+  return count;
+}
+
+void TopSetLimit(int limit)
+{
+  TopContextSetLimit(_top_default(), limit);
+}
+
+void TopSetMetrics(uint32_t metrics)
+{
+  TopContextSetMetrics(_top_default(), metrics);
+}
+
+void TopSetRankWeights(const double* weights)
+{
+  TopContextSetRankWeights(_top_default(), weights);
+}
+
+void TopSetWorkers(int workers)
+{
+  TopContextSetWorkers(_top_default(), workers);
+}
+
+void TopSetRankCpu(int rank_cpu)
+{
+  TopContextSetRankCpu(_top_default(), rank_cpu);
+}
+
+void TopSetHalfLife(double seconds)
+{
+  TopContextSetHalfLife(_top_default(), seconds);
+}
+
+int TopSortAll(void)
+{
+  int count = TopContextSortAll(_top_default());
+  TopCursorInit(&_top_cursor, _top_context);
+  TopCursorInitGroups(&_top_groups_cursor, _top_context);
+  return count;
+}
+
+uint32_t TopGetSyscalls(void)
+{
+  return TopContextGetSyscalls(_top_default());
+}
+
+/* Both walks start over once they have returned NULL, like before there were cursors. */
+const TopProcessSample_t* TopIterate(void)
+{
+  const TopProcessSample_t* sample = TopCursorNext(&_top_cursor);
+  if ((sample == NULL) && (_top_context != NULL))
+  {
+    TopCursorInit(&_top_cursor, _top_context);
+  }
+  return sample;
+}
+
+const TopProcessSample_t* TopIterateGroups(void)
+{
+  const TopProcessSample_t* sample = TopCursorNext(&_top_groups_cursor);
+  if ((sample == NULL) && (_top_context != NULL))
+  {
+    TopCursorInitGroups(&_top_groups_cursor, _top_context);
+  }
+  return sample;
+}
+
+int TopSampleThreads(pid_t pid, TopThreadSample_t* threads, int count)
+{
+  return TopContextSampleThreads(_top_default(), pid, threads, count);
+}
+
+TopProcessInfo_t* TopGetArgs(pid_t pid)
+{
+  return TopContextGetArgs(_top_default(), pid);
+}
+
+TopProcessInfo_t* TopGetArgSpans(pid_t pid)
+{
+  return TopContextGetArgSpans(_top_default(), pid);
+}
+
+int TopStartLifecycle(void)
+{
+  return TopContextStartLifecycle(_top_default());
+}
+
+int TopGetExited(double seconds, TopExitedSample_t* exited, int count)
+{
+  return TopContextGetExited(_top_default(), seconds, exited, count);
+}
+
+TopProcessSample_t* TopGetSample(pid_t pid)
+{
+  return TopContextGetSample(_top_default(), pid);
+}
+
+#ifdef TOP_BENCHMARK
+
+typedef struct _TopBenchNode _TopBenchNode_t;
+struct _TopBenchNode
+{
+  TopProcessSample_t sample;
+  rb_node(_TopBenchNode_t) node;
+};
+
+static int _top_bench_compare_pid(const _TopBenchNode_t *a, const _TopBenchNode_t *b)
+{
+  if (a->sample.pid < b->sample.pid) return -1;
+  if (a->sample.pid > b->sample.pid) return 1;
+  return 0;
+}
+
+static uint64_t _top_bench_nanos(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ((uint64_t)ts.tv_sec * NSEC_PER_SEC) + (uint64_t)ts.tv_nsec;
+}
+
+/* Synthetic pid space: sorted like proc_listallpids, and each round some processes exit and new ones start. */
+static pid_t _top_bench_pids(pid_t* pids, int count)
+{
+  pid_t next = 100;
+  for (int i=0; i<count; i++)
+  {
+    next += 1 + (pid_t)(i % 3);
+    pids[i] = next;
+  }
+  return next;
+}
+
+static pid_t* _top_bench_sources;
+static _TopProcessInfo_t** _top_bench_records;
+
+static void _top_bench_sample_pid(_TopWorker_t* worker, uint32_t index)
+{
+  _top_read_pid(worker, _top_bench_records[index], _top_bench_sources[index]);
+}
+
+static uint32_t _top_bench_syscalls(TopContext_t* ctx)
+{
+  uint32_t syscalls = 0;
+  for (uint32_t i=0; i<ctx->workers_count; i++)
+  {
+    syscalls += ctx->workers[i].syscalls;
+    ctx->workers[i].syscalls = 0;
+  }
+  return syscalls;
+}
+
+/* Synthetic population of count records, each one read from a real process so the cost per record is genuine. */
+static void _top_bench_workers(TopContext_t* ctx, int count)
+{
+  if (_top_context_open(ctx) != 0)
+  {
+    return;
+  }
+  _top_list_pids(ctx);
+  if (ctx->pids_count == 0)
+  {
+    return;
+  }
+  _top_bench_sources = (pid_t *)malloc(count*sizeof(pid_t));
+  _top_bench_records = (_TopProcessInfo_t **)malloc(count*sizeof(_TopProcessInfo_t *));
+  for (int i=0; i<count; i++)
+  {
+    _top_bench_sources[i] = ctx->pids[i % ctx->pids_count];
+    _top_bench_records[i] = _top_alloc(ctx);
+    _top_bench_records[i]->sample.pid = 100+i;
+  }
+
+  const int passes = 5;
+  // sweep past the online cpu count a little, the reads block in the kernel as well
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
+  workers = (workers < 4) ? 4 : ((workers > 16) ? 16 : workers);
+  double single = 0.0;
+  for (int w=1; w<=workers; w++)
+  {
+    _top_pool_resize(ctx, (uint32_t)w);
+    _top_pool_run(ctx, (uint32_t)count, _top_bench_sample_pid);
+    if (w == 1)
+    {
+      // the first pass fetches the static fields, the next ones only what changes
+      double first = (double)_top_bench_syscalls(ctx) / count;
+      _top_pool_run(ctx, (uint32_t)count, _top_bench_sample_pid);
+      double steady = (double)_top_bench_syscalls(ctx) / count;
+      fprintf(stderr, "TopBenchmark: %d processes, %.2f syscalls per process on the first sample, %.2f after\n", count, first, steady);
+    }
+    uint64_t start = _top_bench_nanos();
+    for (int p=0; p<passes; p++)
+    {
+      _top_pool_run(ctx, (uint32_t)count, _top_bench_sample_pid);
+    }
+    double ms = (double)(_top_bench_nanos() - start) / (1000000.0*passes);
+    if (w == 1)
+    {
+      single = ms;
+    }
+    fprintf(stderr, "TopBenchmark: %d processes, %2d workers, %.2f ms per pass (%.2fx)\n", count, w, ms, single/ms);
+  }
+  _top_pool_resize(ctx, 1);
+
+  for (int i=0; i<count; i++)
+  {
+    _top_free(ctx, _top_bench_records[i]);
+  }
+  free(_top_bench_records);
+  free(_top_bench_sources);
+}
+
+/* The copy per entry with a realloc each that TopGetArgs used to do, for comparison. */
+static char* _top_bench_args_copy(const char* data, uint32_t left, char* info, int* info_length, int* info_count)
+{
+  *info_length = 0;
+  *info_count = 0;
+  while (left > 0)
+  {
+    size_t length = strlen(data)+1;
+    if (length > 1)
+    {
+      *info_length += length;
+      info = realloc(info, *info_length+1);
+      (*info_count)++;
+      char *string = &info[*info_length-length];
+      memcpy(string, data, length);
+      string[length-1] = '\n';
+      string[length] = '\0';
+    }
+    data += length;
+    left -= length;
+  }
+  return info;
+}
+
+/* A 256 KB environment of 4096 variables, split and joined against the old copy per entry. */
+static void _top_bench_args(TopContext_t* ctx)
+{
+  const uint32_t size = 256*1024;
+  const uint32_t entries = 4096;
+  const int passes = 200;
+  if ((uint32_t)ctx->arg_max < size+1)
+  {
+    ctx->arg_max = size+1;
+    ctx->arg_buffer = (char *)realloc(ctx->arg_buffer, ctx->arg_max);
+  }
+  uint32_t entry = size/entries;
+  for (uint32_t i=0; i<entries; i++)
+  {
+    char* string = ctx->arg_buffer + (i*entry);
+    int length = snprintf(string, entry, "VARIABLE_%u=", i);
+    memset(string+length, 'x', entry-length-1);
+    string[entry-1] = '\0';
+  }
+  ctx->arg_buffer[size] = '\0';
+
+  char* info = NULL;
+  int length = 0, count = 0;
+  uint64_t start = _top_bench_nanos();
+  for (int p=0; p<passes; p++)
+  {
+    info = _top_bench_args_copy(ctx->arg_buffer, size, info, &length, &count);
+  }
+  uint64_t copy = _top_bench_nanos() - start;
+  free(info);
+
+  start = _top_bench_nanos();
+  for (int p=0; p<passes; p++)
+  {
+    uint32_t spans = 0;
+    _top_args_split(ctx, 0, size, UINT32_MAX, &spans);
+    count = (int)spans;
+  }
+  uint64_t split = _top_bench_nanos() - start;
+
+  info = NULL;
+  start = _top_bench_nanos();
+  for (int p=0; p<passes; p++)
+  {
+    uint32_t spans = 0;
+    _top_args_split(ctx, 0, size, UINT32_MAX, &spans);
+    info = _top_args_join(ctx->arg_buffer, ctx->arg_spans, (int)spans, info, &length);
+  }
+  uint64_t join = _top_bench_nanos() - start;
+  free(info);
+
+  fprintf(stderr, "TopBenchmark: %u KB environment, %d entries, copy per entry %.1f us, split %.1f us, split and join %.1f us (%.2fx)\n",
+          size/1024, count, (double)copy/(1000.0*passes), (double)split/(1000.0*passes), (double)join/(1000.0*passes), (double)copy/(double)join);
+}
+
+#ifdef __linux__
+static uint64_t _top_bench_children_nanos(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_CHILDREN, &usage);
+  return ((uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * NSEC_PER_SEC) +
+         ((uint64_t)(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * NSEC_PER_USEC);
+}
+
+static void _top_bench_burn(clockid_t clock, uint64_t burn)
+{
+  struct timespec ts;
+  do
+  {
+    clock_gettime(clock, &ts);
+  } while (((uint64_t)ts.tv_sec * NSEC_PER_SEC) + (uint64_t)ts.tv_nsec < burn);
+}
+
+/* Ends the process without the exit handlers of the benchmark, long after its leader thread. */
+static void* _top_bench_burn_thread(void* arg)
+{
+  _top_bench_burn(CLOCK_THREAD_CPUTIME_ID, *(const uint64_t *)arg);
+  _exit(0);
+}
+
+/* A child of the storm, reaped as soon as it exits. Some fork a grandchild first, and one burns on a second
+   thread after its leader thread has exited. */
+static void _top_bench_storm(int i, uint64_t burn)
+{
+  prctl(PR_SET_NAME, "top_storm", 0, 0, 0);
+  if ((i % 10) == 9)
+  {
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      _top_bench_burn(CLOCK_PROCESS_CPUTIME_ID, burn);
+      _exit(0);
+    }
+    if (pid > 0)
+    {
+      waitpid(pid, NULL, 0);
+    }
+  }
+  if (i == 0)
+  {
+    static uint64_t longer;
+    longer = 4*burn;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, _top_bench_burn_thread, &longer) == 0)
+    {
+      pthread_exit(NULL);
+    }
+  }
+  _top_bench_burn(CLOCK_PROCESS_CPUTIME_ID, burn);
+  _exit(0);
+}
+
+/* A fork storm of children that each burn a few ms and exit well within one sample interval, run by a
+   process that reaps every child right away. What the exits fold into must add up to the cpu the storm
+   burned, whether their exits were read in time or accounted through the parents. */
+static void _top_bench_lifecycle(void)
+{
+  const int children = 200;
+  const uint64_t burn = 5*NSEC_PER_MSEC;
+
+  TopContext_t* ctx = TopContextCreate();
+  if (ctx == NULL)
+  {
+    return;
+  }
+  if (TopContextStartLifecycle(ctx) != 0)
+  {
+    fprintf(stderr, "TopBenchmark: lifecycle events unavailable (%s)\n", strerror(errno));
+    TopContextDestroy(ctx);
+    return;
+  }
+  // the reaped children totals of the listed processes count from this sample on
+  TopContextSample(ctx);
+  uint64_t burned = _top_bench_children_nanos();
+
+  pid_t runner = fork();
+  if (runner == 0)
+  {
+    prctl(PR_SET_NAME, "top_runner", 0, 0, 0);
+    for (int i=0; i<children; i++)
+    {
+      pid_t pid = fork();
+      if (pid == 0)
+      {
+        _top_bench_storm(i, burn);
+      }
+      if (pid > 0)
+      {
+        waitpid(pid, NULL, 0);
+      }
+    }
+    _exit(0);
+  }
+  if (runner > 0)
+  {
+    waitpid(runner, NULL, 0);
+  }
+  burned = _top_bench_children_nanos() - burned;
+
+  // the events are read on the lifecycle thread, give it a moment to drain the socket
+  usleep(100000);
+  TopContextSample(ctx);
+
+  // the storm, the runner and what this process reaped without an exit to explain it
+  char self[TOP_MAX_SAMPLE_NAME_SIZE+1] = "";
+  prctl(PR_GET_NAME, self, 0, 0, 0);
+  TopExitedSample_t exited[64];
+  int count = TopContextGetExited(ctx, TOP_EXITED_SECONDS, exited, 64);
+  uint32_t exits = 0;
+  uint64_t folded = 0;
+  for (int i=0; i<count; i++)
+  {
+    if ((strcmp(exited[i].name, "top_storm") == 0) || (strcmp(exited[i].name, "top_runner") == 0) || (strcmp(exited[i].name, self) == 0))
+    {
+      exits += exited[i].count;
+      folded += exited[i].total_timens;
+    }
+  }
+  uint64_t error = (folded > burned) ? folded - burned : burned - folded;
+  boolean_t passed = (error <= (burned/10) + (2*_top_tick_nanos));
+  fprintf(stderr, "TopBenchmark: fork storm burned %.1f ms in %d processes, %u exits seen and %u missed, %.1f ms folded %s\n",
+          (double)burned/NSEC_PER_MSEC, children + (children/10) + 1, exits, ctx->exits_missed, (double)folded/NSEC_PER_MSEC,
+          passed ? "passed" : "FAILED");
+  TopContextDestroy(ctx);
+}
+#endif
+
+// runs on a context of its own, so it leaves the one of TopInit alone
+void TopBenchmark(void)
+{
+  TopContext_t* ctx = _top_context_new();
+  if (ctx == NULL)
+  {
+    return;
+  }
+
+  const int count = 20000;
+  const int rounds = 200;
+  const int churn = 500;
+
+  pid_t* pids = (pid_t *)malloc(count*sizeof(pid_t));
+  int* victims = (int *)malloc(rounds*churn*sizeof(int));
+  srandom(42);
+  for (int i=0; i<rounds*churn; i++)
+  {
+    victims[i] = (int)(random() % count);
+  }
+
+  // rb.h tree with a calloc/free per process, as before
+  rb_tree(_TopBenchNode_t) tree;
+  rb_tree_new(&tree, node);
+  pid_t next = _top_bench_pids(pids, count);
+  uint64_t start = _top_bench_nanos();
+  for (int i=0; i<count; i++)
+  {
+    _TopBenchNode_t* pnode = (_TopBenchNode_t *)calloc(1, sizeof(_TopBenchNode_t));
+    pnode->sample.pid = pids[i];
+    rb_node_new(&tree, pnode, node);
+    rb_insert(&tree, pnode, _top_bench_compare_pid, _TopBenchNode_t, node);
+  }
+  for (int r=0; r<rounds; r++)
+  {
+    for (int i=0; i<count; i++)
+    {
+      _TopBenchNode_t* found, key;
+      key.sample.pid = pids[i];
+      rb_search(&tree, &key, _top_bench_compare_pid, node, found);
+      found->sample.sequence = (uint32_t)r;
+    }
+    for (int c=0; c<churn; c++)
+    {
+      int k = victims[(r*churn)+c];
+      _TopBenchNode_t* found, key;
+      key.sample.pid = pids[k];
+      rb_search(&tree, &key, _top_bench_compare_pid, node, found);
+      rb_remove(&tree, found, _TopBenchNode_t, node);
+      free(found);
+      pids[k] = ++next;
+      _TopBenchNode_t* pnode = (_TopBenchNode_t *)calloc(1, sizeof(_TopBenchNode_t));
+      pnode->sample.pid = pids[k];
+      rb_node_new(&tree, pnode, node);
+      rb_insert(&tree, pnode, _top_bench_compare_pid, _TopBenchNode_t, node);
+    }
+  }
+  uint64_t rb = _top_bench_nanos() - start;
+  for (int i=0; i<count; i++)
+  {
+    _TopBenchNode_t* found, key;
+    key.sample.pid = pids[i];
+    rb_search(&tree, &key, _top_bench_compare_pid, node, found);
+    rb_remove(&tree, found, _TopBenchNode_t, node);
+    free(found);
+  }
+
+  // open addressing index with slab records
+  _top_index_init(ctx);
+  next = _top_bench_pids(pids, count);
+  start = _top_bench_nanos();
+  for (int i=0; i<count; i++)
+  {
+    _TopProcessInfo_t* pinfo = _top_alloc(ctx);
+    pinfo->sample.pid = pids[i];
+    _top_insert(ctx, pinfo);
+  }
+  for (int r=0; r<rounds; r++)
+  {
+    for (int i=0; i<count; i++)
+    {
+      _top_search(ctx, pids[i])->sample.sequence = (uint32_t)r;
+    }
+    for (int c=0; c<churn; c++)
+    {
+      int k = victims[(r*churn)+c];
+      _top_destroy(ctx, _top_search(ctx, pids[k]));
+      pids[k] = ++next;
+      _TopProcessInfo_t* pinfo = _top_alloc(ctx);
+      pinfo->sample.pid = pids[k];
+      _top_insert(ctx, pinfo);
+    }
+  }
+  uint64_t hash = _top_bench_nanos() - start;
+  while (ctx->records_count > 0)
+  {
+    _top_destroy(ctx, ctx->records[0]);
+  }
+
+  fprintf(stderr, "TopBenchmark: %d pids, %d rounds with %d exits, rb tree %.1f ns, hash %.1f ns per lookup (%.2fx)\n",
+          count, rounds, churn, (double)rb/((double)rounds*count), (double)hash/((double)rounds*count), (double)rb/(double)hash);
+
+  _top_bench_workers(ctx, count);
+  _top_bench_args(ctx);
+  TopContextDestroy(ctx);
+#ifdef __linux__
+  _top_bench_lifecycle();
+#endif
+
+  free(victims);
+  free(pids);
+}
+#endif
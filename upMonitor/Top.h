@@ -23,12 +23,44 @@
 #ifndef Top_h
 #define Top_h
 
+#include <stdint.h>
 #include <sys/types.h>
 
 __BEGIN_DECLS
 
+//#define TOP_BENCHMARK
+#ifdef TOP_BENCHMARK
+  #warning "TOP_BENCHMARK !"
+#endif
+
 #define TOP_MAX_SAMPLE_NAME_SIZE (128)
 #define TOP_MAX_INFO_NAME_SIZE (4096)
+#define TOP_MAX_THREAD_NAME_SIZE (64)
+#define TOP_HISTORY_SIZE (16)
+#define TOP_EXITED_SECONDS (64)   // the longest window TopGetExited looks back over, in seconds
+
+// metrics beyond cpu, each only collected while asked for with TopSetMetrics or a rank weight
+#define TOP_METRIC_MEMORY (1u<<0)   // resident and footprint
+#define TOP_METRIC_DISK   (1u<<1)   // disk read and write rates
+
+// keys a sample ranks on, each normalized to its largest value in the sample before weighting
+enum TopRankKey
+{
+  TOP_RANK_CPU = 0,
+  TOP_RANK_RESIDENT,
+  TOP_RANK_FOOTPRINT,
+  TOP_RANK_DISK_READ,
+  TOP_RANK_DISK_WRITE,
+  TOP_RANK_KEYS,
+};
+
+// the cpu TOP_RANK_CPU stands for
+enum TopRankCpu
+{
+  TOP_CPU_LAST = 0,       // the latest interval alone
+  TOP_CPU_SMOOTH,         // cpu_smooth
+  TOP_CPU_PEAK,           // cpu_peak
+};
 
 typedef struct TopProcessSample TopProcessSample_t;
 struct TopProcessSample
@@ -40,14 +72,62 @@ struct TopProcessSample
   uint32_t status;
   uint32_t flags;
   char     name[TOP_MAX_SAMPLE_NAME_SIZE+1];
+  uint64_t start_timens;  // nanoseconds since boot on linux, since the epoch on darwin
+  uint32_t generation;    // changes whenever the pid belongs to a new process, caches keyed by pid compare it
   double   cpu;
+  double   cpu_tree;      // cpu of the process and all of its descendants
+  uint32_t count_tree;    // processes in that subtree, the process included
+  double   score;         // weighted rank, the cpu itself while ranking on cpu alone
+  double   cpu_smooth;    // moving average of cpu, with the half-life of TopSetHalfLife
+  double   cpu_peak;      // busiest interval in cpu_history
+  float    cpu_history[TOP_HISTORY_SIZE];  // ring of the latest intervals, read it with TopGetHistory
+  uint8_t  history_head;
+  uint8_t  history_count;
+
+  uint64_t resident;      // bytes, TOP_METRIC_MEMORY
+  uint64_t footprint;     // bytes, phys_footprint on darwin, resident minus shared pages on linux
+  double   disk_read;     // bytes per second, TOP_METRIC_DISK
+  double   disk_write;
 
   uint32_t sequence;
   uint32_t sequence_last;
-  double   usage_last;
   
   uint64_t total_timens;
   uint64_t p_total_timens;
+  uint64_t disk_read_total;
+  uint64_t disk_write_total;
+};
+
+// processes of one name that exited within a window, summed over their last interval or whole short life;
+// exits that could not be read, and on darwin every process no sample listed, are only known through their
+// parent, they are summed under the name of the parent that reaped them and not counted
+typedef struct TopExitedSample TopExitedSample_t;
+struct TopExitedSample
+{
+  char     name[TOP_MAX_SAMPLE_NAME_SIZE+1];
+  uint32_t count;         // exits seen
+  double   cpu;           // their cpu time over the window, in % of one core like TopProcessSample_t.cpu
+  uint64_t total_timens;
+};
+
+typedef struct TopThreadSample TopThreadSample_t;
+struct TopThreadSample
+{
+  uint64_t tid;           // kernel thread id on linux, the libproc thread handle on darwin
+  char     name[TOP_MAX_THREAD_NAME_SIZE+1];
+  int32_t  priority;
+  uint32_t state;         // the proc(5) state letter on linux, TH_STATE_* on darwin
+  double   cpu;
+
+  uint64_t total_timens;
+};
+
+// one NUL terminated string of TopProcessInfo.buffer
+typedef struct TopSpan TopSpan_t;
+struct TopSpan
+{
+  uint32_t offset;
+  uint32_t length;
 };
 
 typedef struct TopProcessInfo TopProcessInfo_t;
@@ -56,6 +136,7 @@ struct TopProcessInfo
   char* name;
   char* command;
 
+  // every argument and environment entry joined with newlines, only filled in by the Get*Args calls
   char* args_info;
   int args_count;
   int args_length;
@@ -63,15 +144,104 @@ struct TopProcessInfo
   char* envs_info;
   int envs_count;
   int envs_length;
+
+  // the raw argument area as read, args_count and envs_count spans into it, empty entries skipped
+  const char* buffer;
+  const TopSpan_t* args;
+  const TopSpan_t* envs;
+};
+
+// A sampler with all of its state. Separate contexts may sample side by side on their own threads, each one
+// at its own interval and with its own settings; the calls on a single context must not overlap, except for
+// the setters, which any thread may call and the next sample picks up. A thread that wants the arguments of
+// a process while another one samples uses a context of its own for them.
+typedef struct TopContext TopContext_t;
+
+// A walk over the ranked processes, or the group roots, of the latest sample of a context. It only reads the
+// context, so any number of cursors may walk the same snapshot from different threads without a lock, as
+// long as the context does not sample meanwhile. A cursor left behind by a newer sample ends its walk.
+typedef struct TopCursor TopCursor_t;
+struct TopCursor
+{
+  const TopContext_t* context;
+  uint32_t version;
+  uint32_t index;
+  uint32_t groups;
 };
 
+// takes the first sample as well, NULL when the process table can not be read
+TopContext_t* TopContextCreate(void);
+void TopContextDestroy(TopContext_t* context);
+int TopContextSample(TopContext_t* context);
+void TopContextSetLimit(TopContext_t* context, int limit);
+void TopContextSetMetrics(TopContext_t* context, uint32_t metrics);
+void TopContextSetRankWeights(TopContext_t* context, const double* weights);
+void TopContextSetWorkers(TopContext_t* context, int workers);
+void TopContextSetRankCpu(TopContext_t* context, int rank_cpu);
+void TopContextSetHalfLife(TopContext_t* context, double seconds);
+int TopContextSortAll(TopContext_t* context);
+uint32_t TopContextGetSyscalls(const TopContext_t* context);
+TopProcessSample_t* TopContextGetSample(TopContext_t* context, pid_t pid);
+int TopContextSampleThreads(TopContext_t* context, pid_t pid, TopThreadSample_t* threads, int count);
+TopProcessInfo_t* TopContextGetArgs(TopContext_t* context, pid_t pid);
+// only the spans, without the copies into args_info and envs_info
+TopProcessInfo_t* TopContextGetArgSpans(TopContext_t* context, pid_t pid);
+int TopContextStartLifecycle(TopContext_t* context);
+int TopContextGetExited(TopContext_t* context, double seconds, TopExitedSample_t* exited, int count);
+
+void TopCursorInit(TopCursor_t* cursor, const TopContext_t* context);
+void TopCursorInitGroups(TopCursor_t* cursor, const TopContext_t* context);
+const TopProcessSample_t* TopCursorNext(TopCursor_t* cursor);
+
+// The calls below work on a single context of their own, for the one sampler an app usually needs.
 int TopInit(void);
+// releases that context, TopInit may set it up again
+void TopFini(void);
 int TopSample(void);
+// TopSample only ranks the first limit processes for TopIterate, 0 ranks them all
+void TopSetLimit(int limit);
+// TOP_METRIC_* collected besides cpu, the default 0 keeps TopSample as cheap as cpu alone
+void TopSetMetrics(uint32_t metrics);
+// TopSample ranks on the weighted sum of the TOP_RANK_* keys, NULL restores cpu alone
+void TopSetRankWeights(const double* weights);
+// ranks every live process of the latest sample, for the rare consumer that needs the full order
+int TopSortAll(void);
+// spreads the per process reads of TopSample over this many threads, including the sampling one
+void TopSetWorkers(int workers);
+// TOP_CPU_* to rank on, TOP_CPU_LAST by default
+void TopSetRankCpu(int rank_cpu);
+// half-life of cpu_smooth, 5 seconds by default, 0 follows the latest interval
+void TopSetHalfLife(double seconds);
+// watches process exits as they happen, so the cpu of processes that live shorter than a sample interval is
+// counted as well: the proc connector on linux, which needs CAP_NET_ADMIN; on darwin kqueue NOTE_EXIT for the
+// processes a sample has listed. The cpu of the children the parents reaped covers the exits neither saw;
+// returns 0, or -1 with errno when exits can not be watched
+int TopStartLifecycle(void);
+// copies the busiest names of the processes that exited in the last seconds, up to TOP_EXITED_SECONDS, as
+// folded in by the samples so far; returns the number copied
+int TopGetExited(double seconds, TopExitedSample_t* exited, int count);
+// copies up to count of the latest cpu intervals of a sample, oldest first, for a sparkline; returns the number
+int TopGetHistory(const TopProcessSample_t* sample, float* values, int count);
+// system calls made by the latest TopSample, listing included
+uint32_t TopGetSyscalls(void);
 const TopProcessSample_t* TopIterate(void);
+// the group roots of the latest sample instead, best cpu_tree first: every process started by launchd/init
+// heads a group with all of its helpers, limited like TopIterate
+const TopProcessSample_t* TopIterateGroups(void);
+// samples every thread of pid and copies the busiest count of them, cpu% is measured against the previous
+// call for the same pid; returns the number copied
+int TopSampleThreads(pid_t pid, TopThreadSample_t* threads, int count);
+// shared by every context and never blocks: NULL while the name of a uid is still being looked up, or when
+// it has no account
 const char* TopGetUsername(uid_t a_uid);
 TopProcessInfo_t* TopGetArgs(pid_t pid);
+TopProcessInfo_t* TopGetArgSpans(pid_t pid);
 TopProcessSample_t* TopGetSample(pid_t pid);
 
+#ifdef TOP_BENCHMARK
+void TopBenchmark(void);
+#endif
+
 __END_DECLS
 
 #endif /* Top_h */